@@ -0,0 +1,122 @@
+#!/bin/sh
+#
+# Throughput sweep for m2m, run by "make bench".
+#
+# Decodes a synthetic stream of fixed size access units once per combination
+# of device, i/o method, buffer count and resolution, and appends one JSON
+# object per run to $BENCH_OUT. Failed runs are recorded too, so a
+# configuration that stops working shows up as a regression.
+#
+# Everything is set from the environment:
+#   BENCH_DEVICES   devices to run on; mock specs get the resolution appended,
+#                   real decoders (e.g. /dev/video10) decode BENCH_INPUT as is
+#   BENCH_IO        i/o methods, any of m u r
+#   BENCH_BUFFERS   -b arguments
+#   BENCH_SINKS     where frames go: none, or null to export them as dmabufs
+#                   with -e null (memory mapped i/o only)
+#   BENCH_SIZES     WxH, mock devices only
+#   BENCH_INPUT     input stream, generated if missing
+#   BENCH_FRAMES    access units in a generated stream
+#   BENCH_AU_SIZE   bytes per generated access unit
+#   BENCH_OUT       results, one JSON object per line
+#   BENCH_CONVERT   1 to also time the -X conversion kernels at BENCH_SIZES
+#
+# The generated stream is an Annex-B start code followed by a constant
+# payload, so every run sees byte-identical input. Only the mock can decode
+# it; vicodec and vim2m don't take H.264, so pass them a stream they do.
+
+M2M=${M2M:-./m2m}
+BENCH_DEVICES=${BENCH_DEVICES:-mock:latency=2000,reorder=2}
+BENCH_IO=${BENCH_IO:-m u}
+BENCH_BUFFERS=${BENCH_BUFFERS:-2,2 4,4 8,4}
+BENCH_SINKS=${BENCH_SINKS:-none null}
+BENCH_SIZES=${BENCH_SIZES:-640x480 1920x1080 3840x2160}
+BENCH_INPUT=${BENCH_INPUT:-bench.h264}
+BENCH_FRAMES=${BENCH_FRAMES:-1000}
+BENCH_AU_SIZE=${BENCH_AU_SIZE:-4096}
+BENCH_OUT=${BENCH_OUT:-bench.jsonl}
+BENCH_CONVERT=${BENCH_CONVERT:-1}
+
+metrics=$(mktemp) || exit 1
+trap 'rm -f "$metrics"' EXIT
+
+if [ ! -e "$BENCH_INPUT" ]; then
+    i=0
+    while [ $i -lt "$BENCH_FRAMES" ]; do
+        printf '\000\000\000\001\145\210'
+        head -c "$BENCH_AU_SIZE" /dev/zero | tr '\000' '\125'
+        i=$((i + 1))
+    done > "$BENCH_INPUT"
+fi
+
+# Pull a top level number out of the metrics; the first match is the top level one.
+field() {
+    grep -o "\"$1\":[0-9.]*" "$metrics" | head -n 1 | cut -d: -f2
+}
+
+# sh has no locals, so the arguments go in r_* to leave the loop variables alone.
+run() {
+    r_dev=$1 r_io=$2 r_bufs=$3 r_size=$4 r_sink=$5
+
+    if [ "$r_sink" = none ]; then
+        r_export=
+    else
+        r_export="-e $r_sink"
+    fi
+
+    : > "$metrics"
+    if "$M2M" -q -d "$r_dev" -$r_io -b "$r_bufs" $r_export -i "$BENCH_INPUT" -j json -P "$metrics" &&
+       [ -s "$metrics" ]; then
+        seconds=$(field seconds)
+        cpu=$(field cpu_seconds)
+        frames=$(field frames)
+        rss=$(field max_rss_kb)
+        p50=$(field p50)
+        p99=$(field p99)
+        max=$(field max)
+        awk -v dev="$r_dev" -v io="$r_io" -v bufs="$r_bufs" -v size="$r_size" -v sink="$r_sink" \
+            -v s="$seconds" -v cpu="$cpu" -v n="$frames" -v rss="$rss" \
+            -v p50="$p50" -v p99="$p99" -v max="$max" 'BEGIN {
+            printf "{\"device\":\"%s\",\"io\":\"%s\",\"buffers\":\"%s\",\"size\":\"%s\",\"sink\":\"%s\",", dev, io, bufs, size, sink
+            printf "\"status\":\"ok\",\"frames\":%d,\"seconds\":%.6f,", n, s
+            printf "\"fps\":%.2f,\"cpu_ms_per_frame\":%.4f,\"max_rss_kb\":%d,", n ? n / s : 0, n ? cpu * 1e3 / n : 0, rss
+            printf "\"latency_ms\":{\"p50\":%.3f,\"p99\":%.3f,\"max\":%.3f}}\n", p50, p99, max
+        }'
+    else
+        printf '{"device":"%s","io":"%s","buffers":"%s","size":"%s","sink":"%s","status":"failed"}\n' \
+            "$r_dev" "$r_io" "$r_bufs" "$r_size" "$r_sink"
+    fi
+}
+
+for dev in $BENCH_DEVICES; do
+    case $dev in
+    mock*)  sizes=$BENCH_SIZES ;;
+    *)      sizes=stream ;;
+    esac
+    for size in $sizes; do
+        spec=$dev
+        if [ "$size" != stream ]; then
+            case $dev in
+            mock)   spec=mock: ;;
+            *)      spec=$dev, ;;
+            esac
+            spec="${spec}width=${size%x*},height=${size#*x}"
+        fi
+        for io in $BENCH_IO; do
+            for bufs in $BENCH_BUFFERS; do
+                for sink in $BENCH_SINKS; do
+                    # Only memory mapped buffers can be exported.
+                    if [ "$sink" != none ] && [ "$io" != m ]; then
+                        continue
+                    fi
+                    run "$spec" "$io" "$bufs" "$size" "$sink"
+                done
+            done
+        done
+    done
+done | tee -a "$BENCH_OUT"
+
+# The conversions run on synthetic frames in process, so no device is needed.
+if [ "$BENCH_CONVERT" = 1 ]; then
+    "$M2M" -B "$(echo $BENCH_SIZES | tr ' ' ',')" | tee -a "$BENCH_OUT"
+fi
@@ -7,26 +7,75 @@
  * see https://linuxtv.org/docs.php for more information
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
 #include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
 
 #include <getopt.h>         /* getopt_long() */
 
 #include <fcntl.h>          /* low-level i/o */
+#include <limits.h>
 #include <unistd.h>
 #include <errno.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/resource.h>
+#include <signal.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
-
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include <linux/dma-buf.h>
+#include <linux/udmabuf.h>
 #include <linux/videodev2.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "mockdev.h"
+#include "trace.h"
+#include "pack.h"
+#include "uring.h"
+
 #define CLEAR(x) memset(&(x), 0, sizeof(x))
-#define FMT_NUM_PLANES 1
+
+#define AU_INDEX_MAGIC   0x5844494d /* "MIDX" */
+#define AU_INDEX_VERSION 2
+#define AU_INDEX_CHUNK   (1 << 20)
+#define AU_FLAG_KEYFRAME 0x01
+/* Must be a power of two larger than VIDEO_MAX_FRAME. */
+#define WRITER_RING_SIZE 64
+/* AUs that can be in flight through the decoder, a power of two */
+#define LATENCY_RING_SIZE 256
+
+/* Input read ahead by -U, in chunks of READAHEAD_CHUNK bytes */
+#define READAHEAD_CHUNK  (1 << 20)
+#define READAHEAD_CHUNKS 4
+
+/* Bytes needed past a start code prefix to classify the NAL unit. */
+#define NAL_LOOKAHEAD    6
+
+enum codec {
+    CODEC_H264,
+    CODEC_HEVC,
+};
 
 enum io_method {
     IO_METHOD_READ,
@@ -37,30 +86,310 @@ enum io_method {
 struct buffer {
     void   *start;
     size_t  length;
+    int     dmabuf_fd;
 };
 
 struct buffer_mp {
-    void   *start[FMT_NUM_PLANES];
-    size_t  length[FMT_NUM_PLANES];
+    void   *start[VIDEO_MAX_PLANES];
+    size_t  length[VIDEO_MAX_PLANES];
+    int     dmabuf_fd[VIDEO_MAX_PLANES];
+    unsigned int num_planes;
+};
+
+/*
+ * USERPTR buffers for both queues, carved out of one arena per session. The
+ * arena is reserved address space that is only backed as it is used, either
+ * by anonymous memory with transparent huge pages or by a hugetlb memfd.
+ * A queue that is reallocated releases its old pages and puts their range on
+ * the free list, sorted and merged, for later buffers to be carved from.
+ */
+struct pool_range {
+    size_t          start;
+    size_t          end;
+};
+
+struct buffer_pool {
+    unsigned char  *base;
+    size_t          size;
+    size_t          used;       /* everything from here on is free */
+    struct pool_range *free;
+    unsigned int    n_free;
+    unsigned int    free_alloc;
+    size_t          mapped;     /* bytes of memfd mapped so far */
+    int             anon_rest;  /* hugetlb ran out, past mapped is anonymous memory */
+    size_t          huge;       /* huge page size */
+    int             memfd;      /* hugetlb backing, -1 for anonymous memory */
+};
+
+#define POOL_RESERVE    ((size_t)(sizeof(void *) > 4 ? 4096 : 768) << 20)
+
+/*
+ * Consumer of exported CAPTURE buffers. frame() returns non-zero if the sink
+ * holds on to the buffer; it is then requeued from release(), which is called
+ * whenever sink_fd is readable. flush() must get every held buffer back and
+ * make the consumer drop its imports before the buffers are freed.
+ */
+struct session;
+
+struct frame_sink {
+    const char *name;
+    void (*open)(struct session *s, const char *arg);
+    int  (*frame)(struct session *s, const struct v4l2_buffer *buf,
+                  const int *fds, unsigned int n_fds);
+    void (*release)(struct session *s);
+    void (*flush)(struct session *s);
+    void (*close)(struct session *s);
+};
+
+/*
+ * Message sent with SCM_RIGHTS by the unix sink, one dmabuf fd per plane.
+ * The consumer returns a uint32_t buffer index once it is done with a frame,
+ * and DMABUF_RELEASE_ALL after dropping its imports in reply to a flush.
+ */
+#define DMABUF_MSG_FRAME   1
+#define DMABUF_MSG_FLUSH   2
+#define DMABUF_RELEASE_ALL UINT32_MAX
+
+struct dmabuf_msg {
+    uint32_t type;
+    uint32_t index;
+    uint32_t width;
+    uint32_t height;
+    uint32_t pixelformat;
+    uint32_t num_planes;
+    uint32_t bytesused[VIDEO_MAX_PLANES];
+    uint32_t bytesperline[VIDEO_MAX_PLANES];
+    uint32_t sequence;
+    uint32_t reserved;
+    uint64_t timestamp_us;
+};
+
+/* Dequeued CAPTURE buffer handed to the writer thread */
+struct writer_job {
+    struct v4l2_buffer buf;
+    struct v4l2_plane  planes[VIDEO_MAX_PLANES];
+};
+
+/* Submit time of the AU whose OUTPUT buffer carried timestamp tag seq */
+struct au_submit {
+    uint64_t seq;
+    uint64_t submit_ns;
+};
+
+/* On-disk access unit index, stored next to the input as <infile>.auidx */
+struct au_index_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t codec;         /* enum codec the AUs were delimited for */
+    uint32_t reserved;
+    uint64_t file_size;
+    int64_t  file_mtime_sec;
+    int64_t  file_mtime_nsec;
+    uint64_t count;
+};
+
+struct au_entry {
+    uint64_t offset;
+    uint32_t size;
+    uint8_t  nal_type;      /* type of the first VCL NAL unit */
+    uint8_t  flags;         /* AU_FLAG_* */
+    uint16_t reserved;
+};
+
+/* Access unit currently being delimited */
+struct au_state {
+    int     first_vcl;      /* NAL type of the first VCL NAL unit, -1 if none */
+    int     keyframe;
 };
 
-static char            *dev_name;
-static enum io_method   io = IO_METHOD_MMAP;
-static int              fd = -1;
-struct buffer          *buffers;
-struct buffer          *buffers_out;
-struct buffer_mp       *buffers_mp;
-struct buffer_mp       *buffers_mp_out;
-static unsigned int     n_buffers;
-static unsigned int     n_buffers_out;
-static int              m2m_enabled;
-static int              multi_planar;
-static char            *out_filename;
-static FILE            *out_fp;
-static int              force_format;
-static int              frame_count = 70;
-static char            *in_filename;
-static FILE            *in_fp;
+/* One decoder instance: a device, its buffers, input, output and sink. */
+struct session {
+    char               *dev_name;
+    enum io_method      io;
+    int                 fd;
+    int                 mock;           /* fd is a mockdev.c device */
+    int                 replay;         /* fd replays a trace.c trace */
+    int                 wait_fd;        /* what epoll watches for fd */
+    struct buffer      *buffers;
+    struct buffer      *buffers_out;
+    struct buffer_mp   *buffers_mp;
+    struct buffer_mp   *buffers_mp_out;
+    unsigned int        n_buffers;
+    unsigned int        n_buffers_out;
+    int                 m2m_enabled;
+    int                 multi_planar;
+    char               *out_filename;
+    FILE               *out_fp;
+    unsigned long       f_offset;
+    int                 force_format;
+    enum codec          codec;
+    int                 codec_forced;
+    int                 frame_count;
+    char               *in_filename;
+    FILE               *in_fp;
+    int                 map_input;
+    const unsigned char *in_map;
+    size_t              in_map_len;
+    size_t              in_map_pos;
+    unsigned long long  in_bytes_scanned;
+    unsigned long long  in_bytes_delivered;
+    int                 use_index;
+    long                start_au;
+    long                end_au;         /* first AU not to decode, -1 for all */
+    unsigned int        gop_split;      /* -G: decode as this many sessions */
+    unsigned int        gop_part;       /* which of them this is */
+    unsigned int        gop_parts;
+    char               *gop_output;     /* where the parts' frames are merged */
+    const unsigned char *param_sets;    /* put in front of the first AU */
+    size_t              param_sets_len;
+    unsigned char      *param_sets_buf; /* param_sets, when this session owns them */
+    int                 param_sets_sent;
+    unsigned int        keyframe_every; /* -K n: every nth keyframe only */
+    double             *keyframe_times; /* -K @t,...: the keyframe nearest each, in s */
+    size_t              n_keyframe_times;
+    double              fps;            /* to place keyframe_times */
+    size_t             *au_pick;        /* AUs to decode, instead of all from au_next */
+    size_t              au_pick_count;
+    size_t              au_pick_next;
+    struct au_entry    *au_index;
+    size_t              au_count;
+    size_t              au_alloc;
+    size_t              au_next;
+    size_t              au_sent;        /* of the next AU, when it needs more than one buffer */
+    void               *au_index_map;
+    size_t              au_index_map_len;
+    int                 use_writer;
+    pthread_t           writer_thread;
+    sem_t               writer_sem;
+    struct writer_job   writer_ring[WRITER_RING_SIZE];
+    unsigned int        writer_head;    /* only written by the main loop */
+    unsigned int        writer_tail;    /* only written by the writer */
+    int                 use_uring;      /* 1 for io_uring, 2 for its thread fallback */
+    struct uring       *uring;
+    struct writer_job   uring_jobs[VIDEO_MAX_FRAME];    /* CAPTURE buffers being written */
+    unsigned int        uring_pending[VIDEO_MAX_FRAME]; /* their writes in flight */
+    unsigned int        uring_writes;   /* all writes in flight */
+    unsigned int        uring_cap_base; /* registered buffer of CAPTURE buffer 0, plane 0 */
+    unsigned int        uring_cap_planes;
+    unsigned int        uring_cap_registered;   /* CAPTURE buffers with registered planes */
+    uint64_t            out_offset;     /* where the next frame is written */
+    int                 pack;           /* -p: 1 to write visible pixels only, 2 non-temporally */
+    uint32_t            convert;        /* -X: pixel format to write instead, 0 for none */
+    unsigned int        convert_scale;
+    int                 pack_ok;        /* pack_layout fits the CAPTURE format */
+    struct pack_layout  pack_layout;
+    unsigned char      *pack_bufs[VIDEO_MAX_FRAME];    /* packed frames; with -U one per buffer */
+    unsigned char      *ra_chunks;      /* READAHEAD_CHUNKS read buffers */
+    int                 ra_result[READAHEAD_CHUNKS];    /* bytes read, or -errno */
+    unsigned char       ra_busy[READAHEAD_CHUNKS];
+    int                 ra_fixed;       /* chunks are registered buffers 0.. */
+    int                 ra_started;
+    int                 ra_eof;         /* a chunk came back short, read no further */
+    unsigned int        ra_head;        /* chunks submitted */
+    unsigned int        ra_tail;        /* chunks copied into the window */
+    uint64_t            ra_next;        /* file offset of the next chunk */
+    unsigned char      *ra_win;         /* contiguous input that AUs are delimited in */
+    size_t              ra_win_size;
+    size_t              ra_win_pos;
+    size_t              ra_win_len;
+    uint64_t            ra_win_offset;  /* file offset of ra_win[0] */
+    int                 threaded;       /* -t: OUTPUT and CAPTURE served by threads */
+    int                 feeder_cpu;     /* -1 to leave unpinned */
+    int                 drainer_cpu;
+    pthread_t           feeder_thread;
+    pthread_t           drainer_thread;
+    pthread_mutex_t     feed_lock;      /* held across source changes and DECODER_CMD */
+    int                 done_fd;        /* eventfd, readable once the drainer is done */
+    int                 doorbell[2];    /* eventfds waking each thread for a mock or replay */
+    uint32_t            pseudo_events;  /* mock or replay events not taken yet */
+    int                 thread_gone[2];
+    const struct frame_sink *sink;
+    char               *sink_arg;
+    int                 sink_fd;
+    unsigned int        sink_held;
+    struct v4l2_format  cap_fmt;
+    struct v4l2_format  out_fmt;
+    struct buffer_pool  pool;
+    int                 pool_hugetlb;
+    unsigned int        out_planes;     /* OUTPUT planes per buffer in MPLANE mode */
+    enum v4l2_memory    out_memory;
+    char               *producer_path;
+    struct buffer      *buffers_dmabuf_out;
+    int                 producer_fd;
+    uint32_t            out_cookies[VIDEO_MAX_FRAME];
+    int                 cap_count;      /* 0 = from V4L2_CID_MIN_BUFFERS_FOR_* */
+    int                 out_count;
+    unsigned int        buf_headroom;
+    int                 grow_buffers;
+    unsigned int        cap_queued;     /* CAPTURE buffers owned by the driver */
+    int                 cap_starved;
+    uint64_t            out_seq;        /* AUs queued, tags OUTPUT timestamps */
+    struct au_submit    submits[LATENCY_RING_SIZE];
+    uint64_t            max_seq_out;    /* highest tag seen on CAPTURE */
+    uint32_t           *lat_us;         /* per frame submit to dequeue latency */
+    uint32_t           *reorder;        /* per frame reorder depth */
+    size_t              lat_count;
+    size_t              lat_alloc;
+    uint32_t            lat_p50_us;     /* summary kept for the metrics */
+    uint32_t            lat_p99_us;
+    uint32_t            lat_max_us;
+    struct timespec     src_change_ts;  /* when the last source change arrived */
+    int                 src_change_pending;
+    int                 frames;         /* CAPTURE frames dequeued so far */
+    unsigned int        out_queued;     /* OUTPUT buffers owned by the driver */
+    unsigned long long  bytes_out;      /* CAPTURE payload dequeued */
+    unsigned long long  bytes_written;  /* of frames, to the output */
+    unsigned long long  cap_stalls;     /* times the decoder had no CAPTURE buffer */
+    unsigned long long  out_stalls;     /* times the decoder ran out of bitstream */
+    unsigned long long  source_changes;
+    int                 input_eof;      /* out of bitstream, STOP still to be sent */
+    int                 stop_sent;
+    int                 last_seen;      /* CAPTURE buffer flagged LAST after STOP */
+    int                 last_empty;     /* the one just dequeued was an empty LAST */
+    int                 eos;            /* decoder drained, last frame seen */
+    int                 done;
+};
+
+static unsigned long long n_ioctls;
+static unsigned long long n_waits;
+static unsigned long long n_frames;
+static uint64_t start_ns;           /* when decoding started */
+
+enum metrics_format {
+    METRICS_NONE,
+    METRICS_JSON,
+    METRICS_PROM,
+};
+
+/* Time spent in each kind of ioctl, only collected when metrics are on */
+struct ioctl_stat {
+    unsigned int        request;
+    const char         *name;
+    unsigned long long  calls;
+    unsigned long long  ns;
+    unsigned long long  max_ns;
+};
+
+static struct ioctl_stat ioctl_stats[] = {
+    { .request = VIDIOC_QBUF,        .name = "qbuf" },
+    { .request = VIDIOC_DQBUF,       .name = "dqbuf" },
+    { .request = VIDIOC_DQEVENT,     .name = "dqevent" },
+    { .request = VIDIOC_DECODER_CMD, .name = "decoder_cmd" },
+    { .request = VIDIOC_STREAMON,    .name = "streamon" },
+    { .request = VIDIOC_STREAMOFF,   .name = "streamoff" },
+    { .request = VIDIOC_REQBUFS,     .name = "reqbufs" },
+    { .request = VIDIOC_CREATE_BUFS, .name = "create_bufs" },
+    { .request = VIDIOC_QUERYBUF,    .name = "querybuf" },
+    { .request = VIDIOC_EXPBUF,      .name = "expbuf" },
+    { .request = VIDIOC_G_FMT,       .name = "g_fmt" },
+    { .request = VIDIOC_S_FMT,       .name = "s_fmt" },
+    { .request = 0,                  .name = "other" },
+};
+
+static enum metrics_format metrics_format;
+static char              *metrics_path;
+static unsigned int       metrics_interval;
+static volatile sig_atomic_t metrics_requested;
 
 static void errno_exit(const char *s)
 {
@@ -68,1070 +397,4737 @@ static void errno_exit(const char *s)
     exit(EXIT_FAILURE);
 }
 
-static int xioctl(int fh, int request, void *arg)
+static uint64_t monotonic_ns(void)
 {
-    int r;
+    struct timespec ts;
 
-    do {
-        r = ioctl(fh, request, arg);
-    } while (-1 == r && EINTR == errno);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
-    return r;
+/*
+ * Diagnostics go through log_*() at one of these levels. Fatal errors still
+ * go straight to stderr. Per frame lines are formatted into log_buf, which
+ * the main loop and the writer thread write out in one go before they sleep,
+ * and can be compiled out altogether with -DM2M_NO_FRAME_LOG. At most
+ * LOG_FRAME_RATE of them are kept a second; the rest, and any that find the
+ * buffer full, are only counted.
+ */
+enum log_level {
+    LOG_QUIET,
+    LOG_WARN,
+    LOG_INFO,
+    LOG_DEBUG,
+    LOG_FRAME,
+};
+
+#define LOG_BUF_SIZE    (64 * 1024)
+#define LOG_FRAME_RATE  1000
+
+static enum log_level  log_level = LOG_INFO;
+static char            log_buf[2][LOG_BUF_SIZE];   /* one filling, one being written */
+static unsigned int    log_buf_cur;
+static size_t          log_buf_len;
+static uint64_t        log_second;         /* the LOG_FRAME_RATE budget is for */
+static unsigned long long log_suppressed;
+static pthread_mutex_t log_buf_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t log_write_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define log_at(level, ...)                                                      \
+    do {                                                                        \
+        if (log_level >= (level))                                               \
+            fprintf(stderr, __VA_ARGS__);                                       \
+    } while (0)
+
+#define log_warn(...)  log_at(LOG_WARN, __VA_ARGS__)
+#define log_info(...)  log_at(LOG_INFO, __VA_ARGS__)
+#define log_debug(...) log_at(LOG_DEBUG, __VA_ARGS__)
+
+#ifdef M2M_NO_FRAME_LOG
+#define log_frame(...) do { if (0) fprintf(stderr, __VA_ARGS__); } while (0)
+#else
+#define log_frame(...)                                                          \
+    do {                                                                        \
+        if (log_level >= LOG_FRAME)                                             \
+            log_buffered(__VA_ARGS__);                                          \
+    } while (0)
+#endif
+
+/*
+ * Write out the buffered lines. The buffers are swapped under log_buf_lock
+ * and the write happens outside it, so threads logging meanwhile only wait
+ * for the swap. If stderr fails or takes nothing, the rest is dropped.
+ * Suppressed lines are reported once their second is over, or when final.
+ */
+static void log_flush(int final)
+{
+    unsigned long long suppressed;
+    const char *buf;
+    size_t len, off = 0;
+
+    pthread_mutex_lock(&log_write_lock);
+
+    pthread_mutex_lock(&log_buf_lock);
+    buf = log_buf[log_buf_cur];
+    len = log_buf_len;
+    suppressed = 0;
+    if (final || monotonic_ns() / 1000000000ULL != log_second) {
+        suppressed = log_suppressed;
+        log_suppressed = 0;
+    }
+    log_buf_cur ^= 1;
+    log_buf_len = 0;
+    pthread_mutex_unlock(&log_buf_lock);
+
+    if (len)
+        fflush(stderr);
+    while (off < len) {
+        ssize_t r = write(STDERR_FILENO, buf + off, len - off);
+
+        if (r <= 0 && EINTR != errno)
+            break;
+        if (r > 0)
+            off += r;
+    }
+    if (suppressed)
+        log_warn("%llu per frame log lines suppressed\n", suppressed);
+
+    pthread_mutex_unlock(&log_write_lock);
 }
 
-static int stream_type(int stream_type) 
+#ifndef M2M_NO_FRAME_LOG
+static void __attribute__((format(printf, 1, 2))) log_buffered(const char *fmt, ...)
 {
-    if (multi_planar) {
-        if (stream_type == V4L2_BUF_TYPE_VIDEO_CAPTURE)
-            return  V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-        else if (stream_type == V4L2_BUF_TYPE_VIDEO_OUTPUT)
-            return V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+    static unsigned int second_lines;
+    uint64_t second = monotonic_ns() / 1000000000ULL;
+    va_list ap;
+    int n;
+
+    pthread_mutex_lock(&log_buf_lock);
+    if (second != log_second) {
+        log_second = second;
+        second_lines = 0;
+    }
+    if (second_lines >= LOG_FRAME_RATE) {
+        log_suppressed++;
+        pthread_mutex_unlock(&log_buf_lock);
+        return;
     }
 
-    return stream_type;
+    va_start(ap, fmt);
+    n = vsnprintf(log_buf[log_buf_cur] + log_buf_len, LOG_BUF_SIZE - log_buf_len, fmt, ap);
+    va_end(ap);
+
+    /* Didn't fit: drop it rather than write from here. */
+    if (n >= 0 && (size_t)n >= LOG_BUF_SIZE - log_buf_len)
+        log_suppressed++;
+    else if (n > 0) {
+        log_buf_len += n;
+        second_lines++;
+    }
+    pthread_mutex_unlock(&log_buf_lock);
+}
+#endif
+
+static void ioctl_account(int request, unsigned long long ns)
+{
+    struct ioctl_stat *st = ioctl_stats;
+    unsigned long long max;
+
+    while (st->request && st->request != (unsigned int)request)
+        st++;
+
+    __atomic_add_fetch(&st->calls, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&st->ns, ns, __ATOMIC_RELAXED);
+    max = __atomic_load_n(&st->max_ns, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&st->max_ns, &max, ns, 1,
+                                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
 }
 
-static void process_image(const void *ptr, int size)
+/* User plus system time of the whole process, threads included */
+static double cpu_seconds(void)
 {
-    if (!out_fp)
-        out_fp = fopen(out_filename, "wb");
-    if (out_fp)
-        fwrite(ptr, size, 1, out_fp);
+    struct rusage ru;
 
-    fflush(stderr);
-    fprintf(stderr, ".");
+    if (-1 == getrusage(RUSAGE_SELF, &ru))
+        return 0;
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+           (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
 }
 
-static void process_image_mp(void *ptr[], unsigned int size[])
+/* Peak resident set size in KiB */
+static long max_rss_kb(void)
 {
-    unsigned int p;
+    struct rusage ru;
 
-    for (p = 0; p < FMT_NUM_PLANES; ++p)
-        process_image(ptr[p], size[p]);
+    if (-1 == getrusage(RUSAGE_SELF, &ru))
+        return 0;
+    return ru.ru_maxrss;
 }
 
-static void supply_input(void *buf, unsigned int buf_len, unsigned int *bytesused)
+static int xioctl(int fh, int request, void *arg)
 {
-    unsigned char *buf_char = (unsigned char*)buf;
-    if (in_fp) {
-        *bytesused = fread(buf, 1, buf_len, in_fp);
-        if (*bytesused != buf_len)
-            fprintf(stderr, "Short read %u instead of %u\n", *bytesused, buf_len);
+    uint64_t start = metrics_format ? monotonic_ns() : 0;
+    int r;
+
+    do {
+        if (mock_owns(fh))
+            r = mock_ioctl(fh, (unsigned int)request, arg);
+        else if (replay_owns(fh))
+            r = replay_ioctl(fh, (unsigned int)request, arg);
         else
-            fprintf(stderr, "Read %u bytes. First 4 bytes %02x %02x %02x %02x\n", *bytesused, 
-                    buf_char[0], buf_char[1], buf_char[2], buf_char[3]);
+            r = ioctl(fh, request, arg);
+        __atomic_add_fetch(&n_ioctls, 1, __ATOMIC_RELAXED);
+    } while (-1 == r && EINTR == errno);
+
+    if (trace_enabled()) {
+        int err = errno;
+
+        trace_ioctl(fh, (unsigned int)request, arg, r, err);
+        errno = err;
     }
-}
 
-unsigned long f_offset = 0;
+    if (metrics_format)
+        ioctl_account(request, monotonic_ns() - start);
 
-static void supply_input_by_au(void *buf, unsigned int buf_len, unsigned int *bytesused)
-{
-    unsigned char *buf_char = (unsigned char*)buf,
-                  aud[5]    = "\000\000\000\001\t";
-    size_t bytes_read, au_length;
-    void *b_offset;
+    return r;
+}
 
-    fseek(in_fp, f_offset, SEEK_SET);
-    bytes_read = fread(buf, 1, buf_len, in_fp);
+static int stream_type(struct session *s, int stream_type)
+{
+    if (s->multi_planar) {
+        if (stream_type == V4L2_BUF_TYPE_VIDEO_CAPTURE)
+            return  V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+        else if (stream_type == V4L2_BUF_TYPE_VIDEO_OUTPUT)
+            return V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+    }
 
-    b_offset = memmem(buf + 1, bytes_read, 
-                      aud, 5);
+    return stream_type;
+}
 
-    au_length = b_offset - buf;
-    f_offset += au_length;
-    *bytesused = au_length;
+/* Planes per buffer on a queue, for v4l2_buffer.length in the MPLANE API */
+static unsigned int queue_planes(struct session *s, enum v4l2_buf_type type)
+{
+    if (!V4L2_TYPE_IS_MULTIPLANAR(type))
+        return 1;
 
-    memset(b_offset, 0, buf_len - au_length);
+    return V4L2_TYPE_IS_OUTPUT(type) ? s->out_planes : s->cap_fmt.fmt.pix_mp.num_planes;
+}
 
-    fprintf(stderr, "Used %u bytes. First 8 bytes %02x %02x %02x %02x %02x %02x %02x %02x\n", 
-            *bytesused, 
-            buf_char[0], buf_char[1], buf_char[2], buf_char[3],
-            buf_char[4], buf_char[5], buf_char[6], buf_char[7]);
+/* Memory of the queues whose buffers we allocate, MMAP or USERPTR */
+static enum v4l2_memory buffer_memory(struct session *s)
+{
+    return s->io == IO_METHOD_USERPTR ? V4L2_MEMORY_USERPTR : V4L2_MEMORY_MMAP;
 }
 
-static void supply_input_mp(void *buf[], unsigned int buf_len[], unsigned int *bytesused)
+/* Fill in the planes of a USERPTR QBUF from buffer b. */
+static void userptr_planes(const struct buffer_mp *b, struct v4l2_plane *planes)
 {
     unsigned int p;
-    unsigned int tot_bytes = 0;
 
-    for (p = 0; p < FMT_NUM_PLANES; ++p) {
-        unsigned int bytes;
-        supply_input_by_au(buf[p], buf_len[p], &bytes);
-        tot_bytes += bytes;
+    for (p = 0; p < b->num_planes; ++p) {
+        planes[p].m.userptr = (unsigned long)b->start[p];
+        planes[p].length    = b->length[p];
     }
-
-    *bytesused = tot_bytes;
 }
 
-static int read_frame(enum v4l2_buf_type type, struct buffer *bufs, unsigned int n_buffers)
+static size_t huge_page_size(void)
 {
-    struct v4l2_buffer buf;
-    unsigned int i;
+    FILE *fp = fopen("/proc/meminfo", "r");
+    char line[128];
+    size_t kb = 0;
 
-    switch (io) {
-    case IO_METHOD_READ:
-        if (-1 == read(fd, bufs[0].start, bufs[0].length)) {
-            switch (errno) {
-            case EAGAIN:
-                return 0;
+    while (fp && fgets(line, sizeof(line), fp))
+        if (1 == sscanf(line, "Hugepagesize: %zu kB", &kb))
+            break;
+    if (fp)
+        fclose(fp);
 
-            case EIO:
-                /* Could ignore EIO, see spec. */
+    return kb ? kb << 10 : 2 << 20;
+}
 
-                /* fall through */
+/* Whether a huge page can actually be had from memfd, not just the memfd created */
+static int hugetlb_usable(struct buffer_pool *pool)
+{
+    void *p;
+
+    if (-1 == ftruncate(pool->memfd, pool->huge))
+        return 0;
+    p = mmap(NULL, pool->huge, PROT_READ | PROT_WRITE, MAP_SHARED, pool->memfd, 0);
+    if (MAP_FAILED == p)
+        return 0;
+    munmap(p, pool->huge);
+    return 1;
+}
 
-            default:
-                errno_exit("read");
-            }
+static void pool_init(struct session *s)
+{
+    struct buffer_pool *pool = &s->pool;
+    unsigned char *raw;
+    size_t slack;
+
+    pool->huge  = huge_page_size();
+    pool->size  = POOL_RESERVE;
+    pool->memfd = -1;
+
+    if (s->pool_hugetlb) {
+        pool->memfd = memfd_create("m2m-userptr", MFD_HUGETLB | MFD_CLOEXEC);
+        if (-1 == pool->memfd) {
+            log_warn("No hugetlb memfd (%s), using transparent huge pages\n", strerror(errno));
+        } else if (!hugetlb_usable(pool)) {
+            log_warn("No hugetlb pages (%s), see /proc/sys/vm/nr_hugepages; "
+                     "using transparent huge pages\n", strerror(errno));
+            close(pool->memfd);
+            pool->memfd = -1;
         }
+    }
 
-        process_image(bufs[0].start, bufs[0].length);
-        break;
+    /* Huge page aligned, so hugetlb mappings can go anywhere in it and THP can back all of it. */
+    raw = mmap(NULL, pool->size + pool->huge, -1 == pool->memfd ? PROT_READ | PROT_WRITE : PROT_NONE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (MAP_FAILED == raw)
+        errno_exit("mmap");
 
-    case IO_METHOD_MMAP:
-        CLEAR(buf);
+    slack = -(uintptr_t)raw & (pool->huge - 1);
+    if (slack)
+        munmap(raw, slack);
+    munmap(raw + slack + pool->size, pool->huge - slack);
+    pool->base = raw + slack;
 
-        buf.type = type;
-        buf.memory = V4L2_MEMORY_MMAP;
+    if (-1 == pool->memfd)
+        madvise(pool->base, pool->size, MADV_HUGEPAGE);
 
-        if (-1 == xioctl(fd, VIDIOC_DQBUF, &buf)) {
-            switch (errno) {
-            case EAGAIN:
-                return 0;
+    log_debug("USERPTR pool: %zu MiB reserved, %s\n", pool->size >> 20,
+              -1 == pool->memfd ? "transparent huge pages" : "hugetlb");
+}
 
-            case EIO:
-                /* Could ignore EIO, see spec. */
+/* Page aligned memory for one plane */
+static void *pool_alloc(struct session *s, size_t len)
+{
+    struct buffer_pool *pool = &s->pool;
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t start, end;
+    unsigned int i;
 
-                /* fall through */
+    if (!pool->base)
+        pool_init(s);
 
-            default:
-                errno_exit("VIDIOC_DQBUF");
-            }
-        }
+    len = (len + page - 1) / page * page;
 
-        assert(buf.index < n_buffers);
+    /* First fit from what earlier buffers gave back */
+    for (i = 0; i < pool->n_free; ++i) {
+        struct pool_range *r = &pool->free[i];
 
-        if (type == V4L2_BUF_TYPE_VIDEO_CAPTURE)
-            process_image(bufs[buf.index].start, buf.bytesused);
-        else
-            supply_input(bufs[buf.index].start, bufs[buf.index].length, &buf.bytesused);
+        if (r->end - r->start < len)
+            continue;
+        start = r->start;
+        r->start += len;
+        if (r->start == r->end)
+            memmove(r, r + 1, (--pool->n_free - i) * sizeof(*r));
+        return pool->base + start;
+    }
 
-        if (-1 == xioctl(fd, VIDIOC_QBUF, &buf))
-            errno_exit("VIDIOC_QBUF");
-        break;
+    start = pool->used;
+    end   = start + len;
+    if (end > pool->size) {
+        fprintf(stderr, "USERPTR pool of %zu MiB exhausted\n", pool->size >> 20);
+        exit(EXIT_FAILURE);
+    }
 
-    case IO_METHOD_USERPTR:
-        CLEAR(buf);
+    if (pool->memfd >= 0 && !pool->anon_rest && end > pool->mapped) {
+        size_t to = (end + pool->huge - 1) / pool->huge * pool->huge;
+
+        if (-1 == ftruncate(pool->memfd, to) ||
+            MAP_FAILED == mmap(pool->base + pool->mapped, to - pool->mapped, PROT_READ | PROT_WRITE,
+                               MAP_SHARED | MAP_FIXED, pool->memfd, pool->mapped)) {
+            log_warn("Out of hugetlb pages for %zu MiB of buffers, see /proc/sys/vm/nr_hugepages; "
+                     "using transparent huge pages for the rest\n", to >> 20);
+            if (MAP_FAILED == mmap(pool->base + pool->mapped, pool->size - pool->mapped,
+                                   PROT_READ | PROT_WRITE,
+                                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0))
+                errno_exit("mmap");
+            madvise(pool->base + pool->mapped, pool->size - pool->mapped, MADV_HUGEPAGE);
+            pool->anon_rest = 1;
+        } else {
+            pool->mapped = to;
+        }
+    }
 
-        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        buf.memory = V4L2_MEMORY_USERPTR;
+    pool->used = end;
+    return pool->base + start;
+}
 
-        if (-1 == xioctl(fd, VIDIOC_DQBUF, &buf)) {
-            switch (errno) {
-            case EAGAIN:
-                return 0;
+/* Give back the pages of a buffer that won't be used again, and its range. */
+static void pool_release(struct session *s, void *start, size_t len)
+{
+    struct buffer_pool *pool = &s->pool;
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t offset = (unsigned char *)start - pool->base;
+    size_t end;
+    unsigned int i;
 
-            case EIO:
-                /* Could ignore EIO, see spec. */
+    len = (len + page - 1) / page * page;
+    end = offset + len;
 
-                /* fall through */
+    if (pool->memfd >= 0 && offset < pool->mapped)
+        fallocate(pool->memfd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len);
+    else
+        madvise(start, len, MADV_DONTNEED);
 
-            default:
-                errno_exit("VIDIOC_DQBUF");
+    for (i = 0; i < pool->n_free && pool->free[i].end < offset; ++i)
+        ;
+
+    if (i < pool->n_free && pool->free[i].end == offset) {
+        pool->free[i].end = end;
+        if (i + 1 < pool->n_free && pool->free[i + 1].start == end) {
+            pool->free[i].end = pool->free[i + 1].end;
+            memmove(&pool->free[i + 1], &pool->free[i + 2], (pool->n_free - i - 2) * sizeof(*pool->free));
+            pool->n_free--;
+        }
+    } else if (i < pool->n_free && pool->free[i].start == end) {
+        pool->free[i].start = offset;
+    } else {
+        if (pool->n_free == pool->free_alloc) {
+            pool->free_alloc = pool->free_alloc ? pool->free_alloc * 2 : 32;
+            pool->free = realloc(pool->free, pool->free_alloc * sizeof(*pool->free));
+            if (!pool->free) {
+                fprintf(stderr, "Out of memory\n");
+                exit(EXIT_FAILURE);
             }
         }
-
-        for (i = 0; i < n_buffers; ++i)
-            if (buf.m.userptr == (unsigned long)bufs[i].start
-                && buf.length == bufs[i].length)
-                break;
-
-        assert(i < n_buffers);
-
-        process_image((void *)buf.m.userptr, buf.bytesused);
-
-        if (-1 == xioctl(fd, VIDIOC_QBUF, &buf))
-            errno_exit("VIDIOC_QBUF");
-        break;
+        memmove(&pool->free[i + 1], &pool->free[i], (pool->n_free - i) * sizeof(*pool->free));
+        pool->free[i].start = offset;
+        pool->free[i].end   = end;
+        pool->n_free++;
     }
 
-    return 1;
+    /* A free range at the top just goes back to the unused space. */
+    if (pool->n_free && pool->free[pool->n_free - 1].end == pool->used) {
+        pool->used = pool->free[pool->n_free - 1].start;
+        pool->n_free--;
+    }
 }
 
-static int read_frame_mmap_mp(enum v4l2_buf_type type, struct buffer_mp *bufs, unsigned int n_buffers)
+static void pool_destroy(struct session *s)
 {
-    struct v4l2_buffer buf;
-    struct v4l2_plane  planes[FMT_NUM_PLANES];
+    struct buffer_pool *pool = &s->pool;
 
-    CLEAR(buf);
-    CLEAR(planes);
+    if (!pool->base)
+        return;
 
-    buf.type     = type;
-    buf.memory   = V4L2_MEMORY_MMAP;
-    buf.length   = FMT_NUM_PLANES;
-    buf.m.planes = planes;
+    munmap(pool->base, pool->size);
+    if (pool->memfd >= 0)
+        close(pool->memfd);
+    free(pool->free);
+    CLEAR(*pool);
+}
 
-    if (-1 == xioctl(fd, VIDIOC_DQBUF, &buf)) {
-        switch (errno) {
-        case EAGAIN:
-            return 0;
+/*
+ * Buffers to request for a queue, either as given or the driver minimum plus
+ * headroom. A count given is still raised to the minimum, which can go up at
+ * a source change.
+ */
+static unsigned int buffer_count(struct session *s, enum v4l2_buf_type type)
+{
+    int output = V4L2_TYPE_IS_OUTPUT(type);
+    int count = output ? s->out_count : s->cap_count;
+    struct v4l2_control ctrl;
+
+    CLEAR(ctrl);
+    ctrl.id = output ? V4L2_CID_MIN_BUFFERS_FOR_OUTPUT : V4L2_CID_MIN_BUFFERS_FOR_CAPTURE;
+
+    if (count > 0) {
+        if (-1 == xioctl(s->fd, VIDIOC_G_CTRL, &ctrl) || ctrl.value <= count)
+            return count;
+        log_info("%s needs %d buffers, more than %d\n",
+                 output ? "OUTPUT" : "CAPTURE", ctrl.value, count);
+        return ctrl.value < VIDEO_MAX_FRAME ? ctrl.value : VIDEO_MAX_FRAME;
+    }
 
-        case EIO:
-            /* Could ignore EIO, see spec. */
+    if (-1 == xioctl(s->fd, VIDIOC_G_CTRL, &ctrl) || ctrl.value < 0) {
+        log_warn("No minimum %s buffer count from %s, using 4\n",
+                output ? "OUTPUT" : "CAPTURE", s->dev_name);
+        return 4;
+    }
 
-            /* fall through */
+    log_info("Minimum %s buffers %d, adding %u\n",
+            output ? "OUTPUT" : "CAPTURE", ctrl.value, s->buf_headroom);
 
-        default:
-            errno_exit("VIDIOC_DQBUF");
-        }
+    if (ctrl.value + s->buf_headroom > VIDEO_MAX_FRAME) {
+        log_warn("Limiting %s buffers to %d\n", output ? "OUTPUT" : "CAPTURE", VIDEO_MAX_FRAME);
+        return VIDEO_MAX_FRAME;
     }
 
-    assert(buf.index < n_buffers);
+    return ctrl.value + s->buf_headroom;
+}
 
-    if (type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE)
-        process_image_mp(bufs[buf.index].start, bufs[buf.index].length);
-    else
-        supply_input_mp(bufs[buf.index].start, bufs[buf.index].length, &buf.bytesused);
+static void log_footprint(enum v4l2_buf_type type, unsigned int n, size_t bytes)
+{
+    log_info("%s: %u buffers, %.1f MiB\n",
+            V4L2_TYPE_IS_OUTPUT(type) ? "OUTPUT" : "CAPTURE", n, bytes / 1048576.0);
+}
 
-    if (-1 == xioctl(fd, VIDIOC_QBUF, &buf))
-        errno_exit("VIDIOC_QBUF");
+static void capture_queued(struct session *s)
+{
+    __atomic_add_fetch(&s->cap_queued, 1, __ATOMIC_RELAXED);
+}
 
-    return 1;
+static void capture_dequeued(struct session *s)
+{
+    /* The decoder has nowhere left to write to. */
+    if (0 == __atomic_sub_fetch(&s->cap_queued, 1, __ATOMIC_RELAXED)) {
+        __atomic_add_fetch(&s->cap_stalls, 1, __ATOMIC_RELAXED);
+        if (s->grow_buffers)
+            s->cap_starved = 1;
+    }
 }
 
-static void stop_capture(enum v4l2_buf_type type)
+static void open_output(struct session *s)
 {
-    type = stream_type(type); // change type if multi-planar
+    if (!s->out_fp && s->out_filename)
+        s->out_fp = fopen(s->out_filename, "wb");
+}
 
-    if (-1 == xioctl(fd, VIDIOC_STREAMOFF, &type))
-        errno_exit("VIDIOC_STREAMOFF");
+static void process_image(struct session *s, const void *ptr, int size)
+{
+    open_output(s);
+    if (s->out_fp && size) {
+        fwrite(ptr, size, 1, s->out_fp);
+        s->bytes_written += size;
+    }
+
+    log_frame("Wrote %d bytes\n", size);
 }
 
-static void stop_capturing(void)
+/* Write each plane's payload, which starts data_offset bytes into the plane. */
+static void process_image_mp(struct session *s, const struct buffer_mp *b, const struct v4l2_buffer *buf)
 {
-    switch (io) {
-    case IO_METHOD_READ:
-        /* Nothing to do. */
-        break;
+    unsigned int p;
 
-    case IO_METHOD_MMAP:
-    case IO_METHOD_USERPTR:
-        stop_capture(V4L2_BUF_TYPE_VIDEO_CAPTURE);
+    for (p = 0; p < buf->length; ++p) {
+        const struct v4l2_plane *plane = &buf->m.planes[p];
 
-        if (m2m_enabled) 
-            stop_capture(V4L2_BUF_TYPE_VIDEO_OUTPUT);
-        break;
+        if (plane->bytesused > plane->data_offset)
+            process_image(s, (char *)b->start[p] + plane->data_offset,
+                          plane->bytesused - plane->data_offset);
     }
 }
 
-static void start_capturing_mmap(enum v4l2_buf_type type, struct buffer *bufs, unsigned int n_bufs)
+static void free_pack(struct session *s)
 {
     unsigned int i;
 
-    for (i = 0; i < n_bufs; ++i) {
-        struct v4l2_buffer buf;
+    for (i = 0; i < VIDEO_MAX_FRAME; ++i) {
+        free(s->pack_bufs[i]);
+        s->pack_bufs[i] = NULL;
+    }
+    s->pack_ok = 0;
+}
 
-        CLEAR(buf);
-        buf.type = type;
-        buf.memory = V4L2_MEMORY_MMAP;
-        buf.index = i;
+/*
+ * -p: find the visible rows of the CAPTURE format, whenever that is set.
+ * Frames in a format pack.c doesn't know are written as they are.
+ */
+static void setup_pack(struct session *s)
+{
+    struct v4l2_selection sel;
+
+    free_pack(s);
+    if (!s->pack || s->io == IO_METHOD_READ)
+        return;
+
+    /* Decoders report the visible rectangle as the CAPTURE compose target. */
+    CLEAR(sel);
+    sel.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    sel.target = V4L2_SEL_TGT_COMPOSE;
+    if (-1 == xioctl(s->fd, VIDIOC_G_SELECTION, &sel))
+        CLEAR(sel.r);
+
+    if (pack_layout(&s->pack_layout, &s->cap_fmt, &sel.r)) {
+        log_warn("Can't pack %.4s frames, writing them as they are\n",
+                 (const char *)&s->pack_layout.pixelformat);
+        return;
+    }
+    if (s->convert && pack_set_output(&s->pack_layout, s->convert, s->convert_scale))
+        log_warn("Can't convert %.4s frames to %.4s, writing them packed\n",
+                 (const char *)&s->pack_layout.pixelformat, (const char *)&s->convert);
+    s->pack_ok = 1;
+    log_info("Packing %ux%u %.4s frames into %zu bytes of %.4s, %s kernels\n",
+             s->pack_layout.width, s->pack_layout.height,
+             (const char *)&s->pack_layout.pixelformat, s->pack_layout.frame_bytes,
+             (const char *)&s->pack_layout.out_pixelformat, pack_kernels_in_use());
+}
 
-        if (type == V4L2_BUF_TYPE_VIDEO_OUTPUT)
-            supply_input(bufs[i].start, bufs[i].length, &buf.bytesused);
+/* Where to pack buffer index; writes in flight with -U each need their own. */
+static unsigned char *pack_buf(struct session *s, unsigned int index)
+{
+    unsigned char **p = &s->pack_bufs[s->uring ? index : 0];
 
-        if (-1 == xioctl(fd, VIDIOC_QBUF, &buf))
-            errno_exit("VIDIOC_QBUF");
+    if (!*p && posix_memalign((void **)p, 64, s->pack_layout.frame_bytes)) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
     }
-    
-    if (-1 == xioctl(fd, VIDIOC_STREAMON, &type))
-        errno_exit("VIDIOC_STREAMON");
+    return *p;
 }
 
-static void start_capturing_mmap_mp(enum v4l2_buf_type type, struct buffer_mp *bufs, unsigned int n_bufs)
+/* Pack a dequeued CAPTURE buffer into dst, returning 0 for an empty one. */
+static size_t pack_capture(struct session *s, const struct v4l2_buffer *buf, unsigned char *dst)
 {
-    unsigned int i;
+    const unsigned char *src[VIDEO_MAX_PLANES];
+    size_t len[VIDEO_MAX_PLANES];
+    unsigned int p;
 
-    for (i = 0; i < n_bufs; ++i) {
-        struct v4l2_buffer buf;
-        struct v4l2_plane  planes[FMT_NUM_PLANES];
+    memset(len, 0, sizeof(len));
+    if (V4L2_TYPE_IS_MULTIPLANAR(buf->type)) {
+        for (p = 0; p < buf->length && p < VIDEO_MAX_PLANES; ++p) {
+            const struct v4l2_plane *plane = &buf->m.planes[p];
 
-        CLEAR(buf);
-        CLEAR(planes);
-        buf.type     = type;
-        buf.memory   = V4L2_MEMORY_MMAP;
-        buf.index    = i;
-        buf.length   = FMT_NUM_PLANES;
-        buf.m.planes = planes;
+            src[p] = (const unsigned char *)s->buffers_mp[buf->index].start[p] + plane->data_offset;
+            if (plane->bytesused > plane->data_offset)
+                len[p] = plane->bytesused - plane->data_offset;
+        }
+    } else {
+        src[0] = s->buffers[buf->index].start;
+        len[0] = buf->bytesused;
+    }
+
+    return pack_frame(&s->pack_layout, src, len, dst, s->pack == 2);
+}
 
-        if (type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE)
-            supply_input_mp(bufs[i].start, bufs[i].length, &buf.bytesused);
+/* Write a dequeued CAPTURE buffer, packed with -p. */
+static void process_frame(struct session *s, const struct v4l2_buffer *buf)
+{
+    if (s->pack_ok) {
+        unsigned char *dst = pack_buf(s, buf->index);
 
-        if (-1 == xioctl(fd, VIDIOC_QBUF, &buf))
-            errno_exit("VIDIOC_QBUF");
+        process_image(s, dst, pack_capture(s, buf, dst));
+    } else if (V4L2_TYPE_IS_MULTIPLANAR(buf->type)) {
+        process_image_mp(s, &s->buffers_mp[buf->index], buf);
+    } else {
+        process_image(s, s->buffers[buf->index].start, buf->bytesused);
     }
-    
-    if (-1 == xioctl(fd, VIDIOC_STREAMON, &type))
-        errno_exit("VIDIOC_STREAMON");
 }
 
-static void start_capturing(void)
+/*
+ * Return a pointer to the first 00 00 01 start code prefix in [p, end), or
+ * end if there is none. The vector loops test 16 candidate positions per
+ * iteration and only fall back to bytewise compares for the tail.
+ */
+static const unsigned char *find_start_code(const unsigned char *p,
+                                            const unsigned char *end)
 {
-    unsigned int i;
-    enum v4l2_buf_type type;
-
-    switch (io) {
-    case IO_METHOD_READ:
-        /* Nothing to do. */
-        break;
-
-    case IO_METHOD_MMAP:
-        if (multi_planar)
-            start_capturing_mmap_mp(V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE, buffers_mp, n_buffers);
-        else
-            start_capturing_mmap(V4L2_BUF_TYPE_VIDEO_CAPTURE, buffers, n_buffers);
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one  = _mm_set1_epi8(1);
+
+    while (end - p >= 18) {
+        __m128i b0 = _mm_loadu_si128((const __m128i *)p);
+        __m128i b1 = _mm_loadu_si128((const __m128i *)(p + 1));
+        __m128i b2 = _mm_loadu_si128((const __m128i *)(p + 2));
+        int mask;
+
+        mask = _mm_movemask_epi8(
+                _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(b0, zero),
+                                            _mm_cmpeq_epi8(b1, zero)),
+                              _mm_cmpeq_epi8(b2, one)));
+        if (mask)
+            return p + __builtin_ctz(mask);
+        p += 16;
+    }
+#elif defined(__ARM_NEON)
+    const uint8x16_t zero = vdupq_n_u8(0);
+    const uint8x16_t one  = vdupq_n_u8(1);
+
+    while (end - p >= 18) {
+        uint8x16_t m = vandq_u8(vandq_u8(vceqq_u8(vld1q_u8(p), zero),
+                                         vceqq_u8(vld1q_u8(p + 1), zero)),
+                                vceqq_u8(vld1q_u8(p + 2), one));
+        /* Narrow to one nibble per byte lane to get a 64 bit mask. */
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(
+                            vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+
+        if (mask)
+            return p + (__builtin_ctzll(mask) >> 2);
+        p += 16;
+    }
+#endif
 
-        if (m2m_enabled) {
-            if (multi_planar)
-                start_capturing_mmap_mp(V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE, buffers_mp_out, n_buffers_out);
-            else
-                start_capturing_mmap(V4L2_BUF_TYPE_VIDEO_OUTPUT, buffers, n_buffers_out);
-        }
-        break;
+    for (; end - p >= 3; ++p)
+        if (!p[0] && !p[1] && p[2] == 1)
+            return p;
 
-    case IO_METHOD_USERPTR:
-        for (i = 0; i < n_buffers; ++i) {
-            struct v4l2_buffer buf;
-
-            CLEAR(buf);
-            buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-            buf.memory = V4L2_MEMORY_USERPTR;
-            buf.index = i;
-            buf.m.userptr = (unsigned long)buffers[i].start;
-            buf.length = buffers[i].length;
-
-            if (-1 == xioctl(fd, VIDIOC_QBUF, &buf))
-                errno_exit("VIDIOC_QBUF");
-        }
-        type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        if (-1 == xioctl(fd, VIDIOC_STREAMON, &type))
-            errno_exit("VIDIOC_STREAMON");
-        break;
-    }
+    return end;
 }
 
-static void unmap_buffers(struct buffer *buf, unsigned int n)
+static void au_state_reset(struct au_state *st)
 {
-    unsigned int b;
-
-    for (b = 0; b < n; ++b)
-        if (-1 == munmap(buf[b].start, buf[b].length))
-            errno_exit("munmap");
+    st->first_vcl = -1;
+    st->keyframe  = 0;
 }
 
-static void unmap_buffers_mp(struct buffer_mp *buf, unsigned int n)
+/*
+ * Does the NAL unit starting at nal (after the start code prefix) begin a new
+ * access unit? Follows H.264 7.4.1.2.3 and H.265 7.4.2.4.4: once the current
+ * AU holds a VCL NAL unit, a new one starts at the first parameter set, SEI,
+ * AUD or similar prefix NAL unit, or at the first slice of the next picture.
+ * Arbitrary slice order and redundant pictures are not considered.
+ */
+static int nal_starts_au(struct session *s, const unsigned char *nal, size_t avail, const struct au_state *st)
 {
-    unsigned int b, p;
+    int type;
 
-    for (b = 0; b < n; b++)
-        for (p = 0; p < FMT_NUM_PLANES; p++)
-            if (-1 == munmap(buf[b].start[p], buf[b].length[p]))
-                errno_exit("munmap");
+    if (st->first_vcl < 0)
+        return 0;
+
+    if (s->codec == CODEC_HEVC) {
+        if (avail < 3)
+            return 0;
+        /* Only the base layer delimits access units. */
+        if ((nal[0] & 0x01) || (nal[1] & 0xf8))
+            return 0;
+
+        type = (nal[0] >> 1) & 0x3f;
+        if (type < 32)
+            return !!(nal[2] & 0x80);   /* first_slice_segment_in_pic_flag */
+
+        return (type >= 32 && type <= 35) || type == 39 ||
+               (type >= 41 && type <= 44) || (type >= 48 && type <= 55);
+    }
+
+    if (avail < 2)
+        return 0;
+
+    type = nal[0] & 0x1f;
+    switch (type) {
+    case 1:
+    case 2:
+    case 5:
+        return !!(nal[1] & 0x80);       /* first_mb_in_slice == 0 */
+    case 6:
+    case 7:
+    case 8:
+    case 9:
+        return 1;
+    default:
+        return type >= 14 && type <= 18;
+    }
 }
 
-static void free_buffers_mmap(enum v4l2_buf_type type)
+static void au_state_add(struct session *s, struct au_state *st, const unsigned char *nal, size_t avail)
 {
-    struct v4l2_requestbuffers req;
+    int type;
+
+    if (!avail)
+        return;
+
+    if (s->codec == CODEC_HEVC) {
+        type = (nal[0] >> 1) & 0x3f;
+        if (type >= 32)
+            return;
+        if (st->first_vcl < 0)
+            st->first_vcl = type;
+        if (type >= 16 && type <= 23)   /* IRAP */
+            st->keyframe = 1;
+    } else {
+        type = nal[0] & 0x1f;
+        if (type < 1 || type > 5)
+            return;
+        if (st->first_vcl < 0)
+            st->first_vcl = type;
+        if (type == 5)
+            st->keyframe = 1;
+    }
+}
 
-    CLEAR(req);
+/*
+ * Length of the access unit at the start of [start, end), i.e. the distance
+ * to the start code of the next NAL unit that begins an AU, or end - start if
+ * the AU runs to the end of the range.
+ */
+static size_t au_length(struct session *s, const unsigned char *start, const unsigned char *end,
+                        struct au_state *st)
+{
+    const unsigned char *p = start;
 
-    req.count = 0;
-    req.type = type;
-    req.memory = V4L2_MEMORY_MMAP;
+    au_state_reset(st);
 
-    if (-1 == xioctl(fd, VIDIOC_REQBUFS, &req)) {
-        if (EINVAL == errno) {
-            fprintf(stderr, "%s does not support "
-                    "memory mapping\n", dev_name);
-            exit(EXIT_FAILURE);
-        } else {
-            errno_exit("VIDIOC_REQBUFS");
+    for (;;) {
+        p = find_start_code(p, end);
+        if (p == end)
+            break;
+        if (p > start + 1 && nal_starts_au(s, p + 3, end - p - 3, st)) {
+            /* The zero_byte of a 4 byte start code belongs to the next AU. */
+            if (p[-1] == 0)
+                p--;
+            break;
         }
+        au_state_add(s, st, p + 3, end - p - 3);
+        p += 3;
     }
+
+    return p - start;
 }
 
-static void uninit_device(void)
+static size_t next_au_mapped(struct session *s, struct au_state *st)
 {
-    unsigned int i;
-
-    switch (io) {   
-    case IO_METHOD_READ:
-        free(buffers[0].start);
-        break;
+    size_t length = au_length(s, s->in_map + s->in_map_pos, s->in_map + s->in_map_len, st);
 
-    case IO_METHOD_MMAP:
-        if (multi_planar) {
-            unmap_buffers_mp(buffers_mp, n_buffers);
-            free_buffers_mmap(V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE);
-            if (m2m_enabled) {
-                unmap_buffers_mp(buffers_mp_out, n_buffers_out);
-                free_buffers_mmap(V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE);
-            }
-        } else {
-            unmap_buffers(buffers, n_buffers);
-            free_buffers_mmap(V4L2_BUF_TYPE_VIDEO_CAPTURE);
-            if (m2m_enabled) {
-                unmap_buffers(buffers_out, n_buffers_out);
-                free_buffers_mmap(V4L2_BUF_TYPE_VIDEO_OUTPUT);
-            }
-        }
-        break;
+    s->in_bytes_scanned += length;
+    return length;
+}
 
-    case IO_METHOD_USERPTR:
-        for (i = 0; i < n_buffers; ++i)
-            free(buffers[i].start);
-        break;
+static void supply_input_mapped(struct session *s, void *buf, unsigned int buf_len, unsigned int *bytesused)
+{
+    struct au_state st;
+    size_t au_length = next_au_mapped(s, &st);
+    size_t copy = au_length;
+
+    /* The rest is scanned again, and sent, from the next buffer. */
+    if (copy > buf_len) {
+        log_warn("Access unit of %zu bytes at %zu split across buffers of %u\n",
+                 au_length, s->in_map_pos, buf_len);
+        copy = buf_len;
+        s->in_bytes_scanned -= au_length - copy;
     }
 
-    free(buffers);
+    memcpy(buf, s->in_map + s->in_map_pos, copy);
+    s->in_map_pos += copy;
+    s->in_bytes_delivered += copy;
+    *bytesused = copy;
+
+    log_frame("Used %u bytes of mapped input at offset %zu\n", *bytesused, s->in_map_pos - copy);
 }
 
-static void init_read(unsigned int buffer_size)
+/*
+ * The writer thread owns every CAPTURE buffer between writer_push() and its
+ * VIDIOC_QBUF, so a slow out_fp only delays that buffer rather than the whole
+ * device loop. Jobs are passed through a single producer, single consumer
+ * ring; the semaphore only wakes the writer up.
+ */
+static void requeue_job(struct session *s, struct writer_job *job)
 {
-    buffers = calloc(1, sizeof(*buffers));
+    if (-1 == xioctl(s->fd, VIDIOC_QBUF, &job->buf))
+        errno_exit("VIDIOC_QBUF");
+    capture_queued(s);
+}
 
-    if (!buffers) {
-        fprintf(stderr, "Out of memory\n");
-        exit(EXIT_FAILURE);
-    }
+static void writer_process(struct session *s, struct writer_job *job)
+{
+    struct v4l2_buffer *buf = &job->buf;
 
-    buffers[0].length = buffer_size;
-    buffers[0].start = malloc(buffer_size);
+    if (V4L2_TYPE_IS_MULTIPLANAR(buf->type))
+        buf->m.planes = job->planes;
+    process_frame(s, buf);
 
-    if (!buffers[0].start) {
-        fprintf(stderr, "Out of memory\n");
-        exit(EXIT_FAILURE);
-    }
+    requeue_job(s, job);
 }
 
-static void init_mmap(enum v4l2_buf_type type, struct buffer **bufs_out, unsigned int *n_bufs)
+static void *writer_main(void *arg)
 {
-    struct v4l2_requestbuffers req;
-    struct buffer *bufs;
-    unsigned int b;
+    struct session *s = arg;
 
-    CLEAR(req);
+    for (;;) {
+        unsigned int tail = s->writer_tail;
+        struct writer_job *job;
 
-    req.count  = 4;
-    req.type   = type;
-    req.memory = V4L2_MEMORY_MMAP;
+        if (tail == __atomic_load_n(&s->writer_head, __ATOMIC_ACQUIRE))
+            log_flush(0);
+        while (-1 == sem_wait(&s->writer_sem) && EINTR == errno)
+            ;
 
-    if (-1 == xioctl(fd, VIDIOC_REQBUFS, &req)) {
-        if (EINVAL == errno) {
-            fprintf(stderr, "%s does not support "
-                    "memory mapping\n", dev_name);
-            exit(EXIT_FAILURE);
-        } else {
-            errno_exit("VIDIOC_REQBUFS");
-        }
-    }
+        if (tail == __atomic_load_n(&s->writer_head, __ATOMIC_ACQUIRE))
+            continue;
 
-    if (req.count < 2) {
-        fprintf(stderr, "Insufficient buffer memory on %s\n",
-                dev_name);
-        exit(EXIT_FAILURE);
+        job = &s->writer_ring[tail & (WRITER_RING_SIZE - 1)];
+        if (job->buf.index == UINT32_MAX)
+            break;
+
+        writer_process(s, job);
+        __atomic_store_n(&s->writer_tail, tail + 1, __ATOMIC_RELEASE);
     }
 
-    bufs = calloc(req.count, sizeof(*bufs));
+    return NULL;
+}
 
-    if (!bufs) {
-        fprintf(stderr, "Out of memory\n");
-        exit(EXIT_FAILURE);
-    }
+static void writer_push(struct session *s, const struct v4l2_buffer *buf)
+{
+    struct writer_job *job;
 
-    for (b = 0; b < req.count; ++b) {
-        struct v4l2_buffer buf;
+    /* Never more jobs in flight than there are buffers, so this can't fill. */
+    assert(s->writer_head - __atomic_load_n(&s->writer_tail, __ATOMIC_ACQUIRE) < WRITER_RING_SIZE);
 
-        CLEAR(buf);
+    job = &s->writer_ring[s->writer_head & (WRITER_RING_SIZE - 1)];
+    job->buf = *buf;
+    if (V4L2_TYPE_IS_MULTIPLANAR(buf->type))
+        memcpy(job->planes, buf->m.planes, sizeof(job->planes));
+
+    __atomic_store_n(&s->writer_head, s->writer_head + 1, __ATOMIC_RELEASE);
+    sem_post(&s->writer_sem);
+}
 
-        buf.type   = type;
-        buf.memory = V4L2_MEMORY_MMAP;
-        buf.index  = b;
+/* Wait until the writer has requeued every buffer it was handed. */
+static void writer_flush(struct session *s)
+{
+    if (!s->use_writer)
+        return;
 
-        if (-1 == xioctl(fd, VIDIOC_QUERYBUF, &buf))
-            errno_exit("VIDIOC_QUERYBUF");
+    /* Only used around STREAMOFF, so a yield loop is good enough. */
+    while (__atomic_load_n(&s->writer_tail, __ATOMIC_ACQUIRE) != s->writer_head)
+        sched_yield();
+}
 
-        fprintf(stderr, "Mapping buffer %u, len %u\n", b, buf.length);
-        bufs[b].length = buf.length;
-        bufs[b].start =
-            mmap(NULL /* start anywhere */,
-                 buf.length,
-                 PROT_READ | PROT_WRITE, /* required */
-                 MAP_SHARED,             /* recommended */
-                 fd, buf.m.offset);
+static void writer_start(struct session *s)
+{
+    int err;
 
-        if (MAP_FAILED == bufs[b].start)
-            errno_exit("mmap");
+    if (!s->use_writer)
+        return;
+
+    if (-1 == sem_init(&s->writer_sem, 0, 0))
+        errno_exit("sem_init");
+
+    err = pthread_create(&s->writer_thread, NULL, writer_main, s);
+    if (err) {
+        errno = err;
+        errno_exit("pthread_create");
     }
-    *n_bufs = b;
-    *bufs_out = bufs;
 }
 
-static void init_mmap_mp(enum v4l2_buf_type type, struct buffer_mp **bufs_out, unsigned int *n_bufs)
+static void writer_stop(struct session *s)
 {
-    struct v4l2_requestbuffers req;
-    struct buffer_mp *bufs;
-    unsigned int b;
+    struct v4l2_buffer stop;
 
-    CLEAR(req);
+    if (!s->use_writer)
+        return;
 
-    req.count  = 4;
-    req.type   = type;
-    req.memory = V4L2_MEMORY_MMAP;
+    writer_flush(s);
 
-    if (-1 == xioctl(fd, VIDIOC_REQBUFS, &req)) {
-        if (EINVAL == errno) {
-            fprintf(stderr, "%s does not support "
-                    "memory mapping\n", dev_name);
+    CLEAR(stop);
+    stop.index = UINT32_MAX;
+    writer_push(s, &stop);
+    pthread_join(s->writer_thread, NULL);
+    sem_destroy(&s->writer_sem);
+}
+
+/*
+ * With -U, bitstream reads and frame writes go through uring.c, whose
+ * completions the main loop reaps along with the devices. The input is read
+ * READAHEAD_CHUNKS chunks ahead and copied into a window that AUs are
+ * delimited and copied out of. A CAPTURE buffer is requeued once every one
+ * of its planes is written, at an offset fixed when it was dequeued, so
+ * frames land in order whatever order the writes finish in.
+ */
+#define URING_READ_TAG  (1ULL << 63)    /* else (bytes << 8) | CAPTURE index */
+
+static void uring_reap(struct session *s)
+{
+    uint64_t tag;
+    int res;
+
+    while (uring_complete(s->uring, &tag, &res)) {
+        unsigned int index = tag & 0xff;
+
+        if (tag & URING_READ_TAG) {
+            index = tag & ~URING_READ_TAG;
+            s->ra_result[index] = res;
+            s->ra_busy[index]   = 0;
+            continue;
+        }
+
+        if (res < 0) {
+            errno = -res;
+            errno_exit("write");
+        }
+        if ((uint64_t)res != tag >> 8) {
+            fprintf(stderr, "Short write of %d bytes instead of %llu\n",
+                    res, (unsigned long long)(tag >> 8));
             exit(EXIT_FAILURE);
-        } else {
-            errno_exit("VIDIOC_REQBUFS");
         }
-    }
 
-    if (req.count < 2) {
-        fprintf(stderr, "Insufficient buffer memory on %s\n",
-                dev_name);
-        exit(EXIT_FAILURE);
+        s->uring_writes--;
+        if (!--s->uring_pending[index])
+            requeue_job(s, &s->uring_jobs[index]);
     }
+}
 
-    bufs = calloc(req.count, sizeof(*bufs));
+static void uring_reap_wait(struct session *s)
+{
+    uring_wait(s->uring);
+    uring_reap(s);
+}
 
-    if (!bufs) {
-        fprintf(stderr, "Out of memory\n");
-        exit(EXIT_FAILURE);
-    }
+/* Wait until every written CAPTURE buffer has been requeued. */
+static void uring_flush(struct session *s)
+{
+    while (s->uring && s->uring_writes)
+        uring_reap_wait(s);
+}
 
-    for (b = 0; b < req.count; ++b) {
-        struct v4l2_buffer buf;
-        struct v4l2_plane  planes[FMT_NUM_PLANES];
-        unsigned int p;
+/* plane is -1 for a packed copy of the frame, which isn't registered */
+static void uring_write_plane(struct session *s, unsigned int index, int plane,
+                              const void *ptr, size_t len)
+{
+    int fixed = -1;
 
-        CLEAR(buf);
+    if (plane >= 0 && index < s->uring_cap_registered)
+        fixed = s->uring_cap_base + index * s->uring_cap_planes + plane;
 
-        buf.type   = type;
-        buf.memory = V4L2_MEMORY_MMAP;
-        buf.index  = b;
-        /* length in struct v4l2_buffer in multi-planar API stores the size
-         * of planes array. */
-        buf.length   = FMT_NUM_PLANES;
-        buf.m.planes = planes;
+    uring_write(s->uring, fileno(s->out_fp), ptr, len, s->out_offset, fixed,
+                ((uint64_t)len << 8) | index);
+    s->out_offset += len;
+    s->bytes_written += len;
+    s->uring_writes++;
+    s->uring_pending[index]++;
+}
+
+static void uring_write_frame(struct session *s, const struct v4l2_buffer *buf)
+{
+    struct writer_job *job = &s->uring_jobs[buf->index];
+    unsigned int p;
 
-        if (-1 == xioctl(fd, VIDIOC_QUERYBUF, &buf))
-            errno_exit("VIDIOC_QUERYBUF");
+    job->buf = *buf;
+    if (V4L2_TYPE_IS_MULTIPLANAR(buf->type)) {
+        memcpy(job->planes, buf->m.planes, sizeof(job->planes));
+        job->buf.m.planes = job->planes;
+    }
 
-        fprintf(stderr, "Mapping buffer %u:\n", b);
-        for (p = 0; p < FMT_NUM_PLANES; ++p) {
-            fprintf(stderr, "Mapping plane %u, len %u\n", p, 
-                    buf.m.planes[p].length);
+    open_output(s);
+    if (s->out_fp && s->pack_ok) {
+        unsigned char *dst = pack_buf(s, buf->index);
+        size_t n = pack_capture(s, &job->buf, dst);
 
-            bufs[b].length[p] = buf.m.planes[p].length;
-            bufs[b].start[p] = 
-                mmap(NULL, 
-                     buf.m.planes[p].length,
-                     PROT_READ | PROT_WRITE, /* required */
-                     MAP_SHARED,             /* recommended */
-                     fd, buf.m.planes[p].m.mem_offset);
+        if (n)
+            uring_write_plane(s, buf->index, -1, dst, n);
+    } else if (s->out_fp && V4L2_TYPE_IS_MULTIPLANAR(buf->type)) {
+        const struct buffer_mp *b = &s->buffers_mp[buf->index];
 
-            if (MAP_FAILED == bufs[b].start[p])
-                errno_exit("mmap");
+        for (p = 0; p < buf->length; ++p) {
+            const struct v4l2_plane *plane = &job->planes[p];
+
+            if (plane->bytesused > plane->data_offset)
+                uring_write_plane(s, buf->index, p, (char *)b->start[p] + plane->data_offset,
+                                  plane->bytesused - plane->data_offset);
         }
+    } else if (s->out_fp && buf->bytesused) {
+        uring_write_plane(s, buf->index, 0, s->buffers[buf->index].start, buf->bytesused);
     }
-    *n_bufs = b;
-    *bufs_out = bufs;
+
+    if (!s->uring_pending[buf->index]) {
+        requeue_job(s, job);
+        return;
+    }
+
+    uring_submit(s->uring);
+    log_frame("Writing %u bytes of buffer %u\n", buf->bytesused, buf->index);
 }
 
-static void init_userp(unsigned int buffer_size)
+static void readahead_submit(struct session *s, unsigned int slot)
 {
-    struct v4l2_requestbuffers req;
-
-    CLEAR(req);
+    uring_read(s->uring, fileno(s->in_fp), s->ra_chunks + (size_t)slot * READAHEAD_CHUNK,
+               READAHEAD_CHUNK, s->ra_next, s->ra_fixed ? (int)slot : -1, URING_READ_TAG | slot);
+    s->ra_busy[slot] = 1;
+    s->ra_next += READAHEAD_CHUNK;
+    s->ra_head++;
+}
 
-    req.count  = 4;
-    req.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    req.memory = V4L2_MEMORY_USERPTR;
+/* Wait for the reads in flight, keeping what they read. */
+static void readahead_drain(struct session *s)
+{
+    unsigned int i;
 
-    if (-1 == xioctl(fd, VIDIOC_REQBUFS, &req)) {
-        if (EINVAL == errno) {
-            fprintf(stderr, "%s does not support "
-                 "user pointer i/o\n", dev_name);
-            exit(EXIT_FAILURE);
-        } else {
-            errno_exit("VIDIOC_REQBUFS");
-        }
+    for (i = 0; i < READAHEAD_CHUNKS; ++i) {
+        while (s->ra_busy[i])
+            uring_reap_wait(s);
     }
+}
 
-    buffers = calloc(4, sizeof(*buffers));
+/* Drop the window and start reading ahead from offset. */
+static void readahead_seek(struct session *s, uint64_t offset)
+{
+    unsigned int i;
 
-    if (!buffers) {
-        fprintf(stderr, "Out of memory\n");
-        exit(EXIT_FAILURE);
-    }
+    readahead_drain(s);
 
-    for (n_buffers = 0; n_buffers < 4; ++n_buffers) {
-        buffers[n_buffers].length = buffer_size;
-        buffers[n_buffers].start = malloc(buffer_size);
+    s->ra_win_offset = offset;
+    s->ra_win_pos    = 0;
+    s->ra_win_len    = 0;
+    s->ra_next       = offset;
+    s->ra_head       = 0;
+    s->ra_tail       = 0;
+    s->ra_eof        = 0;
+    s->ra_started    = 1;
 
-        if (!buffers[n_buffers].start) {
+    for (i = 0; i < READAHEAD_CHUNKS; ++i)
+        readahead_submit(s, i);
+    uring_submit(s->uring);
+}
+
+/*
+ * Return the input at offset with at least want bytes after it, unless the
+ * file ends first, and set *avail to the bytes there are. Only blocks if the
+ * chunks needed haven't been read yet.
+ */
+static const unsigned char *readahead_get(struct session *s, uint64_t offset, size_t want,
+                                          size_t *avail)
+{
+    if (!s->ra_started || offset < s->ra_win_offset || offset > s->ra_win_offset + s->ra_win_len)
+        readahead_seek(s, offset);
+    s->ra_win_pos = offset - s->ra_win_offset;
+
+    /* Room to append a chunk whenever less than want is left, without moving data each time. */
+    if (s->ra_win_size < 2 * want + READAHEAD_CHUNK) {
+        s->ra_win_size = 2 * want + READAHEAD_CHUNK;
+        s->ra_win = realloc(s->ra_win, s->ra_win_size);
+        if (!s->ra_win) {
             fprintf(stderr, "Out of memory\n");
             exit(EXIT_FAILURE);
         }
     }
-}
 
-static void init_device_out(void)
-{
-    struct v4l2_cropcap cropcap;
-    struct v4l2_crop crop;
-    struct v4l2_format fmt;
-    unsigned int min;
+    while (s->ra_win_len - s->ra_win_pos < want && s->ra_tail != s->ra_head) {
+        unsigned int slot = s->ra_tail % READAHEAD_CHUNKS;
+        int got;
 
-    CLEAR(cropcap);
+        while (s->ra_busy[slot])
+            uring_reap_wait(s);
 
-    cropcap.type = stream_type(V4L2_BUF_TYPE_VIDEO_OUTPUT);
+        got = s->ra_result[slot];
+        if (got < 0) {
+            errno = -got;
+            errno_exit("read");
+        }
 
-    if (0 == xioctl(fd, VIDIOC_CROPCAP, &cropcap)) {
-        crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        crop.c = cropcap.defrect; /* reset to default */
+        if (s->ra_win_len + READAHEAD_CHUNK > s->ra_win_size) {
+            s->ra_win_len -= s->ra_win_pos;
+            memmove(s->ra_win, s->ra_win + s->ra_win_pos, s->ra_win_len);
+            s->ra_win_offset += s->ra_win_pos;
+            s->ra_win_pos = 0;
+        }
 
-        if (-1 == xioctl(fd, VIDIOC_S_CROP, &crop)) {
-            switch (errno) {
-            case EINVAL:
-                /* Cropping not supported. */
-                break;
-            default:
-                /* Errors ignored. */
-                break;
-            }
+        memcpy(s->ra_win + s->ra_win_len, s->ra_chunks + (size_t)slot * READAHEAD_CHUNK, got);
+        s->ra_win_len += got;
+        s->ra_tail++;
+
+        if (got < READAHEAD_CHUNK)
+            s->ra_eof = 1;
+        if (!s->ra_eof) {
+            readahead_submit(s, slot);
+            uring_submit(s->uring);
         }
-    } else {
-        /* Errors ignored. */
     }
 
+    *avail = s->ra_win_len - s->ra_win_pos;
+    return s->ra_win + s->ra_win_pos;
+}
 
-    CLEAR(fmt);
+/*
+ * Register the read-ahead chunks and the CAPTURE planes, so neither has its
+ * pages pinned on every request. Device memory usually can't be registered,
+ * in which case only the chunks are.
+ */
+static void uring_register_buffers(struct session *s)
+{
+    struct iovec iov[READAHEAD_CHUNKS + VIDEO_MAX_FRAME * VIDEO_MAX_PLANES];
+    unsigned int n = 0, b, p;
+    int err;
 
-    fmt.type = stream_type(V4L2_BUF_TYPE_VIDEO_OUTPUT);
+    /* Nothing may use the old registrations while they are replaced. */
+    readahead_drain(s);
 
-    if (-1 == xioctl(fd, VIDIOC_G_FMT, &fmt))
-        errno_exit("VIDIOC_G_FMT");
+    s->ra_fixed = 0;
+    s->uring_cap_registered = 0;
 
-    if (force_format) {
-        if (multi_planar) {
-            fmt.fmt.pix_mp.width       = 1920;
-            fmt.fmt.pix_mp.height      = 1080;
-            fmt.fmt.pix_mp.pixelformat = V4L2_PIX_FMT_H264;
-            fmt.fmt.pix_mp.field       = V4L2_FIELD_NONE;
-        } else {
-            fmt.fmt.pix.width       = 640;
-            fmt.fmt.pix.height      = 480;
-            fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_H264;
-            fmt.fmt.pix.field       = V4L2_FIELD_NONE;
+    for (b = 0; s->ra_chunks && b < READAHEAD_CHUNKS; ++b) {
+        iov[n].iov_base = s->ra_chunks + (size_t)b * READAHEAD_CHUNK;
+        iov[n].iov_len  = READAHEAD_CHUNK;
+        n++;
+    }
+
+    s->uring_cap_base   = n;
+    s->uring_cap_planes = s->multi_planar ? queue_planes(s, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) : 1;
+    for (b = 0; s->io != IO_METHOD_READ && b < s->n_buffers; ++b) {
+        for (p = 0; p < s->uring_cap_planes; ++p) {
+            iov[n].iov_base = s->multi_planar ? s->buffers_mp[b].start[p] : s->buffers[b].start;
+            iov[n].iov_len  = s->multi_planar ? s->buffers_mp[b].length[p] : s->buffers[b].length;
+            n++;
         }
+    }
 
-        if (-1 == xioctl(fd, VIDIOC_S_FMT, &fmt))
-            errno_exit("VIDIOC_S_FMT");
+    if (n && !uring_register(s->uring, iov, n)) {
+        s->ra_fixed = s->ra_chunks != NULL;
+        s->uring_cap_registered = (n - s->uring_cap_base) / s->uring_cap_planes;
+        log_debug("Registered %u buffers for async i/o\n", n);
+        return;
+    }
 
-        /* Note VIDIOC_S_FMT may change width and height. */
+    err = errno;
+    if (s->uring_cap_base && n > s->uring_cap_base && !uring_register(s->uring, iov, s->uring_cap_base)) {
+        s->ra_fixed = 1;
+        log_debug("Registered the read-ahead buffers only, CAPTURE buffers: %s\n", strerror(err));
+        return;
     }
 
-    /* Buggy driver paranoia. */
-    if (multi_planar) {
-        unsigned int p;
+    if (n)
+        log_debug("No registered buffers for async i/o: %s\n", strerror(err));
+}
 
-        for (p = 0; p < FMT_NUM_PLANES; ++p) {
-            min = fmt.fmt.pix_mp.width * 2;
-            if (fmt.fmt.pix_mp.plane_fmt[p].bytesperline > 0 &&
-                fmt.fmt.pix_mp.plane_fmt[p].bytesperline < min)
-                fmt.fmt.pix_mp.plane_fmt[p].bytesperline = min;
-            min = fmt.fmt.pix_mp.plane_fmt[p].bytesperline * fmt.fmt.pix_mp.height;
-            if (fmt.fmt.pix_mp.plane_fmt[p].sizeimage > 0 &&
-                fmt.fmt.pix_mp.plane_fmt[p].sizeimage < min)
-                fmt.fmt.pix_mp.plane_fmt[p].sizeimage = min;
-        }
-    } else {
-        min = fmt.fmt.pix.width * 2;
-        if (fmt.fmt.pix.bytesperline < min)
-            fmt.fmt.pix.bytesperline = min;
-        min = fmt.fmt.pix.bytesperline * fmt.fmt.pix.height;
-        if (fmt.fmt.pix.sizeimage < min)
-            fmt.fmt.pix.sizeimage = min;
+static void uring_start(struct session *s)
+{
+    if (!s->use_uring)
+        return;
+
+    s->uring = uring_open(READAHEAD_CHUNKS + VIDEO_MAX_FRAME * VIDEO_MAX_PLANES, s->use_uring > 1);
+
+    if (s->in_fp) {
+        s->ra_chunks = mmap(NULL, (size_t)READAHEAD_CHUNKS * READAHEAD_CHUNK, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (MAP_FAILED == s->ra_chunks)
+            errno_exit("mmap");
     }
 
-    switch (io) {
-    case IO_METHOD_READ:
-        init_read(fmt.fmt.pix.sizeimage);
-        break;
+    uring_register_buffers(s);
+    log_info("Async file i/o on %s\n", uring_backend(s->uring));
+}
 
-    case IO_METHOD_MMAP:
-        if (multi_planar)
-            init_mmap_mp(V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE, &buffers_mp_out, &n_buffers_out);
-        else
-            init_mmap(V4L2_BUF_TYPE_VIDEO_OUTPUT, &buffers_out, &n_buffers_out);
-        break;
+static void readahead_stop(struct session *s)
+{
+    if (!s->ra_chunks)
+        return;
+
+    readahead_drain(s);
+    munmap(s->ra_chunks, (size_t)READAHEAD_CHUNKS * READAHEAD_CHUNK);
+    free(s->ra_win);
+    s->ra_chunks  = NULL;
+    s->ra_win     = NULL;
+    s->ra_started = 0;
+}
 
-    case IO_METHOD_USERPTR:
-        init_userp(fmt.fmt.pix.sizeimage);
-        break;
+static void uring_stop(struct session *s)
+{
+    if (!s->uring)
+        return;
+
+    uring_close(s->uring);
+    s->uring = NULL;
+}
+
+static void requeue_capture(struct session *s, unsigned int index)
+{
+    struct v4l2_buffer buf;
+    struct v4l2_plane  planes[VIDEO_MAX_PLANES];
+
+    CLEAR(buf);
+    CLEAR(planes);
+
+    buf.type   = stream_type(s, V4L2_BUF_TYPE_VIDEO_CAPTURE);
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.index  = index;
+    buf.flags  = V4L2_BUF_FLAG_NO_CACHE_INVALIDATE | V4L2_BUF_FLAG_NO_CACHE_CLEAN;
+    if (s->multi_planar) {
+        buf.length   = queue_planes(s, buf.type);
+        buf.m.planes = planes;
     }
 
-    struct v4l2_event_subscription sub;
+    if (-1 == xioctl(s->fd, VIDIOC_QBUF, &buf))
+        errno_exit("VIDIOC_QBUF");
+    capture_queued(s);
+}
 
-    CLEAR(sub);
+static void null_sink_open(struct session *s, const char *arg)
+{
+    (void)s;
+    (void)arg;
+}
 
-    sub.type = V4L2_EVENT_EOS;
-    if (-1 == ioctl(fd, VIDIOC_SUBSCRIBE_EVENT, &sub))
-        errno_exit("VIDIOC_SUBSCRIBE_EVENT");
+static int null_sink_frame(struct session *s, const struct v4l2_buffer *buf,
+                           const int *fds, unsigned int n_fds)
+{
+    (void)s;
+    (void)fds;
 
-    sub.type = V4L2_EVENT_SOURCE_CHANGE;
-    if (-1 == ioctl(fd, VIDIOC_SUBSCRIBE_EVENT, &sub))
-        errno_exit("VIDIOC_SUBSCRIBE_EVENT");
+    log_frame("Dropped exported buffer %u, %u planes\n", buf->index, n_fds);
+    return 0;
 }
 
-static void init_device(void)
+static void null_sink_nop(struct session *s)
 {
-    struct v4l2_capability cap;
-    struct v4l2_cropcap cropcap;
-    struct v4l2_crop crop;
-    struct v4l2_format fmt;
-    unsigned int min;
+    (void)s;
+}
 
-    if (-1 == xioctl(fd, VIDIOC_QUERYCAP, &cap)) {
-        if (EINVAL == errno) {
-            fprintf(stderr, "%s is no V4L2 device\n",
-                    dev_name);
-            exit(EXIT_FAILURE);
-        } else {
-            errno_exit("VIDIOC_QUERYCAP");
-        }
+static int unix_connect(const char *path)
+{
+    struct sockaddr_un addr;
+    int sock;
+
+    if (!path || strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Bad socket path %s\n", path ? path : "(none)");
+        exit(EXIT_FAILURE);
     }
-/*
-bcm2835-v4l2
-8520 0005
-V4L2_CAP_VIDEO_CAPTURE
-V4L2_CAP_VIDEO_OVERLAY
-V4L2_CAP_EXT_PIX_FORMAT
-V4L2_CAP_READWRITE
-V4L2_CAP_STREAMING
-V4L2_CAP_DEVICE_CAPS
 
-bcm2835-codec
-8420 4000
-V4L2_CAP_VIDEO_M2M_MPLANE
-V4L2_CAP_EXT_PIX_FORMAT
-V4L2_CAP_STREAMING
-V4L2_CAP_DEVICE_CAPS
-*/
-    fprintf(stderr, "caps returned %04x\n", cap.capabilities);
-    if (!(cap.capabilities & (V4L2_CAP_VIDEO_M2M|V4L2_CAP_VIDEO_M2M_MPLANE|V4L2_CAP_VIDEO_CAPTURE))) {
-        fprintf(stderr, "%s is no video capture device\n",
-                dev_name);
+    sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (-1 == sock)
+        errno_exit("socket");
+
+    CLEAR(addr);
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if (-1 == connect(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+        fprintf(stderr, "Cannot connect to '%s': %d, %s\n",
+                path, errno, strerror(errno));
         exit(EXIT_FAILURE);
     }
 
-    if (cap.capabilities & V4L2_CAP_VIDEO_M2M_MPLANE)
-        multi_planar = 1;
+    return sock;
+}
 
-    switch (io) {
-    case IO_METHOD_READ:
-        if (!(cap.capabilities & V4L2_CAP_READWRITE)) {
-            fprintf(stderr, "%s does not support read i/o\n",
-                    dev_name);
-            exit(EXIT_FAILURE);
+static void unix_sink_open(struct session *s, const char *path)
+{
+    s->sink_fd = unix_connect(path);
+}
+
+static void unix_sink_send(struct session *s, const struct dmabuf_msg *msg, const int *fds, unsigned int n_fds)
+{
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int) * VIDEO_MAX_PLANES)];
+    } cmsg;
+    struct msghdr mh;
+    struct iovec iov;
+
+    CLEAR(mh);
+    iov.iov_base = (void *)msg;
+    iov.iov_len  = sizeof(*msg);
+    mh.msg_iov    = &iov;
+    mh.msg_iovlen = 1;
+
+    if (n_fds) {
+        CLEAR(cmsg);
+        mh.msg_control    = cmsg.buf;
+        mh.msg_controllen = CMSG_SPACE(sizeof(int) * n_fds);
+        cmsg.hdr.cmsg_level = SOL_SOCKET;
+        cmsg.hdr.cmsg_type  = SCM_RIGHTS;
+        cmsg.hdr.cmsg_len   = CMSG_LEN(sizeof(int) * n_fds);
+        memcpy(CMSG_DATA(&cmsg.hdr), fds, sizeof(int) * n_fds);
+    }
+
+    while (-1 == sendmsg(s->sink_fd, &mh, MSG_NOSIGNAL))
+        if (EINTR != errno)
+            errno_exit("sendmsg");
+}
+
+static int unix_sink_frame(struct session *s, const struct v4l2_buffer *buf, const int *fds, unsigned int n_fds)
+{
+    struct dmabuf_msg msg;
+    unsigned int p;
+
+    CLEAR(msg);
+    msg.type         = DMABUF_MSG_FRAME;
+    msg.index        = buf->index;
+    msg.num_planes   = n_fds;
+    msg.sequence     = buf->sequence;
+    msg.timestamp_us = buf->timestamp.tv_sec * 1000000ULL + buf->timestamp.tv_usec;
+
+    if (s->multi_planar) {
+        msg.width       = s->cap_fmt.fmt.pix_mp.width;
+        msg.height      = s->cap_fmt.fmt.pix_mp.height;
+        msg.pixelformat = s->cap_fmt.fmt.pix_mp.pixelformat;
+        for (p = 0; p < n_fds; ++p) {
+            msg.bytesused[p]    = buf->m.planes[p].bytesused;
+            msg.bytesperline[p] = s->cap_fmt.fmt.pix_mp.plane_fmt[p].bytesperline;
         }
-        break;
+    } else {
+        msg.width           = s->cap_fmt.fmt.pix.width;
+        msg.height          = s->cap_fmt.fmt.pix.height;
+        msg.pixelformat     = s->cap_fmt.fmt.pix.pixelformat;
+        msg.bytesused[0]    = buf->bytesused;
+        msg.bytesperline[0] = s->cap_fmt.fmt.pix.bytesperline;
+    }
 
-    case IO_METHOD_MMAP:
-    case IO_METHOD_USERPTR:
-        if (!(cap.capabilities & V4L2_CAP_STREAMING)) {
-            fprintf(stderr, "%s does not support streaming i/o\n",
-                    dev_name);
+    unix_sink_send(s, &msg, fds, n_fds);
+    s->sink_held++;
+
+    return 1;
+}
+
+/* Requeue whatever the consumer has released; returns 1 on a flush ack. */
+static int unix_sink_recv(struct session *s, int flags)
+{
+    uint32_t index;
+    ssize_t r;
+
+    for (;;) {
+        r = recv(s->sink_fd, &index, sizeof(index), flags);
+        if (-1 == r) {
+            if (EINTR == errno)
+                continue;
+            if (EAGAIN == errno)
+                return 0;
+            errno_exit("recv");
+        }
+        if (0 == r) {
+            fprintf(stderr, "Sink consumer went away\n");
             exit(EXIT_FAILURE);
         }
-        break;
+
+        if (index == DMABUF_RELEASE_ALL)
+            return 1;
+
+        assert(s->sink_held > 0);
+        s->sink_held--;
+        requeue_capture(s, index);
+        flags |= MSG_DONTWAIT;
     }
+}
 
+static void unix_sink_release(struct session *s)
+{
+    unix_sink_recv(s, MSG_DONTWAIT);
+}
 
-    /* Select video input, video standard and tune here. */
+static void unix_sink_flush(struct session *s)
+{
+    struct dmabuf_msg msg;
 
-    CLEAR(cropcap);
+    CLEAR(msg);
+    msg.type = DMABUF_MSG_FLUSH;
+    unix_sink_send(s, &msg, NULL, 0);
 
-    cropcap.type = stream_type(V4L2_BUF_TYPE_VIDEO_CAPTURE);
+    while (!unix_sink_recv(s, 0))
+        ;
+    s->sink_held = 0;
+}
 
-    if (0 == xioctl(fd, VIDIOC_CROPCAP, &cropcap)) {
-        crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        crop.c = cropcap.defrect; /* reset to default */
+static void unix_sink_close(struct session *s)
+{
+    close(s->sink_fd);
+    s->sink_fd = -1;
+}
 
-        if (-1 == xioctl(fd, VIDIOC_S_CROP, &crop)) {
-            switch (errno) {
-            case EINVAL:
-                /* Cropping not supported. */
-                break;
-                
-            default:
-                /* Errors ignored. */
-                break;
-            }
+static const struct frame_sink frame_sinks[] = {
+    { "null", null_sink_open, null_sink_frame, null_sink_nop,     null_sink_nop,   null_sink_nop },
+    { "unix", unix_sink_open, unix_sink_frame, unix_sink_release, unix_sink_flush, unix_sink_close },
+};
+
+/* Parse "name[:arg]" */
+static void select_sink(struct session *s, char *spec)
+{
+    char *arg = strchr(spec, ':');
+    unsigned int i;
+
+    if (arg)
+        *arg++ = '\0';
+
+    for (i = 0; i < sizeof(frame_sinks) / sizeof(frame_sinks[0]); ++i) {
+        if (!strcmp(spec, frame_sinks[i].name)) {
+            s->sink     = &frame_sinks[i];
+            s->sink_arg = arg;
+            return;
         }
+    }
+
+    fprintf(stderr, "Unknown sink %s\n", spec);
+    exit(EXIT_FAILURE);
+}
+
+static void sink_frame(struct session *s, const struct v4l2_buffer *buf)
+{
+    int fds[VIDEO_MAX_PLANES];
+    unsigned int p, n_fds;
+
+    if (s->multi_planar) {
+        n_fds = s->buffers_mp[buf->index].num_planes;
+        for (p = 0; p < n_fds; ++p)
+            fds[p] = s->buffers_mp[buf->index].dmabuf_fd[p];
     } else {
-        /* Errors ignored. */
+        n_fds  = 1;
+        fds[0] = s->buffers[buf->index].dmabuf_fd;
     }
 
+    if (!s->sink->frame(s, buf, fds, n_fds))
+        requeue_capture(s, buf->index);
+}
 
-    CLEAR(fmt);
+static void export_buffer(struct session *s, enum v4l2_buf_type type, unsigned int index,
+                          unsigned int plane, int *dmabuf_fd)
+{
+    struct v4l2_exportbuffer expbuf;
 
-    fmt.type = stream_type(V4L2_BUF_TYPE_VIDEO_CAPTURE);
+    CLEAR(expbuf);
+    expbuf.type  = type;
+    expbuf.index = index;
+    expbuf.plane = plane;
+    expbuf.flags = O_CLOEXEC | O_RDONLY;
 
-    if (-1 == xioctl(fd, VIDIOC_G_FMT, &fmt))
-        errno_exit("VIDIOC_G_FMT");
+    if (-1 == xioctl(s->fd, VIDIOC_EXPBUF, &expbuf))
+        errno_exit("VIDIOC_EXPBUF");
 
-    if (force_format) {
-        if (multi_planar) {
-            fmt.fmt.pix_mp.width       = 1920;
-            fmt.fmt.pix_mp.height      = 1080;
-            fmt.fmt.pix_mp.pixelformat = V4L2_PIX_FMT_YUV420;
-            fmt.fmt.pix_mp.field       = V4L2_FIELD_NONE;
-        } else {
-            fmt.fmt.pix.width       = 640;
-            fmt.fmt.pix.height      = 480;
-            fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUV420;
-            fmt.fmt.pix.field       = V4L2_FIELD_NONE;
+    *dmabuf_fd = expbuf.fd;
+}
+
+static void close_au_index(struct session *s)
+{
+    if (s->au_index_map)
+        munmap(s->au_index_map, s->au_index_map_len);
+    else
+        free(s->au_index);
+
+    s->au_index_map = NULL;
+    s->au_index     = NULL;
+    s->au_count     = 0;
+    s->au_alloc     = 0;
+
+    free(s->au_pick);
+    free(s->param_sets_buf);
+    s->au_pick        = NULL;
+    s->au_pick_count  = 0;
+    s->param_sets_buf = NULL;
+}
+
+/* Returns -1, with the parameter set prefix in bytesused, if the index had to be dropped. */
+static int supply_input_indexed(struct session *s, void *buf, unsigned int buf_len, unsigned int *bytesused)
+{
+    const struct au_entry *au;
+    unsigned char *dst = buf;
+    size_t size, prefix = 0, got, k;
+    uint64_t offset;
+
+    if (s->au_pick) {
+        if (s->au_pick_next >= s->au_pick_count) {
+            *bytesused = 0;
+            return 0;
         }
+        k = s->au_pick[s->au_pick_next];
+    } else {
+        if (s->au_next >= s->au_count || (s->end_au >= 0 && s->au_next >= (size_t)s->end_au)) {
+            *bytesused = 0;
+            return 0;
+        }
+        k = s->au_next;
+    }
 
-        if (-1 == xioctl(fd, VIDIOC_S_FMT, &fmt))
-            errno_exit("VIDIOC_S_FMT");
+    /* Starting mid-stream, the first AU may need the parameter sets from its start. */
+    if (s->param_sets && !s->param_sets_sent && s->param_sets_len < buf_len) {
+        prefix = s->param_sets_len;
+        memcpy(dst, s->param_sets, prefix);
+        dst += prefix;
+        buf_len -= prefix;
+        s->param_sets_sent = 1;
+    }
 
-        /* Note VIDIOC_S_FMT may change width and height. */
+    au = &s->au_index[k];
+    offset = au->offset + s->au_sent;
+    size = au->size - s->au_sent;
+    if (size > buf_len) {
+        if (!s->au_sent)
+            log_warn("Access unit %zu of %u bytes split across buffers of %u\n", k, au->size, buf_len);
+        size = buf_len;
     }
 
-    /* Buggy driver paranoia. */
-    if (multi_planar) {
-        unsigned int p;
+    if (s->in_map) {
+        memcpy(dst, s->in_map + offset, size);
+        got = size;
+    } else if (s->ra_chunks) {
+        const unsigned char *data = readahead_get(s, offset, size, &got);
 
-        for (p = 0; p < FMT_NUM_PLANES; ++p) {
-            min = fmt.fmt.pix_mp.width * 2;
-            if (fmt.fmt.pix_mp.plane_fmt[p].bytesperline > 0 &&
-                fmt.fmt.pix_mp.plane_fmt[p].bytesperline < min)
-                fmt.fmt.pix_mp.plane_fmt[p].bytesperline = min;
-            min = fmt.fmt.pix_mp.plane_fmt[p].bytesperline * fmt.fmt.pix_mp.height;
-            if (fmt.fmt.pix_mp.plane_fmt[p].sizeimage > 0 &&
-                fmt.fmt.pix_mp.plane_fmt[p].sizeimage < min)
-                fmt.fmt.pix_mp.plane_fmt[p].sizeimage = min;
-        }
+        if (got > size)
+            got = size;
+        memcpy(dst, data, got);
     } else {
-        min = fmt.fmt.pix.width * 2;
-        if (fmt.fmt.pix.bytesperline < min)
-            fmt.fmt.pix.bytesperline = min;
-        min = fmt.fmt.pix.bytesperline * fmt.fmt.pix.height;
-        if (fmt.fmt.pix.sizeimage < min)
-            fmt.fmt.pix.sizeimage = min;
+        ssize_t r = pread(fileno(s->in_fp), dst, size, offset);
+
+        if (-1 == r)
+            errno_exit("pread");
+        got = r;
     }
 
-    switch (io) {
-    case IO_METHOD_READ:
-        init_read(fmt.fmt.pix.sizeimage);
-        break;
+    /* The input shrank under the index; carry on by scanning from here. */
+    if (got < size) {
+        log_warn("Short read of AU %zu, dropping the index\n", k);
+        s->f_offset   = offset;
+        s->in_map_pos = offset;
+        s->au_sent    = 0;
+        s->param_sets = NULL;
+        close_au_index(s);
+        *bytesused = prefix;
+        return -1;
+    }
 
-    case IO_METHOD_MMAP:
-        if (multi_planar)
-            init_mmap_mp(V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE, &buffers_mp, &n_buffers);
+    /* The rest of an AU that didn't fit goes in the next buffer. */
+    s->au_sent += size;
+    if (s->au_sent == au->size) {
+        s->au_sent = 0;
+        if (s->au_pick)
+            s->au_pick_next++;
         else
-            init_mmap(V4L2_BUF_TYPE_VIDEO_CAPTURE, &buffers, &n_buffers);
-        break;
+            s->au_next++;
+    }
 
-    case IO_METHOD_USERPTR:
-        init_userp(fmt.fmt.pix.sizeimage);
-        break;
+    s->in_bytes_delivered += size;
+    *bytesused = prefix + size;
+
+    log_frame("Used AU %zu, %u bytes at offset %llu%s\n", k, *bytesused,
+            (unsigned long long)offset, au->flags & AU_FLAG_KEYFRAME ? " (keyframe)" : "");
+    return 0;
+}
+
+/* The same as supply_input_mapped(), on the read-ahead window at f_offset */
+static void supply_input_ahead(struct session *s, void *buf, unsigned int buf_len, unsigned int *bytesused)
+{
+    struct au_state st;
+    size_t avail, au_len;
+    const unsigned char *data = readahead_get(s, s->f_offset, buf_len, &avail);
+
+    if (avail > buf_len)
+        avail = buf_len;
+
+    /* One too big is cut at buf_len; the rest is scanned again, and sent, from the next buffer. */
+    au_len = au_length(s, data, data + avail, &st);
+    if (au_len == buf_len)
+        log_warn("Access unit at %lu split across buffers of %u bytes\n", s->f_offset, buf_len);
+
+    memcpy(buf, data, au_len);
+    s->f_offset += au_len;
+    s->in_bytes_scanned += au_len;
+    s->in_bytes_delivered += au_len;
+    *bytesused = au_len;
+
+    log_frame("Used %u bytes of read-ahead input at offset %lu\n", *bytesused, s->f_offset - au_len);
+}
+
+static void supply_input_by_au(struct session *s, void *buf, unsigned int buf_len, unsigned int *bytesused)
+{
+    unsigned char *buf_char = (unsigned char*)buf;
+    size_t bytes_read, au_len;
+    struct au_state st;
+
+    if (s->au_index) {
+        unsigned int prefix;
+
+        if (0 == supply_input_indexed(s, buf, buf_len, bytesused))
+            return;
+        prefix = *bytesused;
+        supply_input_by_au(s, buf_char + prefix, buf_len - prefix, bytesused);
+        *bytesused += prefix;
+        return;
     }
-    if (cap.capabilities & (V4L2_CAP_VIDEO_M2M|V4L2_CAP_VIDEO_M2M_MPLANE)) {
-        init_device_out();
-        m2m_enabled = 1;
-        if (in_filename) {
-            in_fp = fopen(in_filename, "rb");
-            if (!in_fp)
-                fprintf(stderr, "Failed to open input file %s\n", in_filename);
+
+    if (s->in_map) {
+        supply_input_mapped(s, buf, buf_len, bytesused);
+        return;
+    }
+
+    if (s->ra_chunks) {
+        supply_input_ahead(s, buf, buf_len, bytesused);
+        return;
+    }
+
+    if (!s->in_fp) {
+        *bytesused = 0;
+        return;
+    }
+
+    fseek(s->in_fp, s->f_offset, SEEK_SET);
+    bytes_read = fread(buf, 1, buf_len, s->in_fp);
+    s->in_bytes_scanned += bytes_read;
+
+    au_len = au_length(s, buf, buf_char + bytes_read, &st);
+    if (au_len == buf_len)
+        log_warn("Access unit at %lu split across buffers of %u bytes\n", s->f_offset, buf_len);
+
+    s->f_offset += au_len;
+    *bytesused = au_len;
+    s->in_bytes_delivered += au_len;
+
+    memset(buf_char + au_len, 0, buf_len - au_len);
+
+    log_frame("Used %u bytes. First 8 bytes %02x %02x %02x %02x %02x %02x %02x %02x\n", 
+            *bytesused, 
+            buf_char[0], buf_char[1], buf_char[2], buf_char[3],
+            buf_char[4], buf_char[5], buf_char[6], buf_char[7]);
+}
+
+/*
+ * Fill an OUTPUT buffer with the next AU. Compressed formats have a single
+ * plane; should there be more, the AU goes in plane 0 and the rest are left
+ * empty. Returns the bytes used.
+ */
+static unsigned int supply_input_mp(struct session *s, const struct buffer_mp *b, struct v4l2_buffer *buf)
+{
+    unsigned int p, bytes;
+
+    supply_input_by_au(s, b->start[0], b->length[0], &bytes);
+    buf->m.planes[0].bytesused = bytes;
+    for (p = 1; p < buf->length; ++p)
+        buf->m.planes[p].bytesused = 0;
+
+    return bytes;
+}
+
+/*
+ * Every queued AU gets a sequence number as its OUTPUT timestamp, which the
+ * decoder copies to the CAPTURE buffer of the frame it produces. The tag
+ * looks up the AU's submit time, giving the decode latency, and how far
+ * behind the newest AU seen so far it comes out, giving the reorder depth.
+ */
+static void tag_output(struct session *s, struct v4l2_buffer *buf)
+{
+    uint64_t seq = ++s->out_seq;
+    struct au_submit *sub = &s->submits[seq & (LATENCY_RING_SIZE - 1)];
+
+    buf->timestamp.tv_sec  = seq / 1000000;
+    buf->timestamp.tv_usec = seq % 1000000;
+    sub->seq       = seq;
+    sub->submit_ns = monotonic_ns();
+
+    __atomic_add_fetch(&s->out_queued, 1, __ATOMIC_RELAXED);
+}
+
+static void frame_stats(struct session *s, const struct v4l2_buffer *buf)
+{
+    uint64_t seq = buf->timestamp.tv_sec * 1000000ULL + buf->timestamp.tv_usec;
+    const struct au_submit *sub = &s->submits[seq & (LATENCY_RING_SIZE - 1)];
+    unsigned int bytesused = V4L2_TYPE_IS_MULTIPLANAR(buf->type) ? buf->m.planes[0].bytesused : buf->bytesused;
+
+    s->bytes_out += bytesused;
+
+    /* Empty LAST buffers, and tags that already left the ring */
+    if (!bytesused || !seq || sub->seq != seq)
+        return;
+
+    if (s->lat_count == s->lat_alloc) {
+        s->lat_alloc = s->lat_alloc ? s->lat_alloc * 2 : 1024;
+        s->lat_us    = realloc(s->lat_us, s->lat_alloc * sizeof(*s->lat_us));
+        s->reorder   = realloc(s->reorder, s->lat_alloc * sizeof(*s->reorder));
+        if (!s->lat_us || !s->reorder) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
         }
     }
+
+    if (seq > s->max_seq_out)
+        s->max_seq_out = seq;
+    s->lat_us[s->lat_count]  = (monotonic_ns() - sub->submit_ns) / 1000;
+    s->reorder[s->lat_count] = s->max_seq_out - seq;
+    s->lat_count++;
 }
 
-static void close_device(void)
+static int cmp_u32(const void *a, const void *b)
 {
-    if (-1 == close(fd))
-        errno_exit("close");
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Value at percentile pct of v[0..n), which must be sorted. */
+static uint32_t percentile(const uint32_t *v, size_t n, unsigned int pct)
+{
+    return v[(n - 1) * pct / 100];
+}
+
+static void report_latency(struct session *s)
+{
+    size_t n = s->lat_count;
+
+    if (!n)
+        return;
+
+    qsort(s->lat_us, n, sizeof(*s->lat_us), cmp_u32);
+    qsort(s->reorder, n, sizeof(*s->reorder), cmp_u32);
+    s->lat_p50_us = percentile(s->lat_us, n, 50);
+    s->lat_p99_us = percentile(s->lat_us, n, 99);
+    s->lat_max_us = s->lat_us[n - 1];
+
+    log_info("%s: %zu frames, latency p50 %.2f ms, p99 %.2f ms, max %.2f ms; "
+            "reorder depth p50 %u, p99 %u, max %u\n", s->dev_name, n,
+            s->lat_p50_us / 1e3, s->lat_p99_us / 1e3, s->lat_max_us / 1e3,
+            percentile(s->reorder, n, 50), percentile(s->reorder, n, 99), s->reorder[n - 1]);
+
+    free(s->lat_us);
+    free(s->reorder);
+    s->lat_us    = NULL;
+    s->reorder   = NULL;
+    s->lat_count = s->lat_alloc = 0;
+}
+
+/*
+ * Bitstream buffers imported with V4L2_MEMORY_DMABUF. They are either
+ * udmabufs we allocate and fill from the input file, or buffers an upstream
+ * producer sends over a unix socket using struct dmabuf_msg. A producer gets
+ * its msg.index back once the decoder has consumed the buffer.
+ */
+static int udmabuf_alloc(size_t size, void **map)
+{
+    struct udmabuf_create create;
+    int memfd, dev, dmabuf_fd;
+
+    memfd = memfd_create("m2m-bitstream", MFD_ALLOW_SEALING | MFD_CLOEXEC);
+    if (-1 == memfd)
+        errno_exit("memfd_create");
+
+    if (-1 == ftruncate(memfd, size))
+        errno_exit("ftruncate");
+
+    /* udmabuf only accepts memfds that can't shrink under it. */
+    if (-1 == fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK))
+        errno_exit("F_ADD_SEALS");
+
+    dev = open("/dev/udmabuf", O_RDWR | O_CLOEXEC);
+    if (-1 == dev) {
+        fprintf(stderr, "Cannot open '/dev/udmabuf': %d, %s\n",
+                errno, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    CLEAR(create);
+    create.memfd  = memfd;
+    create.flags  = UDMABUF_FLAGS_CLOEXEC;
+    create.offset = 0;
+    create.size   = size;
+
+    dmabuf_fd = ioctl(dev, UDMABUF_CREATE, &create);
+    if (-1 == dmabuf_fd)
+        errno_exit("UDMABUF_CREATE");
+    close(dev);
+
+    *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (MAP_FAILED == *map)
+        errno_exit("mmap");
+    close(memfd);
+
+    return dmabuf_fd;
+}
+
+static void dmabuf_sync(int dmabuf_fd, __u64 flags)
+{
+    struct dma_buf_sync sync;
+
+    CLEAR(sync);
+    sync.flags = flags;
+
+    if (-1 == xioctl(dmabuf_fd, DMA_BUF_IOCTL_SYNC, &sync))
+        errno_exit("DMA_BUF_IOCTL_SYNC");
+}
+
+static int producer_recv(struct session *s, unsigned int index, struct buffer *b, unsigned int *bytesused)
+{
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } cmsg;
+    struct dmabuf_msg msg;
+    struct msghdr mh;
+    struct iovec iov;
+    ssize_t r;
+    off_t len;
+
+    CLEAR(mh);
+    iov.iov_base = &msg;
+    iov.iov_len  = sizeof(msg);
+    mh.msg_iov        = &iov;
+    mh.msg_iovlen     = 1;
+    mh.msg_control    = cmsg.buf;
+    mh.msg_controllen = sizeof(cmsg.buf);
+
+    do {
+        r = recvmsg(s->producer_fd, &mh, MSG_CMSG_CLOEXEC);
+    } while (-1 == r && EINTR == errno);
+
+    if (-1 == r)
+        errno_exit("recvmsg");
+    if (0 == r)
+        return 0;
+
+    if (r != sizeof(msg) || msg.type != DMABUF_MSG_FRAME ||
+        mh.msg_controllen < CMSG_LEN(sizeof(int)) ||
+        cmsg.hdr.cmsg_level != SOL_SOCKET || cmsg.hdr.cmsg_type != SCM_RIGHTS) {
+        fprintf(stderr, "Bad message from bitstream producer\n");
+        exit(EXIT_FAILURE);
+    }
+
+    memcpy(&b->dmabuf_fd, CMSG_DATA(&cmsg.hdr), sizeof(int));
+    len = lseek(b->dmabuf_fd, 0, SEEK_END);
+    if (-1 == len) {
+        fprintf(stderr, "Bad dmabuf from bitstream producer: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    b->length = len;
+    s->out_cookies[index] = msg.index;
+
+    /* The producer's word for it can't be trusted past the end of the buffer. */
+    *bytesused = msg.bytesused[0];
+    if (*bytesused > b->length) {
+        log_warn("Producer buffer %u claims %u bytes of %zu, clamping\n",
+                 msg.index, *bytesused, b->length);
+        *bytesused = b->length;
+    }
+
+    return 1;
+}
+
+static void producer_release(struct session *s, unsigned int index)
+{
+    uint32_t cookie = s->out_cookies[index];
+
+    /* A producer that has already gone away doesn't need it back. */
+    while (-1 == send(s->producer_fd, &cookie, sizeof(cookie), MSG_NOSIGNAL) && EINTR == errno)
+        ;
+}
+
+/* Refill OUTPUT buffer index and queue it; returns 0 once the input is exhausted. */
+static int feed_dmabuf_out(struct session *s, enum v4l2_buf_type type, unsigned int index)
+{
+    struct buffer *b = &s->buffers_dmabuf_out[index];
+    struct v4l2_buffer buf;
+    struct v4l2_plane  planes[VIDEO_MAX_PLANES];
+    unsigned int bytesused;
+
+    if (s->producer_fd >= 0) {
+        if (b->dmabuf_fd >= 0) {
+            producer_release(s, index);
+            close(b->dmabuf_fd);
+            b->dmabuf_fd = -1;
+        }
+        if (!producer_recv(s, index, b, &bytesused))
+            return 0;
+    } else {
+        dmabuf_sync(b->dmabuf_fd, DMA_BUF_SYNC_START | DMA_BUF_SYNC_WRITE);
+        supply_input_by_au(s, b->start, b->length, &bytesused);
+        dmabuf_sync(b->dmabuf_fd, DMA_BUF_SYNC_END | DMA_BUF_SYNC_WRITE);
+        if (!bytesused)
+            return 0;
+    }
+
+    CLEAR(buf);
+    CLEAR(planes);
+    buf.type   = type;
+    buf.memory = V4L2_MEMORY_DMABUF;
+    buf.index  = index;
+
+    if (V4L2_TYPE_IS_MULTIPLANAR(type)) {
+        buf.length          = 1;
+        buf.m.planes        = planes;
+        planes[0].m.fd      = b->dmabuf_fd;
+        planes[0].length    = b->length;
+        planes[0].bytesused = bytesused;
+    } else {
+        buf.m.fd      = b->dmabuf_fd;
+        buf.length    = b->length;
+        buf.bytesused = bytesused;
+    }
+    tag_output(s, &buf);
+
+    if (-1 == xioctl(s->fd, VIDIOC_QBUF, &buf))
+        errno_exit("VIDIOC_QBUF");
+
+    return 1;
+}
+
+/*
+ * A CAPTURE buffer flagged LAST after VIDIOC_DECODER_CMD STOP ends the drain,
+ * once every OUTPUT buffer queued before it is back as well.
+ */
+static void drain_check(struct session *s)
+{
+    if (s->last_seen && !__atomic_load_n(&s->out_queued, __ATOMIC_RELAXED) && !s->eos) {
+        log_info("Last buffer, decoder drained\n");
+        s->eos = 1;
+    }
+}
+
+static void last_buffer(struct session *s, const struct v4l2_buffer *buf)
+{
+    unsigned int bytesused = V4L2_TYPE_IS_MULTIPLANAR(buf->type) ? buf->m.planes[0].bytesused : buf->bytesused;
+
+    s->last_empty = (buf->flags & V4L2_BUF_FLAG_LAST) && !bytesused;
+    if (s->stop_sent && (buf->flags & V4L2_BUF_FLAG_LAST)) {
+        s->last_seen = 1;
+        drain_check(s);
+    }
+}
+
+static void output_returned(struct session *s)
+{
+    /* The decoder has run out of bitstream while there is still more to feed. */
+    if (0 == __atomic_sub_fetch(&s->out_queued, 1, __ATOMIC_RELAXED) && !s->input_eof)
+        __atomic_add_fetch(&s->out_stalls, 1, __ATOMIC_RELAXED);
+    drain_check(s);
+}
+
+static int read_frame_dmabuf_out(struct session *s, enum v4l2_buf_type type)
+{
+    struct v4l2_buffer buf;
+    struct v4l2_plane  planes[VIDEO_MAX_PLANES];
+
+    CLEAR(buf);
+    CLEAR(planes);
+
+    buf.type   = type;
+    buf.memory = V4L2_MEMORY_DMABUF;
+    if (V4L2_TYPE_IS_MULTIPLANAR(type)) {
+        buf.length   = queue_planes(s, type);
+        buf.m.planes = planes;
+    }
+
+    if (-1 == xioctl(s->fd, VIDIOC_DQBUF, &buf)) {
+        switch (errno) {
+        case EAGAIN:
+            return 0;
+
+        case EIO:
+            /* Could ignore EIO, see spec. */
+
+            /* fall through */
+
+        default:
+            errno_exit("VIDIOC_DQBUF");
+        }
+    }
+
+    assert(buf.index < s->n_buffers_out);
+    output_returned(s);
+
+    if (!feed_dmabuf_out(s, type, buf.index))
+        s->input_eof = 1;
+
+    return 1;
+}
+
+static void start_dmabuf_out(struct session *s, enum v4l2_buf_type type)
+{
+    unsigned int i;
+
+    for (i = 0; i < s->n_buffers_out; ++i) {
+        if (!feed_dmabuf_out(s, type, i)) {
+            s->input_eof = 1;
+            break;
+        }
+    }
+
+    if (-1 == xioctl(s->fd, VIDIOC_STREAMON, &type))
+        errno_exit("VIDIOC_STREAMON");
+}
+
+static void init_dmabuf_out(struct session *s, enum v4l2_buf_type type, size_t size)
+{
+    struct v4l2_requestbuffers req;
+    long page = sysconf(_SC_PAGESIZE);
+    unsigned int b;
+
+    CLEAR(req);
+
+    req.count  = buffer_count(s, type);
+    req.type   = type;
+    req.memory = V4L2_MEMORY_DMABUF;
+
+    if (-1 == xioctl(s->fd, VIDIOC_REQBUFS, &req)) {
+        if (EINVAL == errno) {
+            fprintf(stderr, "%s does not support "
+                    "dmabuf import\n", s->dev_name);
+            exit(EXIT_FAILURE);
+        } else {
+            errno_exit("VIDIOC_REQBUFS");
+        }
+    }
+
+    if (req.count < 2) {
+        fprintf(stderr, "Insufficient buffer memory on %s\n",
+                s->dev_name);
+        exit(EXIT_FAILURE);
+    }
+
+    s->buffers_dmabuf_out = calloc(req.count, sizeof(*s->buffers_dmabuf_out));
+
+    if (!s->buffers_dmabuf_out) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (!size)
+        size = 2 << 20;
+    size = (size + page - 1) & ~(page - 1);
+
+    for (b = 0; b < req.count; ++b) {
+        s->buffers_dmabuf_out[b].dmabuf_fd = -1;
+        if (s->producer_fd < 0) {
+            s->buffers_dmabuf_out[b].length    = size;
+            s->buffers_dmabuf_out[b].dmabuf_fd = udmabuf_alloc(size, &s->buffers_dmabuf_out[b].start);
+        }
+    }
+    s->n_buffers_out = req.count;
+
+    if (s->producer_fd < 0)
+        log_footprint(type, req.count, req.count * size);
+}
+
+static void uninit_dmabuf_out(struct session *s, enum v4l2_buf_type type)
+{
+    struct v4l2_requestbuffers req;
+    unsigned int b;
+
+    for (b = 0; b < s->n_buffers_out; ++b) {
+        if (s->buffers_dmabuf_out[b].start)
+            munmap(s->buffers_dmabuf_out[b].start, s->buffers_dmabuf_out[b].length);
+        if (s->buffers_dmabuf_out[b].dmabuf_fd >= 0)
+            close(s->buffers_dmabuf_out[b].dmabuf_fd);
+    }
+    free(s->buffers_dmabuf_out);
+    s->buffers_dmabuf_out = NULL;
+
+    CLEAR(req);
+    req.count  = 0;
+    req.type   = type;
+    req.memory = V4L2_MEMORY_DMABUF;
+
+    if (-1 == xioctl(s->fd, VIDIOC_REQBUFS, &req))
+        errno_exit("VIDIOC_REQBUFS");
+
+    if (s->producer_fd >= 0)
+        close(s->producer_fd);
+    s->producer_fd = -1;
+}
+
+static int read_frame(struct session *s, enum v4l2_buf_type type, struct buffer *bufs, unsigned int n_bufs)
+{
+    struct v4l2_buffer buf;
+
+    switch (s->io) {
+    case IO_METHOD_READ:
+        if (-1 == read(s->fd, bufs[0].start, bufs[0].length)) {
+            switch (errno) {
+            case EAGAIN:
+                return 0;
+
+            case EIO:
+                /* Could ignore EIO, see spec. */
+
+                /* fall through */
+
+            default:
+                errno_exit("read");
+            }
+        }
+
+        process_image(s, bufs[0].start, bufs[0].length);
+        break;
+
+    case IO_METHOD_MMAP:
+    case IO_METHOD_USERPTR:
+        CLEAR(buf);
+
+        buf.type = type;
+        buf.memory = buffer_memory(s);
+
+        if (-1 == xioctl(s->fd, VIDIOC_DQBUF, &buf)) {
+            switch (errno) {
+            case EAGAIN:
+                return 0;
+
+            case EPIPE:
+                /* Past the last buffer of a drain. */
+                return 0;
+
+            case EIO:
+                /* Could ignore EIO, see spec. */
+
+                /* fall through */
+
+            default:
+                errno_exit("VIDIOC_DQBUF");
+            }
+        }
+
+        assert(buf.index < n_bufs);
+
+        if (type == V4L2_BUF_TYPE_VIDEO_CAPTURE) {
+            capture_dequeued(s);
+            last_buffer(s, &buf);
+            frame_stats(s, &buf);
+        } else {
+            output_returned(s);
+        }
+
+        if (type == V4L2_BUF_TYPE_VIDEO_CAPTURE && s->sink) {
+            sink_frame(s, &buf);
+            break;
+        }
+
+        if (type == V4L2_BUF_TYPE_VIDEO_CAPTURE && s->use_writer) {
+            writer_push(s, &buf);
+            break;
+        }
+
+        if (type == V4L2_BUF_TYPE_VIDEO_CAPTURE && s->uring) {
+            uring_write_frame(s, &buf);
+            break;
+        }
+
+        if (type == V4L2_BUF_TYPE_VIDEO_CAPTURE) {
+            process_frame(s, &buf);
+        } else {
+            supply_input_by_au(s, bufs[buf.index].start, bufs[buf.index].length, &buf.bytesused);
+            if (!buf.bytesused) {
+                /* Keep the buffer; the stream ends with VIDIOC_DECODER_CMD. */
+                s->input_eof = 1;
+                break;
+            }
+            tag_output(s, &buf);
+        }
+
+        if (-1 == xioctl(s->fd, VIDIOC_QBUF, &buf))
+            errno_exit("VIDIOC_QBUF");
+        if (type == V4L2_BUF_TYPE_VIDEO_CAPTURE)
+            capture_queued(s);
+        break;
+    }
+
+    return 1;
+}
+
+static int read_frame_mp(struct session *s, enum v4l2_buf_type type, struct buffer_mp *bufs, unsigned int n_bufs)
+{
+    struct v4l2_buffer buf;
+    struct v4l2_plane  planes[VIDEO_MAX_PLANES];
+
+    CLEAR(buf);
+    CLEAR(planes);
+
+    buf.type     = type;
+    buf.memory   = buffer_memory(s);
+    buf.length   = queue_planes(s, type);
+    buf.m.planes = planes;
+
+    if (-1 == xioctl(s->fd, VIDIOC_DQBUF, &buf)) {
+        switch (errno) {
+        case EAGAIN:
+            return 0;
+
+        case EPIPE:
+            /* Past the last buffer of a drain. */
+            return 0;
+
+        case EIO:
+            /* Could ignore EIO, see spec. */
+
+            /* fall through */
+
+        default:
+            errno_exit("VIDIOC_DQBUF");
+        }
+    }
+
+    assert(buf.index < n_bufs);
+
+    if (type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
+        capture_dequeued(s);
+        last_buffer(s, &buf);
+        frame_stats(s, &buf);
+    } else {
+        output_returned(s);
+    }
+
+    if (type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE && s->sink) {
+        sink_frame(s, &buf);
+        return 1;
+    }
+
+    if (type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE && s->use_writer) {
+        writer_push(s, &buf);
+        return 1;
+    }
+
+    if (type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE && s->uring) {
+        uring_write_frame(s, &buf);
+        return 1;
+    }
+
+    if (type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
+        process_frame(s, &buf);
+    } else if (!supply_input_mp(s, &bufs[buf.index], &buf)) {
+        s->input_eof = 1;
+        return 1;
+    } else {
+        tag_output(s, &buf);
+    }
+
+    if (-1 == xioctl(s->fd, VIDIOC_QBUF, &buf))
+        errno_exit("VIDIOC_QBUF");
+    if (type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE)
+        capture_queued(s);
+
+    return 1;
+}
+
+static void stop_capture(struct session *s, enum v4l2_buf_type type)
+{
+    type = stream_type(s, type); // change type if multi-planar
+    if (V4L2_TYPE_IS_OUTPUT(type))
+        __atomic_store_n(&s->out_queued, 0, __ATOMIC_RELAXED);
+
+    if (-1 == xioctl(s->fd, VIDIOC_STREAMOFF, &type))
+        errno_exit("VIDIOC_STREAMOFF");
+}
+
+static void stop_capturing(struct session *s)
+{
+    switch (s->io) {
+    case IO_METHOD_READ:
+        /* Nothing to do. */
+        break;
+
+    case IO_METHOD_MMAP:
+    case IO_METHOD_USERPTR:
+        stop_capture(s, V4L2_BUF_TYPE_VIDEO_CAPTURE);
+
+        if (s->m2m_enabled) 
+            stop_capture(s, V4L2_BUF_TYPE_VIDEO_OUTPUT);
+        break;
+    }
+}
+
+static void start_streaming(struct session *s, enum v4l2_buf_type type, struct buffer *bufs, unsigned int n_bufs)
+{
+    unsigned int i;
+
+    for (i = 0; i < n_bufs; ++i) {
+        struct v4l2_buffer buf;
+
+        CLEAR(buf);
+        buf.type = type;
+        buf.memory = buffer_memory(s);
+        buf.index = i;
+        if (buf.memory == V4L2_MEMORY_USERPTR) {
+            buf.m.userptr = (unsigned long)bufs[i].start;
+            buf.length    = bufs[i].length;
+        }
+
+        if (type == V4L2_BUF_TYPE_VIDEO_OUTPUT) {
+            supply_input_by_au(s, bufs[i].start, bufs[i].length, &buf.bytesused);
+            if (!buf.bytesused) {
+                s->input_eof = 1;
+                break;
+            }
+            tag_output(s, &buf);
+        } else if (s->sink) {
+            buf.flags = V4L2_BUF_FLAG_NO_CACHE_INVALIDATE | V4L2_BUF_FLAG_NO_CACHE_CLEAN;
+        }
+
+        if (-1 == xioctl(s->fd, VIDIOC_QBUF, &buf))
+            errno_exit("VIDIOC_QBUF");
+    }
+
+    if (!V4L2_TYPE_IS_OUTPUT(type))
+        s->cap_queued = n_bufs;
+    
+    if (-1 == xioctl(s->fd, VIDIOC_STREAMON, &type))
+        errno_exit("VIDIOC_STREAMON");
+}
+
+static void start_streaming_mp(struct session *s, enum v4l2_buf_type type, struct buffer_mp *bufs, unsigned int n_bufs)
+{
+    unsigned int i;
+
+    for (i = 0; i < n_bufs; ++i) {
+        struct v4l2_buffer buf;
+        struct v4l2_plane  planes[VIDEO_MAX_PLANES];
+
+        CLEAR(buf);
+        CLEAR(planes);
+        buf.type     = type;
+        buf.memory   = buffer_memory(s);
+        buf.index    = i;
+        buf.length   = queue_planes(s, type);
+        buf.m.planes = planes;
+        if (buf.memory == V4L2_MEMORY_USERPTR)
+            userptr_planes(&bufs[i], planes);
+
+        if (type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE) {
+            if (!supply_input_mp(s, &bufs[i], &buf)) {
+                s->input_eof = 1;
+                break;
+            }
+            tag_output(s, &buf);
+        } else if (s->sink) {
+            buf.flags = V4L2_BUF_FLAG_NO_CACHE_INVALIDATE | V4L2_BUF_FLAG_NO_CACHE_CLEAN;
+        }
+
+        if (-1 == xioctl(s->fd, VIDIOC_QBUF, &buf))
+            errno_exit("VIDIOC_QBUF");
+    }
+
+    if (!V4L2_TYPE_IS_OUTPUT(type))
+        s->cap_queued = n_bufs;
+    
+    if (-1 == xioctl(s->fd, VIDIOC_STREAMON, &type))
+        errno_exit("VIDIOC_STREAMON");
+}
+
+static void start_capturing(struct session *s)
+{
+    switch (s->io) {
+    case IO_METHOD_READ:
+        /* Nothing to do. */
+        break;
+
+    case IO_METHOD_MMAP:
+    case IO_METHOD_USERPTR:
+        if (s->multi_planar)
+            start_streaming_mp(s, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE, s->buffers_mp, s->n_buffers);
+        else
+            start_streaming(s, V4L2_BUF_TYPE_VIDEO_CAPTURE, s->buffers, s->n_buffers);
+
+        if (s->m2m_enabled) {
+            if (s->out_memory == V4L2_MEMORY_DMABUF)
+                start_dmabuf_out(s, stream_type(s, V4L2_BUF_TYPE_VIDEO_OUTPUT));
+            else if (s->multi_planar)
+                start_streaming_mp(s, V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE, s->buffers_mp_out, s->n_buffers_out);
+            else
+                start_streaming(s, V4L2_BUF_TYPE_VIDEO_OUTPUT, s->buffers_out, s->n_buffers_out);
+        }
+        break;
+    }
+}
+
+static void unmap_buffers(struct session *s, struct buffer *buf, unsigned int n)
+{
+    unsigned int b;
+
+    for (b = 0; b < n; ++b) {
+        if (buffer_memory(s) == V4L2_MEMORY_USERPTR)
+            pool_release(s, buf[b].start, buf[b].length);
+        else if (-1 == munmap(buf[b].start, buf[b].length))
+            errno_exit("munmap");
+        if (buf[b].dmabuf_fd >= 0)
+            close(buf[b].dmabuf_fd);
+    }
+}
+
+static void unmap_buffers_mp(struct session *s, struct buffer_mp *buf, unsigned int n)
+{
+    unsigned int b, p;
+
+    for (b = 0; b < n; b++) {
+        for (p = 0; p < buf[b].num_planes; p++) {
+            if (buffer_memory(s) == V4L2_MEMORY_USERPTR)
+                pool_release(s, buf[b].start[p], buf[b].length[p]);
+            else if (-1 == munmap(buf[b].start[p], buf[b].length[p]))
+                errno_exit("munmap");
+            if (buf[b].dmabuf_fd[p] >= 0)
+                close(buf[b].dmabuf_fd[p]);
+        }
+    }
+}
+
+static void free_buffers(struct session *s, enum v4l2_buf_type type)
+{
+    struct v4l2_requestbuffers req;
+
+    CLEAR(req);
+
+    req.count = 0;
+    req.type = type;
+    req.memory = buffer_memory(s);
+
+    if (-1 == xioctl(s->fd, VIDIOC_REQBUFS, &req))
+        errno_exit("VIDIOC_REQBUFS");
+}
+
+static void uninit_device(struct session *s)
+{
+    switch (s->io) {   
+    case IO_METHOD_READ:
+        free(s->buffers[0].start);
+        break;
+
+    case IO_METHOD_MMAP:
+    case IO_METHOD_USERPTR:
+        if (s->m2m_enabled && s->out_memory == V4L2_MEMORY_DMABUF)
+            uninit_dmabuf_out(s, stream_type(s, V4L2_BUF_TYPE_VIDEO_OUTPUT));
+
+        if (s->multi_planar) {
+            unmap_buffers_mp(s, s->buffers_mp, s->n_buffers);
+            free_buffers(s, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE);
+            if (s->m2m_enabled && s->out_memory == V4L2_MEMORY_MMAP) {
+                unmap_buffers_mp(s, s->buffers_mp_out, s->n_buffers_out);
+                free_buffers(s, V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE);
+            }
+        } else {
+            unmap_buffers(s, s->buffers, s->n_buffers);
+            free_buffers(s, V4L2_BUF_TYPE_VIDEO_CAPTURE);
+            if (s->m2m_enabled && s->out_memory == V4L2_MEMORY_MMAP) {
+                unmap_buffers(s, s->buffers_out, s->n_buffers_out);
+                free_buffers(s, V4L2_BUF_TYPE_VIDEO_OUTPUT);
+            }
+        }
+        break;
+    }
+
+    free(s->buffers);
+    pool_destroy(s);
+
+    free_pack(s);
+}
+
+static void init_read(struct session *s, unsigned int buffer_size)
+{
+    s->buffers = calloc(1, sizeof(*s->buffers));
+
+    if (!s->buffers) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    s->buffers[0].length = buffer_size;
+    s->buffers[0].start = malloc(buffer_size);
+
+    if (!s->buffers[0].start) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Set up buffer b of a queue: map it for MMAP, or carve it out of the pool
+ * at the size of the queue's format for USERPTR.
+ */
+static size_t map_buffer(struct session *s, enum v4l2_buf_type type, unsigned int b, struct buffer *bufs)
+{
+    struct v4l2_buffer buf;
+
+    if (buffer_memory(s) == V4L2_MEMORY_USERPTR) {
+        const struct v4l2_format *fmt = V4L2_TYPE_IS_OUTPUT(type) ? &s->out_fmt : &s->cap_fmt;
+
+        bufs[b].length    = fmt->fmt.pix.sizeimage;
+        bufs[b].start     = pool_alloc(s, bufs[b].length);
+        bufs[b].dmabuf_fd = -1;
+        return bufs[b].length;
+    }
+
+    CLEAR(buf);
+
+    buf.type   = type;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.index  = b;
+
+    if (-1 == xioctl(s->fd, VIDIOC_QUERYBUF, &buf))
+        errno_exit("VIDIOC_QUERYBUF");
+
+    log_debug("Mapping buffer %u, len %u\n", b, buf.length);
+    bufs[b].length = buf.length;
+    bufs[b].start =
+        mmap(NULL /* start anywhere */,
+             buf.length,
+             PROT_READ | PROT_WRITE, /* required */
+             MAP_SHARED,             /* recommended */
+             s->fd, buf.m.offset);
+
+    if (MAP_FAILED == bufs[b].start)
+        errno_exit("mmap");
+
+    bufs[b].dmabuf_fd = -1;
+    if (s->sink && !V4L2_TYPE_IS_OUTPUT(type))
+        export_buffer(s, type, b, 0, &bufs[b].dmabuf_fd);
+
+    return buf.length;
+}
+
+static size_t map_buffer_mp(struct session *s, enum v4l2_buf_type type, unsigned int b, struct buffer_mp *bufs)
+{
+    struct v4l2_buffer buf;
+    struct v4l2_plane  planes[VIDEO_MAX_PLANES];
+    size_t total = 0;
+    unsigned int p;
+
+    if (buffer_memory(s) == V4L2_MEMORY_USERPTR) {
+        const struct v4l2_format *fmt = V4L2_TYPE_IS_OUTPUT(type) ? &s->out_fmt : &s->cap_fmt;
+
+        bufs[b].num_planes = fmt->fmt.pix_mp.num_planes;
+        for (p = 0; p < bufs[b].num_planes; ++p) {
+            bufs[b].length[p]    = fmt->fmt.pix_mp.plane_fmt[p].sizeimage;
+            bufs[b].start[p]     = pool_alloc(s, bufs[b].length[p]);
+            bufs[b].dmabuf_fd[p] = -1;
+            total += bufs[b].length[p];
+        }
+        return total;
+    }
+
+    CLEAR(buf);
+    CLEAR(planes);
+
+    buf.type   = type;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.index  = b;
+    /* length in struct v4l2_buffer in multi-planar API stores the size
+     * of planes array. */
+    buf.length   = queue_planes(s, type);
+    buf.m.planes = planes;
+
+    if (-1 == xioctl(s->fd, VIDIOC_QUERYBUF, &buf))
+        errno_exit("VIDIOC_QUERYBUF");
+
+    log_debug("Mapping buffer %u:\n", b);
+    bufs[b].num_planes = buf.length;
+    for (p = 0; p < buf.length; ++p) {
+        log_debug("Mapping plane %u, len %u\n", p, 
+                buf.m.planes[p].length);
+
+        bufs[b].length[p] = buf.m.planes[p].length;
+        bufs[b].start[p] = 
+            mmap(NULL, 
+                 buf.m.planes[p].length,
+                 PROT_READ | PROT_WRITE, /* required */
+                 MAP_SHARED,             /* recommended */
+                 s->fd, buf.m.planes[p].m.mem_offset);
+
+        if (MAP_FAILED == bufs[b].start[p])
+            errno_exit("mmap");
+
+        bufs[b].dmabuf_fd[p] = -1;
+        if (s->sink && !V4L2_TYPE_IS_OUTPUT(type))
+            export_buffer(s, type, b, p, &bufs[b].dmabuf_fd[p]);
+
+        total += buf.m.planes[p].length;
+    }
+
+    return total;
+}
+
+static unsigned int request_buffers(struct session *s, enum v4l2_buf_type type)
+{
+    struct v4l2_requestbuffers req;
+
+    CLEAR(req);
+
+    req.count  = buffer_count(s, type);
+    req.type   = type;
+    req.memory = buffer_memory(s);
+
+    if (-1 == xioctl(s->fd, VIDIOC_REQBUFS, &req)) {
+        if (EINVAL == errno) {
+            fprintf(stderr, "%s does not support %s\n", s->dev_name,
+                    req.memory == V4L2_MEMORY_USERPTR ? "user pointer i/o" : "memory mapping");
+            exit(EXIT_FAILURE);
+        } else {
+            errno_exit("VIDIOC_REQBUFS");
+        }
+    }
+
+    if (req.count < 2) {
+        fprintf(stderr, "Insufficient buffer memory on %s\n",
+                s->dev_name);
+        exit(EXIT_FAILURE);
+    }
+
+    return req.count;
+}
+
+/* Room for growing the CAPTURE queue without moving the array under the writer. */
+static unsigned int buffer_slots(struct session *s, enum v4l2_buf_type type, unsigned int count)
+{
+    if (s->grow_buffers && !V4L2_TYPE_IS_OUTPUT(type))
+        return VIDEO_MAX_FRAME;
+    return count;
+}
+
+static void init_buffers(struct session *s, enum v4l2_buf_type type, struct buffer **bufs_out, unsigned int *n_bufs)
+{
+    struct buffer *bufs;
+    unsigned int b, count;
+    size_t total = 0;
+
+    count = request_buffers(s, type);
+
+    bufs = calloc(buffer_slots(s, type, count), sizeof(*bufs));
+
+    if (!bufs) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (b = 0; b < count; ++b)
+        total += map_buffer(s, type, b, bufs);
+
+    log_footprint(type, b, total);
+    *n_bufs = b;
+    *bufs_out = bufs;
+}
+
+static void init_buffers_mp(struct session *s, enum v4l2_buf_type type, struct buffer_mp **bufs_out, unsigned int *n_bufs)
+{
+    struct buffer_mp *bufs;
+    unsigned int b, count;
+    size_t total = 0;
+
+    count = request_buffers(s, type);
+
+    bufs = calloc(buffer_slots(s, type, count), sizeof(*bufs));
+
+    if (!bufs) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (b = 0; b < count; ++b)
+        total += map_buffer_mp(s, type, b, bufs);
+
+    log_footprint(type, b, total);
+    *n_bufs = b;
+    *bufs_out = bufs;
+}
+
+/*
+ * Add one CAPTURE buffer with VIDIOC_CREATE_BUFS after the decoder ran out of
+ * queued buffers, so pipelines deeper than the driver minimum stop stalling.
+ */
+static void grow_capture(struct session *s)
+{
+    struct v4l2_create_buffers create;
+    struct v4l2_buffer buf;
+    struct v4l2_plane  planes[VIDEO_MAX_PLANES];
+    unsigned int b;
+    size_t length;
+
+    s->cap_starved = 0;
+
+    if (s->n_buffers >= VIDEO_MAX_FRAME)
+        return;
+
+    CLEAR(create);
+    create.count  = 1;
+    create.memory = buffer_memory(s);
+    create.format = s->cap_fmt;
+
+    if (-1 == xioctl(s->fd, VIDIOC_CREATE_BUFS, &create) || !create.count) {
+        log_warn("Cannot grow CAPTURE queue: %s\n", strerror(errno));
+        s->grow_buffers = 0;
+        return;
+    }
+
+    b = create.index;
+    assert(b == s->n_buffers);
+
+    if (s->multi_planar)
+        length = map_buffer_mp(s, s->cap_fmt.type, b, s->buffers_mp);
+    else
+        length = map_buffer(s, s->cap_fmt.type, b, s->buffers);
+
+    CLEAR(buf);
+    CLEAR(planes);
+    buf.type   = s->cap_fmt.type;
+    buf.memory = create.memory;
+    buf.index  = b;
+    if (s->multi_planar) {
+        buf.length   = queue_planes(s, buf.type);
+        buf.m.planes = planes;
+        if (buf.memory == V4L2_MEMORY_USERPTR)
+            userptr_planes(&s->buffers_mp[b], planes);
+    } else if (buf.memory == V4L2_MEMORY_USERPTR) {
+        buf.m.userptr = (unsigned long)s->buffers[b].start;
+        buf.length    = s->buffers[b].length;
+    }
+
+    if (-1 == xioctl(s->fd, VIDIOC_QBUF, &buf))
+        errno_exit("VIDIOC_QBUF");
+    capture_queued(s);
+
+    s->n_buffers++;
+    log_info("CAPTURE starved, grew to %u buffers\n", s->n_buffers);
+    log_footprint(s->cap_fmt.type, s->n_buffers, s->n_buffers * length);
+}
+
+static void init_device_out(struct session *s)
+{
+    struct v4l2_cropcap cropcap;
+    struct v4l2_crop crop;
+    struct v4l2_format fmt;
+    unsigned int min;
+
+    CLEAR(cropcap);
+
+    cropcap.type = stream_type(s, V4L2_BUF_TYPE_VIDEO_OUTPUT);
+
+    if (0 == xioctl(s->fd, VIDIOC_CROPCAP, &cropcap)) {
+        crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        crop.c = cropcap.defrect; /* reset to default */
+
+        if (-1 == xioctl(s->fd, VIDIOC_S_CROP, &crop)) {
+            switch (errno) {
+            case EINVAL:
+                /* Cropping not supported. */
+                break;
+            default:
+                /* Errors ignored. */
+                break;
+            }
+        }
+    } else {
+        /* Errors ignored. */
+    }
+
+
+    CLEAR(fmt);
+
+    fmt.type = stream_type(s, V4L2_BUF_TYPE_VIDEO_OUTPUT);
+
+    if (-1 == xioctl(s->fd, VIDIOC_G_FMT, &fmt))
+        errno_exit("VIDIOC_G_FMT");
+
+    if (s->force_format) {
+        if (s->multi_planar) {
+            fmt.fmt.pix_mp.width       = 1920;
+            fmt.fmt.pix_mp.height      = 1080;
+            fmt.fmt.pix_mp.pixelformat = s->codec == CODEC_HEVC ? V4L2_PIX_FMT_HEVC : V4L2_PIX_FMT_H264;
+            fmt.fmt.pix_mp.field       = V4L2_FIELD_NONE;
+        } else {
+            fmt.fmt.pix.width       = 640;
+            fmt.fmt.pix.height      = 480;
+            fmt.fmt.pix.pixelformat = s->codec == CODEC_HEVC ? V4L2_PIX_FMT_HEVC : V4L2_PIX_FMT_H264;
+            fmt.fmt.pix.field       = V4L2_FIELD_NONE;
+        }
+
+        if (-1 == xioctl(s->fd, VIDIOC_S_FMT, &fmt))
+            errno_exit("VIDIOC_S_FMT");
+
+        /* Note VIDIOC_S_FMT may change width and height. */
+    }
+
+    /* Delimit access units for whatever the decoder was set up to take. */
+    if (!s->codec_forced) {
+        __u32 pixelformat = s->multi_planar ? fmt.fmt.pix_mp.pixelformat : fmt.fmt.pix.pixelformat;
+
+        s->codec = pixelformat == V4L2_PIX_FMT_HEVC ? CODEC_HEVC : CODEC_H264;
+    }
+
+    /* Buggy driver paranoia. */
+    if (s->multi_planar) {
+        unsigned int p;
+
+        for (p = 0; p < fmt.fmt.pix_mp.num_planes; ++p) {
+            min = fmt.fmt.pix_mp.width * 2;
+            if (fmt.fmt.pix_mp.plane_fmt[p].bytesperline > 0 &&
+                fmt.fmt.pix_mp.plane_fmt[p].bytesperline < min)
+                fmt.fmt.pix_mp.plane_fmt[p].bytesperline = min;
+            min = fmt.fmt.pix_mp.plane_fmt[p].bytesperline * fmt.fmt.pix_mp.height;
+            if (fmt.fmt.pix_mp.plane_fmt[p].sizeimage > 0 &&
+                fmt.fmt.pix_mp.plane_fmt[p].sizeimage < min)
+                fmt.fmt.pix_mp.plane_fmt[p].sizeimage = min;
+        }
+    } else {
+        min = fmt.fmt.pix.width * 2;
+        if (fmt.fmt.pix.bytesperline < min)
+            fmt.fmt.pix.bytesperline = min;
+        min = fmt.fmt.pix.bytesperline * fmt.fmt.pix.height;
+        if (fmt.fmt.pix.sizeimage < min)
+            fmt.fmt.pix.sizeimage = min;
+    }
+
+    if (s->multi_planar)
+        s->out_planes = fmt.fmt.pix_mp.num_planes;
+    s->out_fmt = fmt;
+
+    switch (s->io) {
+    case IO_METHOD_READ:
+        init_read(s, fmt.fmt.pix.sizeimage);
+        break;
+
+    case IO_METHOD_MMAP:
+    case IO_METHOD_USERPTR:
+        if (s->out_memory == V4L2_MEMORY_DMABUF)
+            init_dmabuf_out(s, stream_type(s, V4L2_BUF_TYPE_VIDEO_OUTPUT),
+                            s->multi_planar ? fmt.fmt.pix_mp.plane_fmt[0].sizeimage : fmt.fmt.pix.sizeimage);
+        else if (s->multi_planar)
+            init_buffers_mp(s, V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE, &s->buffers_mp_out, &s->n_buffers_out);
+        else
+            init_buffers(s, V4L2_BUF_TYPE_VIDEO_OUTPUT, &s->buffers_out, &s->n_buffers_out);
+        break;
+    }
+
+    struct v4l2_event_subscription sub;
+
+    CLEAR(sub);
+
+    sub.type = V4L2_EVENT_EOS;
+    if (-1 == xioctl(s->fd, VIDIOC_SUBSCRIBE_EVENT, &sub))
+        errno_exit("VIDIOC_SUBSCRIBE_EVENT");
+
+    sub.type = V4L2_EVENT_SOURCE_CHANGE;
+    if (-1 == xioctl(s->fd, VIDIOC_SUBSCRIBE_EVENT, &sub))
+        errno_exit("VIDIOC_SUBSCRIBE_EVENT");
+}
+
+static void map_input_file(struct session *s)
+{
+    struct stat st;
+    int in_fd;
+
+    in_fd = open(s->in_filename, O_RDONLY);
+    if (-1 == in_fd) {
+        fprintf(stderr, "Failed to open input file %s\n", s->in_filename);
+        return;
+    }
+
+    if (-1 == fstat(in_fd, &st))
+        errno_exit("fstat");
+
+    if (st.st_size > 0) {
+        s->in_map_len = st.st_size;
+        s->in_map = mmap(NULL, s->in_map_len, PROT_READ, MAP_PRIVATE, in_fd, 0);
+        if (MAP_FAILED == s->in_map)
+            errno_exit("mmap");
+        madvise((void *)s->in_map, s->in_map_len, MADV_SEQUENTIAL);
+    } else {
+        fprintf(stderr, "Input file %s is empty\n", s->in_filename);
+    }
+
+    close(in_fd);
+}
+
+static void au_index_append(struct session *s, uint64_t offset, uint64_t size, const struct au_state *st)
+{
+    struct au_entry *au;
+
+    if (s->au_count == s->au_alloc) {
+        s->au_alloc = s->au_alloc ? s->au_alloc * 2 : 1024;
+        s->au_index = realloc(s->au_index, s->au_alloc * sizeof(*s->au_index));
+        if (!s->au_index) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (size > UINT32_MAX) {
+        fprintf(stderr, "Access unit at %llu too large to index\n",
+                (unsigned long long)offset);
+        exit(EXIT_FAILURE);
+    }
+
+    au = &s->au_index[s->au_count++];
+    CLEAR(*au);
+    au->offset   = offset;
+    au->size     = size;
+    au->nal_type = st->first_vcl < 0 ? 0 : st->first_vcl;
+    au->flags    = st->keyframe ? AU_FLAG_KEYFRAME : 0;
+}
+
+/*
+ * Delimit every access unit of the input in one streaming pass. The input is
+ * read in AU_INDEX_CHUNK pieces; the bytes after the last scanned position are
+ * carried over so start codes that straddle two reads are still found.
+ */
+static void build_au_index(struct session *s, int in_fd)
+{
+    unsigned char *chunk;
+    uint64_t base = 0;          /* file offset of chunk[0] */
+    uint64_t au_start = 0;
+    size_t carry = 0, resume = 0;
+    struct au_state st;
+
+    chunk = malloc(AU_INDEX_CHUNK + NAL_LOOKAHEAD + 1);
+    if (!chunk) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    au_state_reset(&st);
+
+    for (;;) {
+        const unsigned char *p, *end, *sc;
+        ssize_t n;
+        size_t len, keep;
+        int eof;
+
+        n = read(in_fd, chunk + carry, AU_INDEX_CHUNK);
+        if (-1 == n) {
+            if (EINTR == errno)
+                continue;
+            errno_exit("read");
+        }
+
+        s->in_bytes_scanned += n;
+        len = carry + n;
+        eof = (0 == n);
+        p   = chunk + resume;
+        end = chunk + len;
+
+        for (;;) {
+            uint64_t off;
+
+            sc = find_start_code(p, end);
+            if (sc == end || (!eof && end - sc < NAL_LOOKAHEAD))
+                break;
+
+            off = base + (sc - chunk);
+            if (off > au_start + 1 && nal_starts_au(s, sc + 3, end - sc - 3, &st)) {
+                if (sc > chunk && sc[-1] == 0)
+                    off--;
+                au_index_append(s, au_start, off - au_start, &st);
+                au_start = off;
+                au_state_reset(&st);
+            }
+            au_state_add(s, &st, sc + 3, end - sc - 3);
+            p = sc + 3;
+        }
+
+        if (eof)
+            break;
+
+        /* Keep a pending start code, or the tail that may begin one, plus the
+         * byte before it for the zero_byte check. */
+        if (sc == end)
+            sc = (end - p > 2) ? end - 2 : p;
+        keep   = end - sc;
+        resume = 0;
+        if (sc > chunk) {
+            keep++;
+            resume = 1;
+        }
+        memmove(chunk, end - keep, keep);
+        base += len - keep;
+        carry = keep;
+    }
+
+    if (base + carry > au_start)
+        au_index_append(s, au_start, base + carry - au_start, &st);
+
+    free(chunk);
+}
+
+static int load_au_index(struct session *s, const char *path, const struct stat *in_st)
+{
+    const struct au_index_header *hdr;
+    const struct au_entry *au;
+    struct stat st;
+    uint64_t next, k;
+    void *map;
+    int idx_fd;
+
+    idx_fd = open(path, O_RDONLY);
+    if (-1 == idx_fd)
+        return 0;
+
+    if (-1 == fstat(idx_fd, &st) || (size_t)st.st_size < sizeof(*hdr)) {
+        close(idx_fd);
+        return 0;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, idx_fd, 0);
+    close(idx_fd);
+    if (MAP_FAILED == map)
+        return 0;
+
+    hdr = map;
+    if (hdr->magic != AU_INDEX_MAGIC ||
+        hdr->version != AU_INDEX_VERSION ||
+        hdr->codec != s->codec ||
+        hdr->file_size != (uint64_t)in_st->st_size ||
+        hdr->file_mtime_sec != in_st->st_mtim.tv_sec ||
+        hdr->file_mtime_nsec != in_st->st_mtim.tv_nsec ||
+        hdr->count > (size_t)st.st_size / sizeof(struct au_entry) ||
+        (size_t)st.st_size != sizeof(*hdr) + hdr->count * sizeof(struct au_entry)) {
+        log_warn("Ignoring stale index %s\n", path);
+        munmap(map, st.st_size);
+        return 0;
+    }
+
+    /* Entries have to lie in the file, in order, or reading AUs runs off the input. */
+    au   = (const struct au_entry *)(hdr + 1);
+    next = 0;
+    for (k = 0; k < hdr->count; ++k) {
+        if (au[k].offset < next || au[k].offset + au[k].size > (uint64_t)in_st->st_size) {
+            log_warn("Ignoring corrupt index %s at AU %llu\n", path, (unsigned long long)k);
+            munmap(map, st.st_size);
+            return 0;
+        }
+        next = au[k].offset + au[k].size;
+    }
+
+    s->au_index_map     = map;
+    s->au_index_map_len = st.st_size;
+    s->au_index         = (struct au_entry *)(hdr + 1);
+    s->au_count         = hdr->count;
+
+    return 1;
+}
+
+static void save_au_index(struct session *s, const char *path, const struct stat *in_st)
+{
+    struct au_index_header hdr;
+    char tmp_path[PATH_MAX + 4];
+    FILE *fp;
+
+    CLEAR(hdr);
+    hdr.magic           = AU_INDEX_MAGIC;
+    hdr.version         = AU_INDEX_VERSION;
+    hdr.codec           = s->codec;
+    hdr.file_size       = in_st->st_size;
+    hdr.file_mtime_sec  = in_st->st_mtim.tv_sec;
+    hdr.file_mtime_nsec = in_st->st_mtim.tv_nsec;
+    hdr.count           = s->au_count;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    fp = fopen(tmp_path, "wb");
+    if (!fp) {
+        fprintf(stderr, "Cannot write index %s: %s\n", tmp_path, strerror(errno));
+        return;
+    }
+
+    if (1 != fwrite(&hdr, sizeof(hdr), 1, fp) ||
+        s->au_count != fwrite(s->au_index, sizeof(*s->au_index), s->au_count, fp) ||
+        fclose(fp) ||
+        -1 == rename(tmp_path, path)) {
+        fprintf(stderr, "Cannot write index %s: %s\n", tmp_path, strerror(errno));
+        unlink(tmp_path);
+    }
+}
+
+/* An AU that decoding can start at without anything before it: IDR, or BLA for HEVC */
+static int au_is_idr(const struct session *s, const struct au_entry *au)
+{
+    if (!(au->flags & AU_FLAG_KEYFRAME))
+        return 0;
+    if (s->codec == CODEC_HEVC)
+        return au->nal_type >= 16 && au->nal_type <= 20;
+    return au->nal_type == 5;
+}
+
+static int nal_is_param_set(const struct session *s, const unsigned char *nal)
+{
+    int type;
+
+    if (s->codec == CODEC_HEVC) {
+        type = (nal[0] >> 1) & 0x3f;
+        return type >= 32 && type <= 34;    /* VPS, SPS, PPS */
+    }
+
+    type = nal[0] & 0x1f;
+    return type == 7 || type == 8;          /* SPS, PPS */
+}
+
+/*
+ * Append the parameter set NAL units in [p, end) to *out, each behind a 4
+ * byte start code, or with out NULL just count them.
+ */
+static unsigned int copy_param_sets(const struct session *s, const unsigned char *p,
+                                    const unsigned char *end, unsigned char **out, size_t *out_len)
+{
+    const unsigned char *sc = find_start_code(p, end);
+    unsigned int n = 0;
+
+    while (sc != end) {
+        const unsigned char *nal = sc + 3, *next = find_start_code(nal, end);
+        size_t len = next - nal;
+
+        /* Trailing zeros belong to the next start code; a NAL unit never ends in one. */
+        while (len && !nal[len - 1])
+            len--;
+
+        if (len && nal_is_param_set(s, nal)) {
+            if (out) {
+                *out = realloc(*out, *out_len + 4 + len);
+                if (!*out) {
+                    fprintf(stderr, "Out of memory\n");
+                    exit(EXIT_FAILURE);
+                }
+                memcpy(*out + *out_len, "\0\0\0\1", 4);
+                memcpy(*out + *out_len + 4, nal, len);
+                *out_len += 4 + len;
+            }
+            n++;
+        }
+        sc = next;
+    }
+
+    return n;
+}
+
+static void read_au(int fd, const struct au_entry *au, unsigned char **buf)
+{
+    *buf = realloc(*buf, au->size);
+    if (!*buf) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    if ((ssize_t)au->size != pread(fd, *buf, au->size, au->offset))
+        errno_exit("pread");
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * -K: decode only keyframes, every nth one from au_next or the one nearest
+ * each requested time, taking AU k to be shown at k / fps. If the first one
+ * has no parameter sets of its own it gets the first ones in the stream.
+ */
+static void pick_keyframes(struct session *s)
+{
+    size_t *keys, n_keys = 0, k, i;
+    unsigned char *au = NULL;
+    int fd;
+
+    if (!s->keyframe_every && !s->n_keyframe_times)
+        return;
+
+    keys = malloc(s->au_count * sizeof(*keys));
+    s->au_pick = malloc((s->au_count + s->n_keyframe_times) * sizeof(*s->au_pick));
+    if (!keys || !s->au_pick) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (k = s->au_next; k < s->au_count; ++k) {
+        if (s->au_index[k].flags & AU_FLAG_KEYFRAME)
+            keys[n_keys++] = k;
+    }
+    if (!n_keys) {
+        fprintf(stderr, "No keyframes in %s\n", s->in_filename);
+        exit(EXIT_FAILURE);
+    }
+
+    if (s->keyframe_every) {
+        for (i = 0; i < n_keys; i += s->keyframe_every)
+            s->au_pick[s->au_pick_count++] = keys[i];
+    } else {
+        qsort(s->keyframe_times, s->n_keyframe_times, sizeof(double), cmp_double);
+        for (i = 0; i < s->n_keyframe_times; ++i) {
+            double target = s->keyframe_times[i] * s->fps;
+            size_t lo = 0, hi = n_keys;
+
+            /* First keyframe at or after target, or the one before if that is nearer */
+            while (lo < hi) {
+                size_t mid = (lo + hi) / 2;
+
+                if (keys[mid] < target)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+            if (lo == n_keys || (lo > 0 && target - keys[lo - 1] <= keys[lo] - target))
+                lo--;
+
+            if (!s->au_pick_count || s->au_pick[s->au_pick_count - 1] != keys[lo])
+                s->au_pick[s->au_pick_count++] = keys[lo];
+        }
+    }
+    free(keys);
+
+    log_info("Keyframes only: decoding %zu of %zu AUs\n", s->au_pick_count, s->au_count);
+
+    fd = open(s->in_filename, O_RDONLY);
+    if (-1 == fd)
+        errno_exit(s->in_filename);
+
+    read_au(fd, &s->au_index[s->au_pick[0]], &au);
+    if (!copy_param_sets(s, au, au + s->au_index[s->au_pick[0]].size, NULL, NULL)) {
+        for (k = 0; k < s->au_pick[0] && !s->param_sets_len; ++k) {
+            read_au(fd, &s->au_index[k], &au);
+            copy_param_sets(s, au, au + s->au_index[k].size, &s->param_sets_buf, &s->param_sets_len);
+        }
+        s->param_sets = s->param_sets_buf;
+    }
+
+    free(au);
+    close(fd);
+}
+
+/* Load <infile>.auidx, or build it and save it for the next run. */
+static void open_au_index(struct session *s)
+{
+    char path[PATH_MAX];
+    struct stat st;
+    size_t k;
+    int in_fd;
+
+    in_fd = open(s->in_filename, O_RDONLY);
+    if (-1 == in_fd || -1 == fstat(in_fd, &st)) {
+        fprintf(stderr, "Failed to open input file %s\n", s->in_filename);
+        if (-1 != in_fd)
+            close(in_fd);
+        return;
+    }
+
+    snprintf(path, sizeof(path), "%s.auidx", s->in_filename);
+
+    if (load_au_index(s, path, &st)) {
+        log_info("Loaded index of %zu access units from %s\n", s->au_count, path);
+    } else {
+        posix_fadvise(in_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        build_au_index(s, in_fd);
+        log_info("Indexed %zu access units\n", s->au_count);
+        save_au_index(s, path, &st);
+    }
+    close(in_fd);
+
+    if (s->start_au >= 0) {
+        if ((size_t)s->start_au >= s->au_count) {
+            fprintf(stderr, "Start AU %ld is beyond the last AU %zu\n", s->start_au, s->au_count);
+            exit(EXIT_FAILURE);
+        }
+        for (k = s->start_au; k > 0 && !(s->au_index[k].flags & AU_FLAG_KEYFRAME); --k)
+            ;
+        if (k != (size_t)s->start_au)
+            log_info("Starting at keyframe AU %zu instead of %ld\n", k, s->start_au);
+        s->au_next = k;
+    }
+
+    pick_keyframes(s);
+}
+
+static void close_input(struct session *s)
+{
+    close_au_index(s);
+    readahead_stop(s);
+
+    if (s->in_map && -1 == munmap((void *)s->in_map, s->in_map_len))
+        errno_exit("munmap");
+    s->in_map = NULL;
+
+    if (s->in_fp)
+        fclose(s->in_fp);
+    s->in_fp = NULL;
+
+    if (s->in_bytes_delivered)
+        log_info("\nInput: scanned %llu bytes to deliver %llu (%.2f bytes scanned per byte delivered)\n",
+                s->in_bytes_scanned, s->in_bytes_delivered,
+                (double)s->in_bytes_scanned / s->in_bytes_delivered);
+}
+
+static void init_device(struct session *s)
+{
+    struct v4l2_capability cap;
+    struct v4l2_cropcap cropcap;
+    struct v4l2_crop crop;
+    struct v4l2_format fmt;
+    unsigned int min;
+
+    if (-1 == xioctl(s->fd, VIDIOC_QUERYCAP, &cap)) {
+        if (EINVAL == errno) {
+            fprintf(stderr, "%s is no V4L2 device\n",
+                    s->dev_name);
+            exit(EXIT_FAILURE);
+        } else {
+            errno_exit("VIDIOC_QUERYCAP");
+        }
+    }
+/*
+bcm2835-v4l2
+8520 0005
+V4L2_CAP_VIDEO_CAPTURE
+V4L2_CAP_VIDEO_OVERLAY
+V4L2_CAP_EXT_PIX_FORMAT
+V4L2_CAP_READWRITE
+V4L2_CAP_STREAMING
+V4L2_CAP_DEVICE_CAPS
+
+bcm2835-codec
+8420 4000
+V4L2_CAP_VIDEO_M2M_MPLANE
+V4L2_CAP_EXT_PIX_FORMAT
+V4L2_CAP_STREAMING
+V4L2_CAP_DEVICE_CAPS
+*/
+    log_debug("caps returned %04x\n", cap.capabilities);
+    if (!(cap.capabilities & (V4L2_CAP_VIDEO_M2M|V4L2_CAP_VIDEO_M2M_MPLANE|V4L2_CAP_VIDEO_CAPTURE))) {
+        fprintf(stderr, "%s is no video capture device\n",
+                s->dev_name);
+        exit(EXIT_FAILURE);
+    }
+
+    if (cap.capabilities & V4L2_CAP_VIDEO_M2M_MPLANE)
+        s->multi_planar = 1;
+
+    switch (s->io) {
+    case IO_METHOD_READ:
+        if (!(cap.capabilities & V4L2_CAP_READWRITE)) {
+            fprintf(stderr, "%s does not support read i/o\n",
+                    s->dev_name);
+            exit(EXIT_FAILURE);
+        }
+        break;
+
+    case IO_METHOD_MMAP:
+    case IO_METHOD_USERPTR:
+        if (!(cap.capabilities & V4L2_CAP_STREAMING)) {
+            fprintf(stderr, "%s does not support streaming i/o\n",
+                    s->dev_name);
+            exit(EXIT_FAILURE);
+        }
+        break;
+    }
+
+
+    /* Select video input, video standard and tune here. */
+
+    CLEAR(cropcap);
+
+    cropcap.type = stream_type(s, V4L2_BUF_TYPE_VIDEO_CAPTURE);
+
+    if (0 == xioctl(s->fd, VIDIOC_CROPCAP, &cropcap)) {
+        crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        crop.c = cropcap.defrect; /* reset to default */
+
+        if (-1 == xioctl(s->fd, VIDIOC_S_CROP, &crop)) {
+            switch (errno) {
+            case EINVAL:
+                /* Cropping not supported. */
+                break;
+                
+            default:
+                /* Errors ignored. */
+                break;
+            }
+        }
+    } else {
+        /* Errors ignored. */
+    }
+
+
+    CLEAR(fmt);
+
+    fmt.type = stream_type(s, V4L2_BUF_TYPE_VIDEO_CAPTURE);
+
+    if (-1 == xioctl(s->fd, VIDIOC_G_FMT, &fmt))
+        errno_exit("VIDIOC_G_FMT");
+
+    if (s->force_format) {
+        if (s->multi_planar) {
+            fmt.fmt.pix_mp.width       = 1920;
+            fmt.fmt.pix_mp.height      = 1080;
+            fmt.fmt.pix_mp.pixelformat = V4L2_PIX_FMT_YUV420;
+            fmt.fmt.pix_mp.field       = V4L2_FIELD_NONE;
+        } else {
+            fmt.fmt.pix.width       = 640;
+            fmt.fmt.pix.height      = 480;
+            fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUV420;
+            fmt.fmt.pix.field       = V4L2_FIELD_NONE;
+        }
+
+        if (-1 == xioctl(s->fd, VIDIOC_S_FMT, &fmt))
+            errno_exit("VIDIOC_S_FMT");
+
+        /* Note VIDIOC_S_FMT may change width and height. */
+    }
+
+    /*
+     * Buggy driver paranoia. Formats with a buffer per plane have smaller
+     * chroma planes, so their sizes are taken as reported. Rows are at least
+     * as wide as the pixel format needs, two bytes a pixel if it isn't known.
+     */
+    if (s->multi_planar) {
+        if (fmt.fmt.pix_mp.num_planes == 1) {
+            struct v4l2_plane_pix_format *pf = &fmt.fmt.pix_mp.plane_fmt[0];
+            unsigned int bpp = pack_bpp(fmt.fmt.pix_mp.pixelformat);
+
+            min = fmt.fmt.pix_mp.width * (bpp ? bpp : 2);
+            if (pf->bytesperline > 0 && pf->bytesperline < min)
+                pf->bytesperline = min;
+            min = pf->bytesperline * fmt.fmt.pix_mp.height;
+            if (pf->sizeimage > 0 && pf->sizeimage < min)
+                pf->sizeimage = min;
+        }
+    } else {
+        unsigned int bpp = pack_bpp(fmt.fmt.pix.pixelformat);
+
+        min = fmt.fmt.pix.width * (bpp ? bpp : 2);
+        if (fmt.fmt.pix.bytesperline < min)
+            fmt.fmt.pix.bytesperline = min;
+        min = fmt.fmt.pix.bytesperline * fmt.fmt.pix.height;
+        if (fmt.fmt.pix.sizeimage < min)
+            fmt.fmt.pix.sizeimage = min;
+    }
+
+    s->cap_fmt = fmt;
+    setup_pack(s);
+
+    switch (s->io) {
+    case IO_METHOD_READ:
+        init_read(s, fmt.fmt.pix.sizeimage);
+        break;
+
+    case IO_METHOD_MMAP:
+    case IO_METHOD_USERPTR:
+        if (s->multi_planar)
+            init_buffers_mp(s, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE, &s->buffers_mp, &s->n_buffers);
+        else
+            init_buffers(s, V4L2_BUF_TYPE_VIDEO_CAPTURE, &s->buffers, &s->n_buffers);
+        break;
+    }
+    if (cap.capabilities & (V4L2_CAP_VIDEO_M2M|V4L2_CAP_VIDEO_M2M_MPLANE)) {
+        init_device_out(s);
+        s->m2m_enabled = 1;
+        if (s->in_filename) {
+            if (s->map_input) {
+                map_input_file(s);
+            } else {
+                s->in_fp = fopen(s->in_filename, "rb");
+                if (!s->in_fp)
+                    fprintf(stderr, "Failed to open input file %s\n", s->in_filename);
+            }
+            if (s->use_index)
+                open_au_index(s);
+        }
+    } else if (!s->frame_count) {
+        /* A capture device has no end of stream. */
+        s->frame_count = 70;
+    }
+}
+
+static void close_device(struct session *s)
+{
+    if (s->mock)
+        mock_close(s->fd);
+    else if (s->replay)
+        replay_close(s->fd);
+    else if (-1 == close(s->fd))
+        errno_exit("close");
+
+    s->fd = -1;
+}
+
+static void open_device(struct session *s)
+{
+    struct stat st;
+
+    /* "mock" or "mock:key=val,..." is the userspace decoder in mockdev.c */
+    if (!strncmp(s->dev_name, "mock", 4) && (!s->dev_name[4] || s->dev_name[4] == ':')) {
+        s->fd = mock_open(s->dev_name[4] ? s->dev_name + 5 : "");
+        if (-1 == s->fd)
+            errno_exit("mock_open");
+        s->mock    = 1;
+        s->wait_fd = mock_wait_fd(s->fd);
+        return;
+    }
+
+    if (!strncmp(s->dev_name, "replay:", 7)) {
+        s->fd = replay_open(s->dev_name + 7);
+        if (-1 == s->fd)
+            errno_exit("replay_open");
+        s->replay  = 1;
+        s->wait_fd = replay_wait_fd(s->fd);
+        return;
+    }
+
+    if (-1 == stat(s->dev_name, &st)) {
+        fprintf(stderr, "Cannot identify '%s': %d, %s\n",
+                s->dev_name, errno, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if (!S_ISCHR(st.st_mode)) {
+        fprintf(stderr, "%s is no devicen", s->dev_name);
+        exit(EXIT_FAILURE);
+    }
+
+    s->fd = open(s->dev_name, O_RDWR /* required */ | O_NONBLOCK, 0);
+
+    if (-1 == s->fd) {
+        fprintf(stderr, "Cannot open '%s': %d, %s\n",
+                s->dev_name, errno, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    s->wait_fd = s->fd;
+}
+
+static double elapsed_ms(const struct timespec *since)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1e3 + (now.tv_nsec - since->tv_nsec) / 1e6;
+}
+
+/* Whether the CAPTURE buffers we have can hold frames in the format fmt. */
+static int capture_fits(struct session *s, const struct v4l2_format *fmt)
+{
+    unsigned int b, p;
+
+    if (buffer_count(s, fmt->type) > s->n_buffers)
+        return 0;
+
+    for (b = 0; b < s->n_buffers; ++b) {
+        if (s->multi_planar) {
+            if (s->buffers_mp[b].num_planes != fmt->fmt.pix_mp.num_planes)
+                return 0;
+            for (p = 0; p < s->buffers_mp[b].num_planes; ++p)
+                if (s->buffers_mp[b].length[p] < fmt->fmt.pix_mp.plane_fmt[p].sizeimage)
+                    return 0;
+        } else if (s->buffers[b].length < fmt->fmt.pix.sizeimage) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * Handle a resolution change. The decoder only needs the CAPTURE queue
+ * restarted, so if the current buffers are big enough for the new format
+ * they are requeued as they are; otherwise they are reallocated.
+ */
+static void source_change(struct session *s)
+{
+    struct v4l2_format fmt;
+
+    clock_gettime(CLOCK_MONOTONIC, &s->src_change_ts);
+    s->src_change_pending = 1;
+    s->source_changes++;
+
+    writer_flush(s);
+    uring_flush(s);
+    if (s->sink)
+        s->sink->flush(s);
+    stop_capture(s, V4L2_BUF_TYPE_VIDEO_CAPTURE);
+
+    CLEAR(fmt);
+    fmt.type = stream_type(s, V4L2_BUF_TYPE_VIDEO_CAPTURE);
+    if (-1 == xioctl(s->fd, VIDIOC_G_FMT, &fmt))
+        errno_exit("VIDIOC_G_FMT");
+
+    if (capture_fits(s, &fmt)) {
+        log_info("Source changed to %ux%u, reusing %u buffers\n",
+                fmt.fmt.pix.width, fmt.fmt.pix.height, s->n_buffers);
+        s->cap_fmt = fmt;
+    } else {
+        log_info("Source changed to %ux%u, reallocating buffers\n",
+                fmt.fmt.pix.width, fmt.fmt.pix.height);
+        s->cap_fmt = fmt;
+
+        if (s->multi_planar) {
+            unmap_buffers_mp(s, s->buffers_mp, s->n_buffers);
+            free(s->buffers_mp);
+            free_buffers(s, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE);
+            init_buffers_mp(s, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE, &s->buffers_mp, &s->n_buffers);
+        } else {
+            unmap_buffers(s, s->buffers, s->n_buffers);
+            free(s->buffers);
+            free_buffers(s, V4L2_BUF_TYPE_VIDEO_CAPTURE);
+            init_buffers(s, V4L2_BUF_TYPE_VIDEO_CAPTURE, &s->buffers, &s->n_buffers);
+        }
+        if (s->uring)
+            uring_register_buffers(s);
+    }
+    setup_pack(s);
+
+    if (s->multi_planar)
+        start_streaming_mp(s, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE, s->buffers_mp, s->n_buffers);
+    else
+        start_streaming(s, V4L2_BUF_TYPE_VIDEO_CAPTURE, s->buffers, s->n_buffers);
+
+    log_info("Source change handled in %.2f ms\n", elapsed_ms(&s->src_change_ts));
+}
+
+/*
+ * Once the input runs out, ask the decoder to drain. It then returns every
+ * pending frame, the last one flagged V4L2_BUF_FLAG_LAST, and signals EOS.
+ */
+static void decoder_stop(struct session *s)
+{
+    struct v4l2_decoder_cmd cmd;
+
+    if (!s->input_eof || s->stop_sent)
+        return;
+    s->stop_sent = 1;
+
+    CLEAR(cmd);
+    cmd.cmd = V4L2_DEC_CMD_STOP;
+
+    if (-1 == xioctl(s->fd, VIDIOC_DECODER_CMD, &cmd)) {
+        log_warn("VIDIOC_DECODER_CMD STOP failed (%s), not draining\n", strerror(errno));
+        s->eos = 1;
+        return;
+    }
+
+    log_info("End of input, draining\n");
+}
+
+static void handle_event(struct session *s)
+{
+    struct v4l2_event ev;
+
+    while (!xioctl(s->fd, VIDIOC_DQEVENT, &ev)) {
+        switch (ev.type) {
+        case V4L2_EVENT_SOURCE_CHANGE:
+            source_change(s);
+            break;
+        case V4L2_EVENT_EOS:
+            log_info("EOS\n");
+            s->eos = 1;
+            break;
+        }
+    }
+
+}
+
+static int dequeue_capture(struct session *s)
+{
+    int got;
+
+    if (s->multi_planar)
+        got = read_frame_mp(s, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE, s->buffers_mp, s->n_buffers);
+    else
+        got = read_frame(s, V4L2_BUF_TYPE_VIDEO_CAPTURE, s->buffers, s->n_buffers);
+
+    if (got && s->src_change_pending) {
+        log_info("First frame %.2f ms after source change\n", elapsed_ms(&s->src_change_ts));
+        s->src_change_pending = 0;
+    }
+
+    if (s->cap_starved)
+        grow_capture(s);
+
+    /* The empty buffer that ends a drain isn't a frame. */
+    return got && !s->last_empty;
+}
+
+static int dequeue_output(struct session *s)
+{
+    int got;
+
+    if (s->out_memory == V4L2_MEMORY_DMABUF)
+        got = read_frame_dmabuf_out(s, stream_type(s, V4L2_BUF_TYPE_VIDEO_OUTPUT));
+    else if (s->multi_planar)
+        got = read_frame_mp(s, V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE, s->buffers_mp_out, s->n_buffers_out);
+    else
+        got = read_frame(s, V4L2_BUF_TYPE_VIDEO_OUTPUT, s->buffers_out, s->n_buffers_out);
+
+    return got;
+}
+
+static void session_defaults(struct session *s)
+{
+    memset(s, 0, sizeof(*s));
+    s->dev_name     = "/dev/video0";
+    s->io           = IO_METHOD_MMAP;
+    s->fd           = -1;
+    s->wait_fd      = -1;
+    s->codec        = CODEC_H264;
+    s->frame_count  = 0;
+    s->start_au     = -1;
+    s->end_au       = -1;
+    s->fps          = 25;
+    s->sink_fd      = -1;
+    s->out_memory   = V4L2_MEMORY_MMAP;
+    s->producer_fd  = -1;
+    s->cap_count    = 4;
+    s->out_count    = 4;
+    s->buf_headroom = 2;
+    s->feeder_cpu   = -1;
+    s->drainer_cpu  = -1;
+    s->done_fd      = -1;
+}
+
+/* epoll data for a session's fds: the session index and which fd it is */
+enum session_fd {
+    SESSION_FD_DEVICE,
+    SESSION_FD_SINK,
+    SESSION_FD_URING,
+    SESSION_FD_THREADS,
+};
+
+#define EPOLL_TAG(i, which)     (((uint64_t)(i) << 2) | (which))
+
+/* A frame count of 0 runs until the decoder reports the end of the stream. */
+static int session_complete(struct session *s)
+{
+    return s->eos || (s->frame_count && s->frames >= s->frame_count);
+}
+
+/*
+ * With -t, a session's OUTPUT feeder and CAPTURE drainer run on threads of
+ * their own, each blocked in poll() on the device for its own queue, so
+ * parsing the bitstream and writing frames overlap. The drainer handles
+ * events and serves the sink too. It holds feed_lock across a source change
+ * and the feeder takes it to send DECODER_CMD STOP, so a drain never starts
+ * while the CAPTURE queue is being restarted. The main loop only hears from
+ * the session once the drainer is done, through done_fd.
+ */
+enum session_thread {
+    THREAD_FEEDER,
+    THREAD_DRAINER,
+};
+
+static const short thread_wants[] = {
+    [THREAD_FEEDER]  = POLLOUT,
+    [THREAD_DRAINER] = POLLIN | POLLPRI,
+};
+
+static void pin_thread(int cpu, const char *name)
+{
+    cpu_set_t set;
+    int err;
+
+    if (cpu < 0)
+        return;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err)
+        log_warn("Can't pin the %s to CPU %d: %s\n", name, cpu, strerror(err));
+}
+
+static void ring_doorbell(int fd)
+{
+    uint64_t one = 1;
+
+    if (-1 == write(fd, &one, sizeof(one)))
+        errno_exit("eventfd write");
+}
+
+/*
+ * Wait until the device is ready for this thread or extra_fd is readable,
+ * which is reported in *extra, and return the device's events.
+ *
+ * A mock or replay has one wait_fd for both queues. The thread it wakes asks
+ * for the events and leaves the other thread's share in pseudo_events,
+ * ringing its doorbell. Until that share is taken the thread leaves wait_fd
+ * alone, as the mock keeps it readable while anything is ready.
+ */
+static uint32_t thread_poll(struct session *s, enum session_thread self, int extra_fd, int *extra)
+{
+    enum session_thread other = self == THREAD_FEEDER ? THREAD_DRAINER : THREAD_FEEDER;
+    short want = thread_wants[self];
+    int pseudo = s->mock || s->replay;
+
+    for (;;) {
+        struct pollfd pfd[3];
+        uint32_t theirs, mine;
+        uint64_t count;
+        int r;
+
+        theirs = s->thread_gone[other] ? 0 : thread_wants[other];
+
+        pfd[0].fd     = s->wait_fd;
+        pfd[0].events = pseudo ? POLLIN : want;
+        if (pseudo && (__atomic_load_n(&s->pseudo_events, __ATOMIC_ACQUIRE) & theirs))
+            pfd[0].fd = -1;
+        pfd[1].fd     = extra_fd;
+        pfd[1].events = POLLIN;
+        pfd[2].fd     = pseudo ? s->doorbell[self] : -1;
+        pfd[2].events = POLLIN;
+
+        r = poll(pfd, 3, 10000);
+        if (-1 == r) {
+            if (EINTR == errno)
+                continue;
+            errno_exit("poll");
+        }
+        if (0 == r) {
+            fprintf(stderr, "poll timeout\n");
+            exit(EXIT_FAILURE);
+        }
+        __atomic_add_fetch(&n_waits, 1, __ATOMIC_RELAXED);
+
+        *extra = extra_fd >= 0 && pfd[1].revents;
+        if (!pseudo)
+            return pfd[0].revents;
+
+        if (pfd[2].revents && -1 == read(s->doorbell[self], &count, sizeof(count)) && EAGAIN != errno)
+            errno_exit("eventfd read");
+
+        if (pfd[0].revents) {
+            uint32_t events = s->mock ? mock_poll(s->fd) : replay_poll(s->fd);
+
+            if (trace_enabled())
+                trace_wait(s->fd, events);
+            events &= POLLIN | POLLOUT | POLLPRI;
+            __atomic_or_fetch(&s->pseudo_events, events, __ATOMIC_RELEASE);
+            if (events & theirs)
+                ring_doorbell(s->doorbell[other]);
+        }
+
+        /* Taking our share lets the other thread watch wait_fd again. */
+        mine = __atomic_fetch_and(&s->pseudo_events, ~want, __ATOMIC_ACQ_REL) & want;
+        if (mine && theirs)
+            ring_doorbell(s->doorbell[other]);
+        if (mine || *extra)
+            return mine;
+    }
+}
+
+static void *feeder_main(void *arg)
+{
+    struct session *s = arg;
+    int done = 0;
+
+    pin_thread(s->feeder_cpu, "feeder");
+
+    while (!s->stop_sent && !done) {
+        uint32_t events = thread_poll(s, THREAD_FEEDER, s->done_fd, &done);
+
+        if (events & POLLOUT) {
+            while (dequeue_output(s))
+                ;
+        }
+
+        pthread_mutex_lock(&s->feed_lock);
+        decoder_stop(s);
+        pthread_mutex_unlock(&s->feed_lock);
+    }
+
+    __atomic_store_n(&s->thread_gone[THREAD_FEEDER], 1, __ATOMIC_RELEASE);
+    ring_doorbell(s->doorbell[THREAD_DRAINER]);
+    return NULL;
+}
+
+static void *drainer_main(void *arg)
+{
+    struct session *s = arg;
+
+    pin_thread(s->drainer_cpu, "drainer");
+
+    while (!session_complete(s)) {
+        int sink_ready;
+        uint32_t events = thread_poll(s, THREAD_DRAINER, s->sink_fd, &sink_ready);
+
+        if (sink_ready)
+            s->sink->release(s);
+        if (events & POLLIN) {
+            while (!session_complete(s) && dequeue_capture(s))
+                s->frames++;
+            /* The feeder stopped at STOP; take back the OUTPUT buffers the drain waits for. */
+            while (s->last_seen && !s->eos && dequeue_output(s))
+                ;
+        }
+        if (events & POLLPRI) {
+            pthread_mutex_lock(&s->feed_lock);
+            handle_event(s);
+            pthread_mutex_unlock(&s->feed_lock);
+            /* EOS can be signalled before the last frames are dequeued. */
+            if (s->eos) {
+                while (dequeue_capture(s))
+                    s->frames++;
+            }
+        }
+    }
+
+    __atomic_store_n(&s->thread_gone[THREAD_DRAINER], 1, __ATOMIC_RELEASE);
+    ring_doorbell(s->done_fd);
+    return NULL;
+}
+
+static void threads_start(struct session *s, int epfd, unsigned int i)
+{
+    struct epoll_event ev;
+    int err;
+
+    s->done_fd     = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    s->doorbell[0] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    s->doorbell[1] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (-1 == s->done_fd || -1 == s->doorbell[0] || -1 == s->doorbell[1])
+        errno_exit("eventfd");
+    pthread_mutex_init(&s->feed_lock, NULL);
+
+    CLEAR(ev);
+    ev.events   = EPOLLIN;
+    ev.data.u64 = EPOLL_TAG(i, SESSION_FD_THREADS);
+    if (-1 == epoll_ctl(epfd, EPOLL_CTL_ADD, s->done_fd, &ev))
+        errno_exit("EPOLL_CTL_ADD");
+
+    err = pthread_create(&s->feeder_thread, NULL, feeder_main, s);
+    if (!err)
+        err = pthread_create(&s->drainer_thread, NULL, drainer_main, s);
+    if (err) {
+        errno = err;
+        errno_exit("pthread_create");
+    }
+}
+
+static void threads_stop(struct session *s, int epfd)
+{
+    if (-1 == epoll_ctl(epfd, EPOLL_CTL_DEL, s->done_fd, NULL))
+        errno_exit("EPOLL_CTL_DEL");
+
+    /* done_fd stays readable, which also stops the feeder if it is still waiting. */
+    pthread_join(s->drainer_thread, NULL);
+    pthread_join(s->feeder_thread, NULL);
+
+    pthread_mutex_destroy(&s->feed_lock);
+    close(s->doorbell[0]);
+    close(s->doorbell[1]);
+    close(s->done_fd);
+    s->done_fd = -1;
+}
+
+static void session_start(struct session *s, int epfd, unsigned int i)
+{
+    struct epoll_event ev;
+
+    if (s->producer_path)
+        s->producer_fd = unix_connect(s->producer_path);
+    if (s->sink)
+        s->sink->open(s, s->sink_arg);
+    open_device(s);
+    init_device(s);
+    uring_start(s);
+    start_capturing(s);
+    writer_start(s);
+    decoder_stop(s);
+
+    if (s->threaded) {
+        threads_start(s, epfd, i);
+        return;
+    }
+
+    /* Level triggered, so a session left with work after its budget is reported again. */
+    CLEAR(ev);
+    ev.events   = EPOLLIN | EPOLLOUT | EPOLLPRI;
+    ev.data.u64 = EPOLL_TAG(i, SESSION_FD_DEVICE);
+    if (-1 == epoll_ctl(epfd, EPOLL_CTL_ADD, s->wait_fd, &ev))
+        errno_exit("EPOLL_CTL_ADD");
+
+    if (s->sink_fd >= 0) {
+        ev.events   = EPOLLIN;
+        ev.data.u64 = EPOLL_TAG(i, SESSION_FD_SINK);
+        if (-1 == epoll_ctl(epfd, EPOLL_CTL_ADD, s->sink_fd, &ev))
+            errno_exit("EPOLL_CTL_ADD");
+    }
+
+    if (s->uring) {
+        ev.events   = EPOLLIN;
+        ev.data.u64 = EPOLL_TAG(i, SESSION_FD_URING);
+        if (-1 == epoll_ctl(epfd, EPOLL_CTL_ADD, uring_fd(s->uring), &ev))
+            errno_exit("EPOLL_CTL_ADD");
+    }
+}
+
+static void session_finish(struct session *s, int epfd)
+{
+    if (s->threaded) {
+        threads_stop(s, epfd);
+    } else {
+        if (-1 == epoll_ctl(epfd, EPOLL_CTL_DEL, s->wait_fd, NULL))
+            errno_exit("EPOLL_CTL_DEL");
+        if (s->sink_fd >= 0 && -1 == epoll_ctl(epfd, EPOLL_CTL_DEL, s->sink_fd, NULL))
+            errno_exit("EPOLL_CTL_DEL");
+        if (s->uring && -1 == epoll_ctl(epfd, EPOLL_CTL_DEL, uring_fd(s->uring), NULL))
+            errno_exit("EPOLL_CTL_DEL");
+    }
+
+    writer_stop(s);
+    uring_flush(s);
+    if (s->sink)
+        s->sink->flush(s);
+    stop_capturing(s);
+    uninit_device(s);
+    close_device(s);
+    if (s->sink)
+        s->sink->close(s);
+    close_input(s);
+    uring_stop(s);
+    if (s->out_fp)
+        fclose(s->out_fp);
+    s->out_fp = NULL;
+    report_latency(s);
+
+    n_frames += s->frames;
+    s->done = 1;
+}
+
+/*
+ * Serve one session's ready fd. Each ready queue is dequeued until EAGAIN or
+ * for at most one queue's worth of buffers, whichever comes first, so a busy
+ * session can't hold up the others; anything left over is picked up on the
+ * next epoll_wait(), which the main loop serves starting from another session
+ * each time. OUTPUT buffers are refilled and queued as soon as they come back.
+ */
+static void session_serve(struct session *s, uint32_t events, enum session_fd which)
+{
+    unsigned int budget;
+
+    if (which == SESSION_FD_SINK) {
+        s->sink->release(s);
+        return;
+    }
+    if (which == SESSION_FD_URING) {
+        uring_reap(s);
+        return;
+    }
+    if (which == SESSION_FD_THREADS)
+        return;
+
+    /* The wait_fd of a mock or replay only says something changed, ask what. */
+    if (s->mock)
+        events = mock_poll(s->fd);
+    else if (s->replay)
+        events = replay_poll(s->fd);
+    if (trace_enabled())
+        trace_wait(s->fd, events);
+
+    if (events & EPOLLIN) {
+        for (budget = s->n_buffers; budget && !session_complete(s); budget--) {
+            if (!dequeue_capture(s))
+                break;
+            s->frames++;
+        }
+    }
+    if (events & EPOLLOUT) {
+        for (budget = s->n_buffers_out; budget; budget--) {
+            if (!dequeue_output(s))
+                break;
+        }
+    }
+    if (events & EPOLLPRI) {
+        handle_event(s);
+        /* EOS can be signalled before the last frames are dequeued. */
+        if (s->eos) {
+            while (dequeue_capture(s))
+                s->frames++;
+        }
+    }
+
+    decoder_stop(s);
+}
+
+static void metrics_signal(int sig)
+{
+    (void)sig;
+    metrics_requested = 1;
+}
+
+/* Write str escaped for a JSON string or a Prometheus label value */
+static void write_escaped(FILE *fp, const char *str)
+{
+    for (; *str; ++str) {
+        if (*str == '\n') {
+            fputs("\\n", fp);
+            continue;
+        }
+        if (*str == '"' || *str == '\\')
+            fputc('\\', fp);
+        fputc(*str, fp);
+    }
+}
+
+static void write_metrics_json(FILE *fp, struct session *sessions, unsigned int n_sessions)
+{
+    const struct ioctl_stat *st;
+    unsigned int i;
+
+    fprintf(fp, "{\"seconds\":%.6f,\"cpu_seconds\":%.6f,\"max_rss_kb\":%ld,\"frames\":%llu,\"ioctls\":{",
+            (monotonic_ns() - start_ns) / 1e9, cpu_seconds(), max_rss_kb(), n_frames);
+    for (st = ioctl_stats; ; st++) {
+        fprintf(fp, "\"%s\":{\"calls\":%llu,\"seconds\":%.9f,\"max_seconds\":%.9f}",
+                st->name, st->calls, st->ns / 1e9, st->max_ns / 1e9);
+        if (!st->request)
+            break;
+        fprintf(fp, ",");
+    }
+    fprintf(fp, "},\"waits\":%llu,\"sessions\":[", n_waits);
+
+    for (i = 0; i < n_sessions; ++i) {
+        struct session *s = &sessions[i];
+
+        fprintf(fp, "%s{\"session\":%u,\"device\":\"", i ? "," : "", i);
+        write_escaped(fp, s->dev_name);
+        fprintf(fp, "\",\"frames\":%d,"
+                "\"bytes_in\":%llu,\"bytes_out\":%llu,\"bytes_written\":%llu,"
+                "\"in_flight\":{\"output\":%u,\"capture\":%u},"
+                "\"stalls\":{\"output\":%llu,\"capture\":%llu},"
+                "\"source_changes\":%llu,"
+                "\"latency_ms\":{\"p50\":%.3f,\"p99\":%.3f,\"max\":%.3f},\"done\":%s}",
+                s->frames,
+                s->in_bytes_delivered, s->bytes_out, s->bytes_written,
+                s->done ? 0 : __atomic_load_n(&s->out_queued, __ATOMIC_RELAXED),
+                s->done ? 0 : __atomic_load_n(&s->cap_queued, __ATOMIC_RELAXED),
+                __atomic_load_n(&s->out_stalls, __ATOMIC_RELAXED),
+                __atomic_load_n(&s->cap_stalls, __ATOMIC_RELAXED),
+                s->source_changes, s->lat_p50_us / 1e3, s->lat_p99_us / 1e3,
+                s->lat_max_us / 1e3, s->done ? "true" : "false");
+    }
+    fprintf(fp, "]}\n");
+}
+
+static void write_metrics_prom(FILE *fp, struct session *sessions, unsigned int n_sessions)
+{
+    const struct ioctl_stat *st;
+    unsigned int i;
+
+    fprintf(fp, "# TYPE m2m_elapsed_seconds gauge\nm2m_elapsed_seconds %.6f\n",
+            (monotonic_ns() - start_ns) / 1e9);
+    fprintf(fp, "# TYPE m2m_cpu_seconds_total counter\nm2m_cpu_seconds_total %.6f\n", cpu_seconds());
+    fprintf(fp, "# TYPE m2m_max_rss_bytes gauge\nm2m_max_rss_bytes %ld\n", max_rss_kb() * 1024);
+    fprintf(fp, "# TYPE m2m_ioctl_calls_total counter\n");
+    for (st = ioctl_stats; ; st++) {
+        fprintf(fp, "m2m_ioctl_calls_total{ioctl=\"%s\"} %llu\n", st->name, st->calls);
+        if (!st->request)
+            break;
+    }
+    fprintf(fp, "# TYPE m2m_ioctl_seconds_total counter\n");
+    for (st = ioctl_stats; ; st++) {
+        fprintf(fp, "m2m_ioctl_seconds_total{ioctl=\"%s\"} %.9f\n", st->name, st->ns / 1e9);
+        if (!st->request)
+            break;
+    }
+    fprintf(fp, "# TYPE m2m_ioctl_max_seconds gauge\n");
+    for (st = ioctl_stats; ; st++) {
+        fprintf(fp, "m2m_ioctl_max_seconds{ioctl=\"%s\"} %.9f\n", st->name, st->max_ns / 1e9);
+        if (!st->request)
+            break;
+    }
+    fprintf(fp, "# TYPE m2m_waits_total counter\nm2m_waits_total %llu\n", n_waits);
+
+    /* One sample per session for metric name, with extra labels and a value. */
+#define PROM_SESSIONS(name, labels, fmt, value)                                 \
+    for (i = 0; i < n_sessions; ++i) {                                          \
+        struct session *s = &sessions[i];                                       \
+        fprintf(fp, "m2m_" name "{session=\"%u\",device=\"", i);                \
+        write_escaped(fp, s->dev_name);                                         \
+        fprintf(fp, "\"" labels "} " fmt "\n", value);                          \
+    }
+
+    fprintf(fp, "# TYPE m2m_frames_total counter\n");
+    PROM_SESSIONS("frames_total", "", "%d", s->frames);
+    fprintf(fp, "# TYPE m2m_bytes_in_total counter\n");
+    PROM_SESSIONS("bytes_in_total", "", "%llu", s->in_bytes_delivered);
+    fprintf(fp, "# TYPE m2m_bytes_out_total counter\n");
+    PROM_SESSIONS("bytes_out_total", "", "%llu", s->bytes_out);
+    fprintf(fp, "# TYPE m2m_bytes_written_total counter\n");
+    PROM_SESSIONS("bytes_written_total", "", "%llu", s->bytes_written);
+    fprintf(fp, "# TYPE m2m_buffers_in_flight gauge\n");
+    PROM_SESSIONS("buffers_in_flight", ",queue=\"output\"", "%u", s->done ? 0 : __atomic_load_n(&s->out_queued, __ATOMIC_RELAXED));
+    PROM_SESSIONS("buffers_in_flight", ",queue=\"capture\"", "%u", s->done ? 0 : __atomic_load_n(&s->cap_queued, __ATOMIC_RELAXED));
+    fprintf(fp, "# TYPE m2m_stalls_total counter\n");
+    PROM_SESSIONS("stalls_total", ",queue=\"output\"", "%llu", __atomic_load_n(&s->out_stalls, __ATOMIC_RELAXED));
+    PROM_SESSIONS("stalls_total", ",queue=\"capture\"", "%llu", __atomic_load_n(&s->cap_stalls, __ATOMIC_RELAXED));
+    fprintf(fp, "# TYPE m2m_source_changes_total counter\n");
+    PROM_SESSIONS("source_changes_total", "", "%llu", s->source_changes);
+    fprintf(fp, "# TYPE m2m_latency_seconds gauge\n");
+    PROM_SESSIONS("latency_seconds", ",quantile=\"0.5\"", "%.6f", s->lat_p50_us / 1e6);
+    PROM_SESSIONS("latency_seconds", ",quantile=\"0.99\"", "%.6f", s->lat_p99_us / 1e6);
+    PROM_SESSIONS("latency_seconds", ",quantile=\"1\"", "%.6f", s->lat_max_us / 1e6);
+
+#undef PROM_SESSIONS
+}
+
+/* Write a snapshot to stdout, or atomically replace metrics_path. */
+static void dump_metrics(struct session *sessions, unsigned int n_sessions)
+{
+    char tmp_path[PATH_MAX + 4];
+    FILE *fp = stdout;
+
+    if (metrics_path) {
+        snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", metrics_path);
+        fp = fopen(tmp_path, "w");
+        if (!fp) {
+            fprintf(stderr, "Cannot write metrics to %s: %s\n", tmp_path, strerror(errno));
+            return;
+        }
+    }
+
+    if (metrics_format == METRICS_JSON)
+        write_metrics_json(fp, sessions, n_sessions);
+    else
+        write_metrics_prom(fp, sessions, n_sessions);
+
+    if (metrics_path) {
+        if (fclose(fp) || -1 == rename(tmp_path, metrics_path))
+            fprintf(stderr, "Cannot write metrics to %s: %s\n", metrics_path, strerror(errno));
+    } else {
+        fflush(fp);
+    }
+}
+
+static void mainloop(struct session *sessions, unsigned int n_sessions)
+{
+    struct epoll_event events[64];
+    unsigned int i, active = n_sessions, threaded = 0, round = 0;
+    uint64_t next_dump = 0, idle_since = monotonic_ns();
+    int epfd;
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (-1 == epfd)
+        errno_exit("epoll_create1");
+
+    if (metrics_format) {
+        struct sigaction sa;
+
+        CLEAR(sa);
+        sa.sa_handler = metrics_signal;
+        sa.sa_flags   = SA_RESTART;
+        sigaction(SIGUSR1, &sa, NULL);
+        if (metrics_interval)
+            next_dump = monotonic_ns() + metrics_interval * 1000000000ULL;
+    }
+
+    for (i = 0; i < n_sessions; ++i) {
+        session_start(&sessions[i], epfd, i);
+        threaded += sessions[i].threaded;
+    }
+
+    while (active) {
+        int r, e, timeout = 10000;
+        uint64_t now = monotonic_ns();
+
+        if (metrics_requested || (next_dump && now >= next_dump)) {
+            metrics_requested = 0;
+            dump_metrics(sessions, n_sessions);
+            if (next_dump)
+                next_dump = now + metrics_interval * 1000000000ULL;
+        }
+        if (next_dump && (next_dump - now) / 1000000 < (uint64_t)timeout)
+            timeout = (next_dump - now) / 1000000 + 1;
+
+        log_flush(0);
+
+        r = epoll_wait(epfd, events, sizeof(events) / sizeof(events[0]), timeout);
+        __atomic_add_fetch(&n_waits, 1, __ATOMIC_RELAXED);
+
+        if (-1 == r) {
+            if (EINTR == errno)
+                continue;
+            errno_exit("epoll_wait");
+        }
+
+        if (0 == r) {
+            /*
+             * Periodic dumps wake us up early; only give up after 10 s of
+             * silence. Threaded sessions time out on their own.
+             */
+            if (threaded || monotonic_ns() - idle_since < 10000000000ULL)
+                continue;
+            fprintf(stderr, "epoll timeout\n");
+            exit(EXIT_FAILURE);
+        }
+        idle_since = monotonic_ns();
+
+        /* Rotate the starting point so no session is always served first. */
+        for (e = 0; e < r; ++e) {
+            struct epoll_event *ev = &events[(e + round) % r];
+            struct session *s = &sessions[ev->data.u64 >> 2];
+
+            if (s->done)
+                continue;
+
+            session_serve(s, ev->events, ev->data.u64 & 3);
+
+            if (session_complete(s)) {
+                session_finish(s, epfd);
+                threaded -= s->threaded;
+                active--;
+            }
+        }
+        round++;
+    }
+
+    close(epfd);
+    log_flush(1);
+
+    if (metrics_format)
+        dump_metrics(sessions, n_sessions);
+}
+
+static void report_syscalls(void)
+{
+    unsigned long long syscalls = n_ioctls + n_waits;
+    double seconds = (monotonic_ns() - start_ns) / 1e9;
+
+    log_info("\n%llu frames, %llu ioctls, %llu waits", n_frames, n_ioctls, n_waits);
+    if (n_frames)
+        log_info(", %.2f syscalls per frame", (double)syscalls / n_frames);
+    log_info("\n");
+    if (n_frames)
+        log_info("%.3f s, %.1f frames/s, %.1f us CPU per frame\n", seconds,
+                 n_frames / seconds, cpu_seconds() * 1e6 / n_frames);
+}
+
+static void usage(FILE *fp, int argc, char **argv)
+{
+    struct session def;
 
-    fd = -1;
+    session_defaults(&def);
+    fprintf(fp,
+            "Usage: %s [options]\n\n"
+            "Version 1.3\n"
+            "Options:\n"
+            "-d | --device name   Video device name [%s], mock[:key=val,...] for the\n"
+            "                     userspace decoder in mockdev.h, or replay:trace[,fast]\n"
+            "                     to replay a trace recorded with -T\n"
+            "-h | --help          Print this message\n"
+            "-m | --mmap          Use memory mapped buffers [default]\n"
+            "-r | --read          Use read() calls\n"
+            "-u | --userp         Use application allocated buffers, for both queues\n"
+            "-L | --hugetlb       Back -u buffers with hugetlb pages rather than\n"
+            "                     transparent huge pages, while there are any\n"
+            "-o | --output name   Outputs stream to filename\n"
+            "-f | --format        Force format to 640x480 YUYV\n"
+            "-c | --count         Number of frames to grab, 0 to decode until the end\n"
+            "                     of the stream [%i; 70 for capture devices]\n"
+            "-i | --infile name   Input filename for M2M devices\n"
+            "-M | --map-input     Memory map the input file\n"
+            "-x | --index         Use (and create) an access unit index <infile>.auidx\n"
+            "-s | --start-au num  Start decoding at the keyframe at or before AU num\n"
+            "-C | --codec name    Input codec, h264 or hevc [from OUTPUT format]\n"
+            "-w | --writer-thread Write frames and requeue CAPTURE buffers on a thread\n"
+            "-e | --export sink   Export CAPTURE buffers as dmabufs to sink instead of\n"
+            "                     writing them: null or unix:path (SCM_RIGHTS)\n"
+            "-D | --out-dmabuf src Queue the bitstream as dmabufs from src: udmabuf\n"
+            "                     or unix:path (fds from a producer process)\n"
+            "-b | --buffers n[,m] CAPTURE[,OUTPUT] buffer counts, or auto for the\n"
+            "                     driver minimum plus headroom [4]\n"
+            "-H | --headroom n    Buffers added to the minimum in auto mode [%u]\n"
+            "-g | --grow          Add CAPTURE buffers when the decoder runs out\n"
+            "-N | --next          Start another session, copying the options so far;\n"
+            "                     all sessions are run together from one thread, and\n"
+            "                     sessions given the same -o write to <name>.<session>\n"
+            "-j | --metrics fmt   Dump metrics as json or prom at exit and on SIGUSR1\n"
+            "-J | --metrics-interval s  Also dump metrics every s seconds\n"
+            "-P | --metrics-file path   Write metrics to path instead of stdout\n"
+            "-v | --verbose       More diagnostics; twice for per-frame lines\n"
+            "-q | --quiet         Only report errors\n"
+            "-T | --trace path    Record every ioctl and device wakeup to path; neither\n"
+            "                     this nor replay: work with -t, -w or -U\n"
+            "-G | --gop-split n   Decode the input as n sessions at once, split at IDRs,\n"
+            "                     merging their frames into the output; give -C for\n"
+            "                     anything but H.264\n"
+            "-K | --keyframes n   Only decode every nth keyframe, or with @t1,t2,... the\n"
+            "                     keyframe nearest each time in seconds; implies -x\n"
+            "-F | --fps rate      Frame rate that -K times are counted in [%g]\n"
+            "-t | --threads cpus  Feed OUTPUT and drain CAPTURE from two threads of this\n"
+            "                     session's own, pinned to cpus f,d or unpinned with any\n"
+            "-U | --async-io how  Read the bitstream ahead and write frames without\n"
+            "                     blocking the loop: uring (io_uring, or a thread where\n"
+            "                     it isn't available) or thread\n"
+            "-p | --pack how      Write only the visible pixels of each frame, without\n"
+            "                     row padding: copy, or stream to bypass the cache\n"
+            "-X | --convert fmt   Write 4:2:0 frames as i420, nv12, yuyv or grey[/n],\n"
+            "                     the luma scaled down n times (2, 4 or 8); implies -p\n"
+            "-B | --convert-bench WxH,...  Time the -X conversions at each size with\n"
+            "                     every set of kernels the CPU runs, then exit\n"
+            "",
+            argv[0], def.dev_name, def.frame_count, def.buf_headroom, def.fps);
 }
 
-static void open_device(void)
+/*
+ * -G n: decode s's input as up to n sessions, each a run of AUs starting at
+ * an IDR, so that none of them references a picture another one decodes.
+ * The cuts are the first IDRs at or after even shares of the AUs. A run
+ * whose first AU doesn't carry its own parameter sets gets the first ones in
+ * the stream. Each run writes to <output>.gop<k>, merged by merge_gops().
+ * Returns the number of sessions written to parts.
+ */
+static unsigned int split_gops(const struct session *s, struct session *parts, unsigned int n)
 {
-    struct stat st;
-
-    if (-1 == stat(dev_name, &st)) {
-        fprintf(stderr, "Cannot identify '%s': %d, %s\n",
-                dev_name, errno, strerror(errno));
+    struct session idx = *s;
+    size_t starts[n];
+    unsigned char *au = NULL, *param_sets = NULL;
+    size_t param_sets_len = 0, k;
+    unsigned int n_parts = 1, p;
+    int fd;
+
+    idx.start_au = -1;
+    open_au_index(&idx);
+    if (!idx.au_count) {
+        fprintf(stderr, "No access units to split in %s\n", s->in_filename);
         exit(EXIT_FAILURE);
     }
 
-    if (!S_ISCHR(st.st_mode)) {
-        fprintf(stderr, "%s is no devicen", dev_name);
-        exit(EXIT_FAILURE);
+    starts[0] = 0;
+    for (p = 1; p < n; ++p) {
+        k = idx.au_count * p / n;
+        if (k <= starts[n_parts - 1])
+            k = starts[n_parts - 1] + 1;
+        while (k < idx.au_count && !au_is_idr(&idx, &idx.au_index[k]))
+            k++;
+        if (k >= idx.au_count)
+            break;
+        starts[n_parts++] = k;
     }
 
-    fd = open(dev_name, O_RDWR /* required */ | O_NONBLOCK, 0);
+    fd = open(s->in_filename, O_RDONLY);
+    if (-1 == fd)
+        errno_exit(s->in_filename);
 
-    if (-1 == fd) {
-        fprintf(stderr, "Cannot open '%s': %d, %s\n",
-                dev_name, errno, strerror(errno));
-        exit(EXIT_FAILURE);
+    for (k = 0; n_parts > 1 && k < starts[1] && !param_sets_len; ++k) {
+        read_au(fd, &idx.au_index[k], &au);
+        copy_param_sets(&idx, au, au + idx.au_index[k].size, &param_sets, &param_sets_len);
+    }
+
+    for (p = 0; p < n_parts; ++p) {
+        struct session *part = &parts[p];
+
+        *part = *s;
+        part->use_index = 1;
+        part->start_au  = starts[p];
+        part->end_au    = p + 1 < n_parts ? (long)starts[p + 1] : -1;
+        part->gop_part  = p;
+        part->gop_parts = n_parts;
+
+        if (p && param_sets_len) {
+            read_au(fd, &idx.au_index[starts[p]], &au);
+            if (!copy_param_sets(&idx, au, au + idx.au_index[starts[p]].size, NULL, NULL)) {
+                part->param_sets     = param_sets;
+                part->param_sets_len = param_sets_len;
+            }
+        }
+
+        if (s->out_filename) {
+            part->gop_output = s->out_filename;
+            if (-1 == asprintf(&part->out_filename, "%s.gop%u", s->out_filename, p)) {
+                fprintf(stderr, "Out of memory\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        log_info("GOP session %u: AUs %zu to %zu%s\n", p, starts[p],
+                 (p + 1 < n_parts ? starts[p + 1] : idx.au_count) - 1,
+                 part->param_sets ? ", with the stream's parameter sets" : "");
     }
+
+    if (n_parts < n)
+        log_info("Only %u IDRs to split %s at\n", n_parts, s->in_filename);
+
+    free(au);
+    close(fd);
+    close_au_index(&idx);
+    return n_parts;
 }
 
-static void handle_event(void)
+/* Replace every -G session by its GOP sessions. */
+static struct session *split_sessions(struct session *sessions, unsigned int *n_sessions)
 {
-    struct v4l2_event ev;
-
-    while (!ioctl(fd, VIDIOC_DQEVENT, &ev)) {
-        switch (ev.type) {
-        case V4L2_EVENT_SOURCE_CHANGE:
-            fprintf(stderr, "Source changed\n");
+    struct session *out = NULL;
+    unsigned int i, n = 0;
 
-            stop_capture(V4L2_BUF_TYPE_VIDEO_CAPTURE);
+    for (i = 0; i < *n_sessions; ++i) {
+        struct session *s = &sessions[i];
+        unsigned int parts = s->gop_split > 1 ? s->gop_split : 1;
 
-            if (multi_planar) {
-                unmap_buffers_mp(buffers_mp, n_buffers);
+        out = realloc(out, (n + parts) * sizeof(*out));
+        if (!out) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
 
-                fprintf(stderr, "Unmapped all buffers\n");
+        if (parts == 1)
+            out[n++] = *s;
+        else
+            n += split_gops(s, &out[n], parts);
+    }
 
-                free_buffers_mmap(V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE);
+    free(sessions);
+    *n_sessions = n;
+    return out;
+}
 
-                init_mmap_mp(V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE, &buffers_mp, &n_buffers);
+static void append_file(int out_fd, int in_fd)
+{
+    static char buf[1 << 16];
+    ssize_t n;
 
-                start_capturing_mmap_mp(V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE, buffers_mp, n_buffers);
-            } else {
-                unmap_buffers(buffers, n_buffers);
-                fprintf(stderr, "Unmapped all buffers\n");
+    /* In kernel where possible, which may share extents on filesystems that can */
+    for (;;) {
+        n = copy_file_range(in_fd, NULL, out_fd, NULL, 1 << 30, 0);
+        if (n > 0)
+            continue;
+        if (0 == n)
+            return;
+        if (EINTR == errno)
+            continue;
+        if (EXDEV != errno && ENOSYS != errno && EINVAL != errno && EOPNOTSUPP != errno)
+            errno_exit("copy_file_range");
+        break;
+    }
 
-                free_buffers_mmap(V4L2_BUF_TYPE_VIDEO_CAPTURE);
+    while ((n = read(in_fd, buf, sizeof(buf))) != 0) {
+        char *p = buf;
 
-                init_mmap(V4L2_BUF_TYPE_VIDEO_CAPTURE, &buffers, &n_buffers);
+        if (-1 == n) {
+            if (EINTR == errno)
+                continue;
+            errno_exit("read");
+        }
+        while (n > 0) {
+            ssize_t w = write(out_fd, p, n);
 
-                start_capturing_mmap(V4L2_BUF_TYPE_VIDEO_CAPTURE, buffers, n_buffers);
+            if (-1 == w) {
+                if (EINTR == errno)
+                    continue;
+                errno_exit("write");
             }
-            break;
-        case V4L2_EVENT_EOS:
-            fprintf(stderr, "EOS\n");
-            break;
+            p += w;
+            n -= w;
         }
     }
-
 }
 
-static void mainloop(void)
+/* Concatenate each split file's GOP outputs, in order, into the file asked for. */
+static void merge_gops(struct session *sessions, unsigned int n_sessions)
 {
-    unsigned int count;
-
-    count = frame_count;
+    unsigned int i, p;
+
+    for (i = 0; i < n_sessions; ++i) {
+        struct session *s = &sessions[i];
+        int out_fd;
+
+        if (!s->gop_output || s->gop_part)
+            continue;
+
+        out_fd = open(s->gop_output, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (-1 == out_fd)
+            errno_exit(s->gop_output);
+
+        for (p = 0; p < s->gop_parts; ++p) {
+            struct session *part = &sessions[i + p];
+            int in_fd = open(part->out_filename, O_RDONLY);
+
+            /* A part that produced no frames never opened its output. */
+            if (-1 == in_fd)
+                continue;
+            append_file(out_fd, in_fd);
+            close(in_fd);
+            unlink(part->out_filename);
+            free(part->out_filename);
+            part->out_filename = NULL;
+        }
 
-    while (count-- > 0) {
-        for (;;) {
-            fd_set fds[3];
-            fd_set *rd_fds = &fds[0]; /* for capture */
-            fd_set *ex_fds = &fds[1]; /* for capture */
-            fd_set *wr_fds = &fds[2]; /* for output */
-            struct timeval tv;
-            int r;
-
-            if (rd_fds) {
-                FD_ZERO(rd_fds);
-                FD_SET(fd, rd_fds);
-            }
+        close(out_fd);
+        log_info("Merged %u GOP sessions into %s\n", s->gop_parts, s->gop_output);
+    }
+}
 
-            if (ex_fds) {
-                FD_ZERO(ex_fds);
-                FD_SET(fd, ex_fds);
-            }
+/* A buffer count, or 0 for auto */
+static int parse_buffer_count(const char *arg)
+{
+    char *end;
+    long n;
 
-            if (wr_fds) {
-                FD_ZERO(wr_fds);
-                FD_SET(fd, wr_fds);
-            }
+    if (!strncmp(arg, "auto", 4) && (!arg[4] || arg[4] == ','))
+        return 0;
 
-            /* Timeout. */
-            tv.tv_sec = 10;
-            tv.tv_usec = 0;
+    errno = 0;
+    n = strtol(arg, &end, 0);
+    if (errno || end == arg || (*end && *end != ',') || n < 1 || n > VIDEO_MAX_FRAME) {
+        fprintf(stderr, "Bad buffer count %s\n", arg);
+        exit(EXIT_FAILURE);
+    }
 
-            r = select(fd + 1, rd_fds, wr_fds, ex_fds, &tv);
+    return n;
+}
 
-            if (-1 == r) {
-                if (EINTR == errno)
+/*
+ * -B: time every conversion -X does on frames of each size in sizes, with
+ * each set of kernels the CPU runs, after checking that they give the same
+ * bytes as the scalar ones. Sources have their rows padded to 64 bytes and
+ * their height to 16 rows, as decoders tend to. Prints a JSON object per run.
+ */
+static void convert_bench(const char *sizes)
+{
+    static const uint32_t from[] = { V4L2_PIX_FMT_NV12, V4L2_PIX_FMT_YUV420 };
+    static const struct {
+        uint32_t        pixelformat;
+        unsigned int    scale;
+    } to[] = {
+        { V4L2_PIX_FMT_YUV420, 1 },
+        { V4L2_PIX_FMT_NV12, 1 },
+        { V4L2_PIX_FMT_YUYV, 1 },
+        { V4L2_PIX_FMT_GREY, 1 },
+        { V4L2_PIX_FMT_GREY, 2 },
+    };
+    const char *p = sizes;
+
+    while (*p) {
+        struct v4l2_format fmt;
+        struct v4l2_rect visible;
+        unsigned int width, height, stride, coded, f, c, k;
+        unsigned char *src, *dst, *ref;
+        size_t len, i;
+        char *end;
+
+        width = strtoul(p, &end, 10);
+        height = *end == 'x' ? strtoul(end + 1, &end, 10) : 0;
+        if (!width || !height || (*end && *end != ',')) {
+            fprintf(stderr, "Bad size in %s, want WxH,...\n", sizes);
+            exit(EXIT_FAILURE);
+        }
+        p = *end ? end + 1 : end;
+
+        stride = (width + 63) & ~63;
+        coded  = (height + 15) & ~15;
+        len    = (size_t)stride * coded * 3 / 2;
+        src    = malloc(len);
+        dst    = NULL;
+        ref    = NULL;
+        if (!src) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        for (i = 0; i < len; ++i)
+            src[i] = i * 2654435761u >> 24;
+
+        CLEAR(visible);
+        visible.width  = width;
+        visible.height = height;
+
+        for (f = 0; f < sizeof(from) / sizeof(from[0]); ++f) {
+            for (c = 0; c < sizeof(to) / sizeof(to[0]); ++c) {
+                const unsigned char *planes[1] = { src };
+                struct pack_layout l;
+                size_t n;
+
+                CLEAR(fmt);
+                fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+                fmt.fmt.pix.width        = stride;
+                fmt.fmt.pix.height       = coded;
+                fmt.fmt.pix.bytesperline = stride;
+                fmt.fmt.pix.pixelformat  = from[f];
+                if (pack_layout(&l, &fmt, &visible) ||
+                    pack_set_output(&l, to[c].pixelformat, to[c].scale))
                     continue;
-                errno_exit("select");
-            }
 
-            if (0 == r) {
-                fprintf(stderr, "select timeout\n");
-                exit(EXIT_FAILURE);
-            }
-
-            if (rd_fds && FD_ISSET(fd, rd_fds)) {
-                fprintf(stderr, "Reading\n");
-                if (multi_planar) {
-                    if (read_frame_mmap_mp(V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE, buffers_mp, n_buffers))
-                        break;
-                } else {
-                    if (read_frame(V4L2_BUF_TYPE_VIDEO_CAPTURE, buffers, n_buffers))
-                        break;
+                dst = realloc(dst, l.frame_bytes);
+                ref = realloc(ref, l.frame_bytes);
+                if (!dst || !ref) {
+                    fprintf(stderr, "Out of memory\n");
+                    exit(EXIT_FAILURE);
                 }
-            }
-            if (wr_fds && FD_ISSET(fd, wr_fds)) {
-                fprintf(stderr, "Writing\n");
-                if (multi_planar) {
-                    if (read_frame_mmap_mp(V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE, buffers_mp_out, n_buffers_out))
-                        break;
-                } else {
-                    if (read_frame(V4L2_BUF_TYPE_VIDEO_OUTPUT, buffers_out, n_buffers_out))
-                        break;
+
+                pack_use_kernels("scalar");
+                n = pack_frame(&l, planes, &len, ref, 0);
+
+                for (k = 0; pack_kernel_name(k); ++k) {
+                    uint64_t start, elapsed;
+                    unsigned int frames = 0;
+
+                    pack_use_kernels(pack_kernel_name(k));
+                    if (pack_frame(&l, planes, &len, dst, 0) != n || memcmp(dst, ref, n)) {
+                        fprintf(stderr, "%s kernels disagree with scalar converting %ux%u %.4s to %.4s/%u\n",
+                                pack_kernels_in_use(), width, height, (const char *)&from[f],
+                                (const char *)&to[c].pixelformat, to[c].scale);
+                        exit(EXIT_FAILURE);
+                    }
+
+                    start = monotonic_ns();
+                    do {
+                        pack_frame(&l, planes, &len, dst, 0);
+                        frames++;
+                        elapsed = monotonic_ns() - start;
+                    } while (elapsed < 200000000 || frames < 3);
+
+                    printf("{\"size\":\"%ux%u\",\"from\":\"%.4s\",\"to\":\"%.4s\",\"scale\":%u,"
+                           "\"kernels\":\"%s\",\"frames\":%u,\"ms_per_frame\":%.4f,"
+                           "\"mpixels_per_s\":%.1f}\n",
+                           width, height, (const char *)&from[f], (const char *)&to[c].pixelformat,
+                           to[c].scale, pack_kernels_in_use(), frames, elapsed / 1e6 / frames,
+                           (double)width * height * frames / (elapsed / 1e3));
                 }
             }
-            if (ex_fds && FD_ISSET(fd, ex_fds)) {
-                fprintf(stderr, "Exception\n");
-                handle_event();
-            }
-            /* EAGAIN - continue select loop. */
         }
+
+        free(src);
+        free(dst);
+        free(ref);
     }
-}
 
-static void usage(FILE *fp, int argc, char **argv)
-{
-    fprintf(fp,
-            "Usage: %s [options]\n\n"
-            "Version 1.3\n"
-            "Options:\n"
-            "-d | --device name   Video device name [%s]\n"
-            "-h | --help          Print this message\n"
-            "-m | --mmap          Use memory mapped buffers [default]\n"
-            "-r | --read          Use read() calls\n"
-            "-u | --userp         Use application allocated buffers\n"
-            "-o | --output name   Outputs stream to filename\n"
-            "-f | --format        Force format to 640x480 YUYV\n"
-            "-c | --count         Number of frames to grab [%i]\n"
-            "-i | --infile name   Input filename for M2M devices\n"
-            "",
-            argv[0], dev_name, frame_count);
+    pack_use_kernels(NULL);
 }
 
-static const char short_options[] = "d:hmruo:fc:i:";
+static const char short_options[] = "d:hmruo:fc:i:Mxs:C:we:D:b:H:gNj:J:P:vqT:LU:t:G:K:F:p:X:B:";
 
 static const struct option
 long_options[] = {
@@ -1144,12 +5140,47 @@ long_options[] = {
     { "format", no_argument,       NULL, 'f' },
     { "count",  required_argument, NULL, 'c' },
     { "infile", required_argument, NULL, 'i' },
+    { "map-input", no_argument,    NULL, 'M' },
+    { "index",  no_argument,       NULL, 'x' },
+    { "start-au", required_argument, NULL, 's' },
+    { "codec",  required_argument, NULL, 'C' },
+    { "writer-thread", no_argument, NULL, 'w' },
+    { "export", required_argument, NULL, 'e' },
+    { "out-dmabuf", required_argument, NULL, 'D' },
+    { "buffers", required_argument, NULL, 'b' },
+    { "headroom", required_argument, NULL, 'H' },
+    { "grow",   no_argument,       NULL, 'g' },
+    { "next",   no_argument,       NULL, 'N' },
+    { "metrics", required_argument, NULL, 'j' },
+    { "metrics-interval", required_argument, NULL, 'J' },
+    { "metrics-file", required_argument, NULL, 'P' },
+    { "verbose", no_argument,      NULL, 'v' },
+    { "quiet",  no_argument,       NULL, 'q' },
+    { "trace",  required_argument, NULL, 'T' },
+    { "hugetlb", no_argument,      NULL, 'L' },
+    { "async-io", required_argument, NULL, 'U' },
+    { "threads", required_argument, NULL, 't' },
+    { "gop-split", required_argument, NULL, 'G' },
+    { "keyframes", required_argument, NULL, 'K' },
+    { "fps",    required_argument, NULL, 'F' },
+    { "pack",   required_argument, NULL, 'p' },
+    { "convert", required_argument, NULL, 'X' },
+    { "convert-bench", required_argument, NULL, 'B' },
     { 0, 0, 0, 0 }
 };
 
 int main(int argc, char **argv)
 {
-    dev_name = "/dev/video0";
+    struct session *sessions, *s;
+    unsigned int n_sessions = 1, i;
+
+    sessions = malloc(sizeof(*sessions));
+    if (!sessions) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    s = &sessions[0];
+    session_defaults(s);
 
     for (;;) {
         int idx;
@@ -1166,7 +5197,7 @@ int main(int argc, char **argv)
             break;
 
         case 'd':
-            dev_name = optarg;
+            s->dev_name = optarg;
             break;
 
         case 'h':
@@ -1174,34 +5205,308 @@ int main(int argc, char **argv)
             exit(EXIT_SUCCESS);
 
         case 'm':
-            io = IO_METHOD_MMAP;
+            s->io = IO_METHOD_MMAP;
             break;
 
         case 'r':
-            io = IO_METHOD_READ;
+            s->io = IO_METHOD_READ;
             break;
 
         case 'u':
-            io = IO_METHOD_USERPTR;
+            s->io = IO_METHOD_USERPTR;
+            break;
+
+        case 'L':
+            s->pool_hugetlb = 1;
+            break;
+
+        case 'U':
+            if (!strcmp(optarg, "uring")) {
+                s->use_uring = 1;
+            } else if (!strcmp(optarg, "thread")) {
+                s->use_uring = 2;
+            } else {
+                fprintf(stderr, "Unknown async i/o backend %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'p':
+            if (!strcmp(optarg, "copy")) {
+                s->pack = 1;
+            } else if (!strcmp(optarg, "stream")) {
+                s->pack = 2;
+            } else {
+                fprintf(stderr, "Unknown packing %s, want copy or stream\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'X':
+            s->convert_scale = 1;
+            if (!strcmp(optarg, "i420")) {
+                s->convert = V4L2_PIX_FMT_YUV420;
+            } else if (!strcmp(optarg, "nv12")) {
+                s->convert = V4L2_PIX_FMT_NV12;
+            } else if (!strcmp(optarg, "yuyv")) {
+                s->convert = V4L2_PIX_FMT_YUYV;
+            } else if (!strncmp(optarg, "grey", 4) && (!optarg[4] || optarg[4] == '/')) {
+                s->convert = V4L2_PIX_FMT_GREY;
+                if (optarg[4])
+                    s->convert_scale = strtoul(optarg + 5, NULL, 0);
+            } else {
+                s->convert = 0;
+            }
+            if (!s->convert || (s->convert_scale != 1 && s->convert_scale != 2 &&
+                                s->convert_scale != 4 && s->convert_scale != 8)) {
+                fprintf(stderr, "Unknown conversion %s, want i420, nv12, yuyv or grey[/n]\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            if (!s->pack)
+                s->pack = 1;
+            break;
+
+        case 'B':
+            convert_bench(optarg);
+            exit(EXIT_SUCCESS);
+
+        case 'G': {
+            char *end;
+
+            errno = 0;
+            s->gop_split = strtoul(optarg, &end, 0);
+            if (errno)
+                errno_exit(optarg);
+            if (*end || s->gop_split > 64) {
+                fprintf(stderr, "Bad GOP split %s, at most 64 sessions\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        }
+
+        case 'K':
+            s->use_index++;
+            if (optarg[0] == '@') {
+                char *p = optarg;
+
+                do {
+                    char *end;
+                    double t;
+
+                    errno = 0;
+                    t = strtod(p + 1, &end);
+                    if (errno || end == p + 1 || t < 0 || (*end && *end != ',')) {
+                        fprintf(stderr, "Bad keyframe times %s\n", optarg);
+                        exit(EXIT_FAILURE);
+                    }
+                    s->keyframe_times = realloc(s->keyframe_times,
+                                                (s->n_keyframe_times + 1) * sizeof(double));
+                    if (!s->keyframe_times) {
+                        fprintf(stderr, "Out of memory\n");
+                        exit(EXIT_FAILURE);
+                    }
+                    s->keyframe_times[s->n_keyframe_times++] = t;
+                    p = end;
+                } while (*p);
+            } else {
+                char *end;
+
+                errno = 0;
+                s->keyframe_every = strtoul(optarg, &end, 0);
+                if (errno || *end || !s->keyframe_every) {
+                    fprintf(stderr, "Bad keyframe interval %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+            }
+            break;
+
+        case 'F': {
+            char *end;
+
+            errno = 0;
+            s->fps = strtod(optarg, &end);
+            if (errno || *end || s->fps <= 0) {
+                fprintf(stderr, "Bad frame rate %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        }
+
+        case 't':
+            s->threaded = 1;
+            if (strcmp(optarg, "any")) {
+                char *end;
+
+                s->feeder_cpu = strtol(optarg, &end, 0);
+                if (*end == ',')
+                    s->drainer_cpu = strtol(end + 1, &end, 0);
+                if (*end || s->feeder_cpu < 0 || s->drainer_cpu < 0) {
+                    fprintf(stderr, "Bad thread cpus %s, want f,d or any\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+            }
             break;
 
         case 'o':
-            out_filename = optarg;
+            s->out_filename = optarg;
             break;
 
         case 'f':
-            force_format++;
+            s->force_format++;
             break;
 
-        case 'c':
+        case 'c': {
+            char *end;
+
             errno = 0;
-            frame_count = strtol(optarg, NULL, 0);
+            s->frame_count = strtol(optarg, &end, 0);
             if (errno)
                 errno_exit(optarg);
+            if (*end || end == optarg || s->frame_count < 0) {
+                fprintf(stderr, "Bad frame count %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
             break;
+        }
 
         case 'i':
-            in_filename = optarg;
+            s->in_filename = optarg;
+            break;
+
+        case 'M':
+            s->map_input++;
+            break;
+
+        case 'x':
+            s->use_index++;
+            break;
+
+        case 's': {
+            char *end;
+
+            errno = 0;
+            s->start_au = strtol(optarg, &end, 0);
+            if (errno)
+                errno_exit(optarg);
+            if (*end || end == optarg || s->start_au < 0) {
+                fprintf(stderr, "Bad start AU %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            s->use_index++;
+            break;
+        }
+
+        case 'C':
+            if (!strcasecmp(optarg, "h264")) {
+                s->codec = CODEC_H264;
+            } else if (!strcasecmp(optarg, "hevc") || !strcasecmp(optarg, "h265")) {
+                s->codec = CODEC_HEVC;
+            } else {
+                fprintf(stderr, "Unknown codec %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            s->codec_forced++;
+            break;
+
+        case 'w':
+            s->use_writer++;
+            break;
+
+        case 'e':
+            select_sink(s, optarg);
+            break;
+
+        case 'b':
+            s->cap_count = s->out_count = parse_buffer_count(optarg);
+            if (strchr(optarg, ','))
+                s->out_count = parse_buffer_count(strchr(optarg, ',') + 1);
+            break;
+
+        case 'H': {
+            char *end;
+
+            errno = 0;
+            s->buf_headroom = strtoul(optarg, &end, 0);
+            if (errno)
+                errno_exit(optarg);
+            if (*end || end == optarg || s->buf_headroom > VIDEO_MAX_FRAME) {
+                fprintf(stderr, "Bad buffer headroom %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        }
+
+        case 'g':
+            s->grow_buffers++;
+            break;
+
+        case 'D':
+            s->out_memory = V4L2_MEMORY_DMABUF;
+            if (!strncmp(optarg, "unix:", 5)) {
+                s->producer_path = optarg + 5;
+            } else if (!strcmp(optarg, "udmabuf")) {
+                s->producer_path = NULL;
+            } else {
+                fprintf(stderr, "Unknown dmabuf source %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'j':
+            if (!strcmp(optarg, "json")) {
+                metrics_format = METRICS_JSON;
+            } else if (!strcmp(optarg, "prom")) {
+                metrics_format = METRICS_PROM;
+            } else {
+                fprintf(stderr, "Unknown metrics format %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'J': {
+            char *end;
+
+            errno = 0;
+            metrics_interval = strtoul(optarg, &end, 0);
+            if (errno)
+                errno_exit(optarg);
+            if (*end || end == optarg) {
+                fprintf(stderr, "Bad metrics interval %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        }
+
+        case 'P':
+            metrics_path = optarg;
+            break;
+
+        case 'v':
+            if (log_level < LOG_FRAME)
+                log_level++;
+            break;
+
+        case 'q':
+            log_level = LOG_QUIET;
+            break;
+
+        case 'T':
+            if (trace_enabled()) {
+                fprintf(stderr, "Only one trace can be recorded\n");
+                exit(EXIT_FAILURE);
+            }
+            if (-1 == trace_start(optarg))
+                errno_exit(optarg);
+            break;
+
+        case 'N':
+            sessions = realloc(sessions, (n_sessions + 1) * sizeof(*sessions));
+            if (!sessions) {
+                fprintf(stderr, "Out of memory\n");
+                exit(EXIT_FAILURE);
+            }
+            sessions[n_sessions] = sessions[n_sessions - 1];
+            s = &sessions[n_sessions++];
             break;
 
         default:
@@ -1210,13 +5515,88 @@ int main(int argc, char **argv)
         }
     }
 
-    open_device();
-    init_device();
-    start_capturing();
-    mainloop();
-    stop_capturing();
-    uninit_device();
-    close_device();
-    fprintf(stderr, "\n");
+    for (i = 0; i < n_sessions; ++i) {
+        s = &sessions[i];
+
+        if (s->sink && s->io != IO_METHOD_MMAP) {
+            fprintf(stderr, "Exporting buffers needs memory mapped i/o\n");
+            exit(EXIT_FAILURE);
+        }
+
+        if (s->out_memory == V4L2_MEMORY_DMABUF && s->io != IO_METHOD_MMAP) {
+            fprintf(stderr, "Importing bitstream dmabufs needs streaming i/o (-m)\n");
+            exit(EXIT_FAILURE);
+        }
+
+        if (s->grow_buffers && s->io == IO_METHOD_READ) {
+            fprintf(stderr, "Growing the CAPTURE queue needs streaming i/o\n");
+            exit(EXIT_FAILURE);
+        }
+
+        if (s->gop_split > 1 && (!s->in_filename || s->start_au >= 0 || s->frame_count ||
+                                 s->keyframe_every || s->n_keyframe_times)) {
+            fprintf(stderr, "Splitting at GOPs needs an input file and no -s, -c or -K\n");
+            exit(EXIT_FAILURE);
+        }
+
+        if (s->threaded && (s->use_uring || s->io == IO_METHOD_READ)) {
+            fprintf(stderr, "Threaded sessions need streaming i/o without -U\n");
+            exit(EXIT_FAILURE);
+        }
+
+        if (s->use_uring && s->use_writer) {
+            fprintf(stderr, "-U already writes frames asynchronously, drop -w\n");
+            exit(EXIT_FAILURE);
+        }
+
+        if (s->pack && (s->sink || s->io == IO_METHOD_READ)) {
+            fprintf(stderr, "Packing or converting frames needs streaming i/o without -e\n");
+            exit(EXIT_FAILURE);
+        }
+
+        /* Their threads and completions interleave differently on every run. */
+        if ((trace_enabled() || !strncmp(s->dev_name, "replay:", 7)) &&
+            (s->threaded || s->use_writer || s->use_uring)) {
+            fprintf(stderr, "Traces can't be recorded or replayed with -t, -w or -U\n");
+            exit(EXIT_FAILURE);
+        }
+
+        if (s->pool_hugetlb && s->io != IO_METHOD_USERPTR) {
+            fprintf(stderr, "Hugetlb buffers need user pointer i/o (-u)\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* Sessions that would share an output file each get their own, suffixed with the session. */
+    {
+        int shared[n_sessions];
+        unsigned int j;
+
+        for (i = 0; i < n_sessions; ++i) {
+            shared[i] = 0;
+            for (j = 0; j < n_sessions && sessions[i].out_filename; ++j)
+                if (j != i && sessions[j].out_filename &&
+                    !strcmp(sessions[i].out_filename, sessions[j].out_filename))
+                    shared[i] = 1;
+        }
+        for (i = 0; i < n_sessions; ++i) {
+            s = &sessions[i];
+            if (!shared[i])
+                continue;
+            if (-1 == asprintf(&s->out_filename, "%s.%u", s->out_filename, i)) {
+                fprintf(stderr, "Out of memory\n");
+                exit(EXIT_FAILURE);
+            }
+            log_info("Session %u writes to %s\n", i, s->out_filename);
+        }
+    }
+
+    sessions = split_sessions(sessions, &n_sessions);
+
+    start_ns = monotonic_ns();
+    mainloop(sessions, n_sessions);
+    merge_gops(sessions, n_sessions);
+    report_syscalls();
+    free(sessions);
     return 0;
 }
@@ -0,0 +1,947 @@
+/*
+ *  Userspace mock of a V4L2 M2M stateful decoder
+ *
+ *  This program can be used and distributed without restrictions.
+ *
+ * Every OUTPUT buffer is one access unit that decodes into one frame,
+ * latency after it was queued and no sooner than the fps limit allows.
+ * Decoded frames wait in groups of reorder + 1 and are returned in reverse,
+ * so the first frame of a group comes out reorder frames late. Buffer
+ * contents are never touched.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include <linux/videodev2.h>
+
+#include "mockdev.h"
+
+#define CLEAR(x) memset(&(x), 0, sizeof(x))
+#define MOCK_MAX_FDS 1024
+#define MOCK_MAX_EVENTS 8
+
+enum buf_state {
+    BUF_DEQUEUED,
+    BUF_QUEUED,
+    BUF_DONE,
+};
+
+struct mock_buf {
+    enum buf_state  state;
+    uint32_t        flags;
+    uint32_t        bytesused[VIDEO_MAX_PLANES];
+    uint32_t        length[VIDEO_MAX_PLANES];
+    uint32_t        offset[VIDEO_MAX_PLANES];   /* into the memfd */
+    unsigned long   userptr[VIDEO_MAX_PLANES];
+    struct timeval  timestamp;
+    uint32_t        sequence;
+    uint64_t        queued_ns;
+};
+
+/* Buffer indices in queue order */
+struct fifo {
+    unsigned int    idx[VIDEO_MAX_FRAME];
+    unsigned int    head;
+    unsigned int    n;
+};
+
+struct mock_queue {
+    enum v4l2_memory memory;
+    unsigned int    count;
+    unsigned int    planes;
+    int             streaming;
+    uint32_t        sequence;
+    struct mock_buf bufs[VIDEO_MAX_FRAME];
+    struct fifo     queued;
+    struct fifo     done;
+};
+
+struct mock {
+    pthread_mutex_t lock;
+    int             fd;             /* memfd backing every buffer */
+    int             timer_fd;
+    int             mplane;
+    unsigned int    planes;
+    uint32_t        width, height;
+    uint32_t        base_width, base_height;
+    uint32_t        stride_align;   /* of bytesperline */
+    uint32_t        height_align;   /* of the coded height */
+    int             paint;
+    uint32_t        outsize;
+    uint32_t        out_pixfmt;
+    uint64_t        latency_ns;
+    uint64_t        interval_ns;
+    unsigned int    reorder;
+    unsigned int    min_cap;
+    unsigned int    change_every;
+    off_t           mem_size;
+    struct mock_queue out;
+    struct mock_queue cap;
+    unsigned int    group[VIDEO_MAX_FRAME];
+    unsigned int    group_n;
+    uint64_t        last_decode_ns;
+    unsigned long long decoded;
+    int             change_pending; /* until CAPTURE is restarted */
+    int             draining;
+    int             drained;        /* LAST dequeued, DQBUF now fails with EPIPE */
+    uint32_t        events[MOCK_MAX_EVENTS];
+    unsigned int    n_events;
+    uint64_t        next_deadline;
+    uint64_t        armed;          /* 0 off, 1 fire now, else absolute deadline */
+};
+
+static struct mock *mocks[MOCK_MAX_FDS];
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void fifo_push(struct fifo *f, unsigned int idx)
+{
+    f->idx[(f->head + f->n++) % VIDEO_MAX_FRAME] = idx;
+}
+
+static unsigned int fifo_pop(struct fifo *f)
+{
+    unsigned int idx = f->idx[f->head];
+
+    f->head = (f->head + 1) % VIDEO_MAX_FRAME;
+    f->n--;
+    return idx;
+}
+
+static unsigned int fifo_tail(const struct fifo *f)
+{
+    return f->idx[(f->head + f->n - 1) % VIDEO_MAX_FRAME];
+}
+
+static void parse_spec(struct mock *m, const char *spec)
+{
+    char *copy = strdup(spec ? spec : ""), *tok, *save;
+    int min = -1;
+
+    if (!copy) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        char *val = strchr(tok, '=');
+        unsigned long n;
+        char *end;
+
+        if (!val) {
+            fprintf(stderr, "Bad mock option %s\n", tok);
+            exit(EXIT_FAILURE);
+        }
+        *val++ = '\0';
+        errno = 0;
+        n = strtoul(val, &end, 0);
+        if (errno || end == val || *end || *val == '-' || n > INT_MAX) {
+            fprintf(stderr, "Bad value for mock option %s: %s\n", tok, val);
+            exit(EXIT_FAILURE);
+        }
+
+        if (!strcmp(tok, "width"))
+            m->base_width = n;
+        else if (!strcmp(tok, "height"))
+            m->base_height = n;
+        else if (!strcmp(tok, "planes"))
+            m->planes = n;
+        else if (!strcmp(tok, "mplane"))
+            m->mplane = n;
+        else if (!strcmp(tok, "outsize"))
+            m->outsize = n;
+        else if (!strcmp(tok, "latency"))
+            m->latency_ns = n * 1000ULL;
+        else if (!strcmp(tok, "fps"))
+            m->interval_ns = n ? 1000000000ULL / n : 0;
+        else if (!strcmp(tok, "reorder"))
+            m->reorder = n;
+        else if (!strcmp(tok, "min"))
+            min = n;
+        else if (!strcmp(tok, "change"))
+            m->change_every = n;
+        else if (!strcmp(tok, "stride"))
+            m->stride_align = n;
+        else if (!strcmp(tok, "align"))
+            m->height_align = n;
+        else if (!strcmp(tok, "paint"))
+            m->paint = n;
+        else {
+            fprintf(stderr, "Unknown mock option %s\n", tok);
+            exit(EXIT_FAILURE);
+        }
+    }
+    free(copy);
+
+    if (m->planes < 1 || m->planes > 2 || (m->planes == 2 && !m->mplane) ||
+        m->reorder >= VIDEO_MAX_FRAME / 2 || min > VIDEO_MAX_FRAME || !m->outsize ||
+        !m->base_width || !m->base_height || m->base_width > 16384 || m->base_height > 16384 ||
+        !m->stride_align || !m->height_align) {
+        fprintf(stderr, "Bad mock configuration %s\n", spec);
+        exit(EXIT_FAILURE);
+    }
+
+    m->min_cap = min >= 0 ? (unsigned int)min : m->reorder + 1;
+    m->width   = m->base_width;
+    m->height  = m->base_height;
+}
+
+int mock_open(const char *spec)
+{
+    struct mock *m = calloc(1, sizeof(*m));
+
+    if (!m) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    m->mplane      = 1;
+    m->planes      = 1;
+    m->base_width  = 1920;
+    m->base_height = 1080;
+    m->outsize     = 2 << 20;
+    m->out_pixfmt  = V4L2_PIX_FMT_H264;
+    m->latency_ns  = 1000000;
+    m->stride_align = 1;
+    m->height_align = 1;
+    parse_spec(m, spec);
+
+    m->fd = memfd_create("m2m-mock", MFD_CLOEXEC);
+    if (-1 == m->fd) {
+        free(m);
+        return -1;
+    }
+
+    m->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (-1 == m->timer_fd || m->fd >= MOCK_MAX_FDS) {
+        if (-1 != m->timer_fd)
+            close(m->timer_fd);
+        close(m->fd);
+        free(m);
+        errno = EMFILE;
+        return -1;
+    }
+
+    pthread_mutex_init(&m->lock, NULL);
+    mocks[m->fd] = m;
+    return m->fd;
+}
+
+void mock_close(int fd)
+{
+    struct mock *m = mocks[fd];
+
+    mocks[fd] = NULL;
+    close(m->timer_fd);
+    close(m->fd);
+    pthread_mutex_destroy(&m->lock);
+    free(m);
+}
+
+int mock_owns(int fd)
+{
+    return fd >= 0 && fd < MOCK_MAX_FDS && mocks[fd];
+}
+
+int mock_wait_fd(int fd)
+{
+    return mocks[fd]->timer_fd;
+}
+
+static struct mock_queue *queue_of(struct mock *m, uint32_t type)
+{
+    switch (type) {
+    case V4L2_BUF_TYPE_VIDEO_OUTPUT:
+        return m->mplane ? NULL : &m->out;
+    case V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE:
+        return m->mplane ? &m->out : NULL;
+    case V4L2_BUF_TYPE_VIDEO_CAPTURE:
+        return m->mplane ? NULL : &m->cap;
+    case V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE:
+        return m->mplane ? &m->cap : NULL;
+    default:
+        return NULL;
+    }
+}
+
+static uint32_t coded_height(const struct mock *m)
+{
+    return (m->height + m->height_align - 1) / m->height_align * m->height_align;
+}
+
+/* Plane sizes of the current CAPTURE format, NV12 or NV12M */
+static unsigned int cap_plane_sizes(const struct mock *m, uint32_t *sizes, uint32_t *strides)
+{
+    uint32_t stride = (m->width + m->stride_align - 1) / m->stride_align * m->stride_align;
+    uint32_t luma = stride * coded_height(m);
+
+    strides[0] = strides[1] = stride;
+    if (m->planes == 2) {
+        sizes[0] = luma;
+        sizes[1] = luma / 2;
+    } else {
+        sizes[0] = luma + luma / 2;
+    }
+    return m->planes;
+}
+
+static void fill_fmt(struct mock *m, struct v4l2_format *fmt)
+{
+    uint32_t sizes[VIDEO_MAX_PLANES], strides[VIDEO_MAX_PLANES];
+    int output = V4L2_TYPE_IS_OUTPUT(fmt->type);
+    unsigned int p, n;
+
+    if (output) {
+        n = 1;
+        sizes[0]   = m->outsize;
+        strides[0] = 0;
+    } else {
+        n = cap_plane_sizes(m, sizes, strides);
+    }
+
+    if (m->mplane) {
+        struct v4l2_pix_format_mplane *pix = &fmt->fmt.pix_mp;
+
+        memset(pix, 0, sizeof(*pix));
+        pix->width       = m->width;
+        pix->height      = output ? m->height : coded_height(m);
+        pix->pixelformat = output ? m->out_pixfmt : m->planes == 2 ? V4L2_PIX_FMT_NV12M : V4L2_PIX_FMT_NV12;
+        pix->field       = V4L2_FIELD_NONE;
+        pix->num_planes  = n;
+        for (p = 0; p < n; ++p) {
+            pix->plane_fmt[p].sizeimage    = sizes[p];
+            pix->plane_fmt[p].bytesperline = strides[p];
+        }
+    } else {
+        struct v4l2_pix_format *pix = &fmt->fmt.pix;
+
+        memset(pix, 0, sizeof(*pix));
+        pix->width        = m->width;
+        pix->height       = output ? m->height : coded_height(m);
+        pix->pixelformat  = output ? m->out_pixfmt : V4L2_PIX_FMT_NV12;
+        pix->field        = V4L2_FIELD_NONE;
+        pix->sizeimage    = sizes[0];
+        pix->bytesperline = strides[0];
+    }
+}
+
+static int set_fmt(struct mock *m, struct v4l2_format *fmt, int try)
+{
+    if (V4L2_TYPE_IS_OUTPUT(fmt->type)) {
+        uint32_t pixfmt = m->mplane ? fmt->fmt.pix_mp.pixelformat : fmt->fmt.pix.pixelformat;
+        uint32_t size = m->mplane ? fmt->fmt.pix_mp.plane_fmt[0].sizeimage : fmt->fmt.pix.sizeimage;
+
+        if (!try && (pixfmt == V4L2_PIX_FMT_H264 || pixfmt == V4L2_PIX_FMT_HEVC))
+            m->out_pixfmt = pixfmt;
+        if (!try && size)
+            m->outsize = size;
+    }
+
+    /* The CAPTURE format is whatever the stream decodes to. */
+    fill_fmt(m, fmt);
+    return 0;
+}
+
+/* Allocate buffers [first, first + n) of q from the memfd */
+static int alloc_bufs(struct mock *m, struct mock_queue *q, int output,
+                      unsigned int first, unsigned int n)
+{
+    uint32_t sizes[VIDEO_MAX_PLANES], strides[VIDEO_MAX_PLANES];
+    long page = sysconf(_SC_PAGESIZE);
+    unsigned int b, p;
+
+    if (output) {
+        q->planes = 1;
+        sizes[0]  = m->outsize;
+    } else {
+        q->planes = cap_plane_sizes(m, sizes, strides);
+    }
+
+    for (b = first; b < first + n; ++b) {
+        struct mock_buf *buf = &q->bufs[b];
+
+        memset(buf, 0, sizeof(*buf));
+        for (p = 0; p < q->planes; ++p) {
+            buf->length[p] = sizes[p];
+            if (q->memory != V4L2_MEMORY_MMAP)
+                continue;
+            buf->offset[p] = m->mem_size;
+            m->mem_size += (sizes[p] + page - 1) / page * page;
+        }
+    }
+
+    if (q->memory == V4L2_MEMORY_MMAP && -1 == ftruncate(m->fd, m->mem_size))
+        return -1;
+
+    return 0;
+}
+
+static void reset_queue(struct mock_queue *q)
+{
+    unsigned int b;
+
+    for (b = 0; b < q->count; ++b)
+        q->bufs[b].state = BUF_DEQUEUED;
+    CLEAR(q->queued);
+    CLEAR(q->done);
+}
+
+static int reqbufs(struct mock *m, struct v4l2_requestbuffers *req)
+{
+    struct mock_queue *q = queue_of(m, req->type);
+    int output = V4L2_TYPE_IS_OUTPUT(req->type);
+    unsigned int count;
+
+    if (!q)
+        return EINVAL;
+    if (q->streaming)
+        return EBUSY;
+
+    reset_queue(q);
+    q->count  = 0;
+    q->memory = req->memory;
+
+    /* Start the memfd over once nothing is allocated from it. */
+    if (!m->out.count && !m->cap.count && m->mem_size) {
+        m->mem_size = 0;
+        if (-1 == ftruncate(m->fd, 0))
+            return errno;
+    }
+
+    if (!req->count)
+        return 0;
+
+    count = req->count;
+    if (!output && count < m->min_cap)
+        count = m->min_cap;
+    if (count > VIDEO_MAX_FRAME)
+        count = VIDEO_MAX_FRAME;
+
+    if (alloc_bufs(m, q, output, 0, count))
+        return errno;
+
+    q->count   = count;
+    req->count = count;
+    return 0;
+}
+
+static int create_bufs(struct mock *m, struct v4l2_create_buffers *create)
+{
+    struct mock_queue *q = queue_of(m, create->format.type);
+    unsigned int n = create->count;
+
+    if (!q || create->memory != q->memory)
+        return EINVAL;
+
+    if (n > VIDEO_MAX_FRAME - q->count)
+        n = VIDEO_MAX_FRAME - q->count;
+    if (n && alloc_bufs(m, q, V4L2_TYPE_IS_OUTPUT(create->format.type), q->count, n))
+        return errno;
+
+    create->index = q->count;
+    create->count = n;
+    q->count += n;
+    return 0;
+}
+
+static void fill_buf(struct mock_queue *q, unsigned int index, struct v4l2_buffer *buf)
+{
+    struct mock_buf *b = &q->bufs[index];
+    unsigned int p;
+
+    buf->index     = index;
+    buf->memory    = q->memory;
+    buf->flags     = b->flags | V4L2_BUF_FLAG_TIMESTAMP_COPY;
+    buf->timestamp = b->timestamp;
+    buf->sequence  = b->sequence;
+    buf->field     = V4L2_FIELD_NONE;
+    if (b->state == BUF_QUEUED)
+        buf->flags |= V4L2_BUF_FLAG_QUEUED;
+    else if (b->state == BUF_DONE)
+        buf->flags |= V4L2_BUF_FLAG_DONE;
+    if (q->memory == V4L2_MEMORY_MMAP)
+        buf->flags |= V4L2_BUF_FLAG_MAPPED;
+
+    if (V4L2_TYPE_IS_MULTIPLANAR(buf->type)) {
+        buf->length = q->planes;
+        for (p = 0; p < q->planes; ++p) {
+            buf->m.planes[p].bytesused = b->bytesused[p];
+            buf->m.planes[p].length    = b->length[p];
+            if (q->memory == V4L2_MEMORY_MMAP)
+                buf->m.planes[p].m.mem_offset = b->offset[p];
+            else if (q->memory == V4L2_MEMORY_USERPTR)
+                buf->m.planes[p].m.userptr = b->userptr[p];
+        }
+    } else {
+        buf->bytesused = b->bytesused[0];
+        buf->length    = b->length[0];
+        if (q->memory == V4L2_MEMORY_MMAP)
+            buf->m.offset = b->offset[0];
+        else if (q->memory == V4L2_MEMORY_USERPTR)
+            buf->m.userptr = b->userptr[0];
+    }
+}
+
+static int check_buf(struct mock *m, struct v4l2_buffer *buf, struct mock_queue **qp)
+{
+    struct mock_queue *q = queue_of(m, buf->type);
+
+    if (!q || buf->memory != q->memory)
+        return EINVAL;
+    if (V4L2_TYPE_IS_MULTIPLANAR(buf->type) && (!buf->m.planes || buf->length < q->planes))
+        return EINVAL;
+
+    *qp = q;
+    return 0;
+}
+
+static int querybuf(struct mock *m, struct v4l2_buffer *buf)
+{
+    struct mock_queue *q;
+    int err = check_buf(m, buf, &q);
+
+    if (err)
+        return err;
+    if (buf->index >= q->count)
+        return EINVAL;
+
+    fill_buf(q, buf->index, buf);
+    return 0;
+}
+
+/* Every buffer lives in the one memfd, so an exported plane is a dup of it. */
+static int expbuf(struct mock *m, struct v4l2_exportbuffer *exp)
+{
+    struct mock_queue *q = queue_of(m, exp->type);
+
+    if (!q || q->memory != V4L2_MEMORY_MMAP || exp->index >= q->count || exp->plane >= q->planes)
+        return EINVAL;
+
+    exp->fd = fcntl(m->fd, exp->flags & O_CLOEXEC ? F_DUPFD_CLOEXEC : F_DUPFD, 0);
+    if (-1 == exp->fd)
+        return errno;
+    return 0;
+}
+
+static int qbuf(struct mock *m, struct v4l2_buffer *buf)
+{
+    struct mock_queue *q;
+    struct mock_buf *b;
+    int err = check_buf(m, buf, &q);
+    unsigned int p;
+
+    if (err)
+        return err;
+    if (buf->index >= q->count || q->bufs[buf->index].state != BUF_DEQUEUED)
+        return EINVAL;
+
+    b = &q->bufs[buf->index];
+    if (q->memory == V4L2_MEMORY_USERPTR) {
+        for (p = 0; p < q->planes; ++p) {
+            int mp = V4L2_TYPE_IS_MULTIPLANAR(buf->type);
+            unsigned long ptr = mp ? buf->m.planes[p].m.userptr : buf->m.userptr;
+            uint32_t length = mp ? buf->m.planes[p].length : buf->length;
+
+            if (!ptr || length < b->length[p])
+                return EINVAL;
+            b->userptr[p] = ptr;
+        }
+    }
+    b->flags = 0;
+    if (V4L2_TYPE_IS_OUTPUT(buf->type)) {
+        for (p = 0; p < q->planes; ++p)
+            b->bytesused[p] = V4L2_TYPE_IS_MULTIPLANAR(buf->type) ? buf->m.planes[p].bytesused : buf->bytesused;
+        b->timestamp = buf->timestamp;
+        b->queued_ns = now_ns();
+    }
+    b->state = BUF_QUEUED;
+    fifo_push(&q->queued, buf->index);
+
+    fill_buf(q, buf->index, buf);
+    return 0;
+}
+
+static int dqbuf(struct mock *m, struct v4l2_buffer *buf)
+{
+    struct mock_queue *q;
+    unsigned int index;
+    int err = check_buf(m, buf, &q);
+
+    if (err)
+        return err;
+
+    if (!q->done.n)
+        return q == &m->cap && m->drained ? EPIPE : EAGAIN;
+
+    index = fifo_pop(&q->done);
+    q->bufs[index].state = BUF_DEQUEUED;
+    fill_buf(q, index, buf);
+    if (q == &m->cap && (buf->flags & V4L2_BUF_FLAG_LAST))
+        m->drained = 1;
+
+    return 0;
+}
+
+static int streamon(struct mock *m, int *type, int on)
+{
+    struct mock_queue *q = queue_of(m, *type);
+
+    if (!q)
+        return EINVAL;
+
+    q->streaming = on;
+    if (!on)
+        reset_queue(q);
+
+    if (q == &m->cap) {
+        m->group_n        = 0;
+        m->drained        = 0;
+        m->change_pending = 0;
+    } else if (!on) {
+        m->draining = 0;
+    }
+
+    return 0;
+}
+
+static void queue_event(struct mock *m, uint32_t type)
+{
+    if (m->n_events < MOCK_MAX_EVENTS)
+        m->events[m->n_events++] = type;
+}
+
+static int dqevent(struct mock *m, struct v4l2_event *ev)
+{
+    if (!m->n_events)
+        return ENOENT;
+
+    CLEAR(*ev);
+    ev->type = m->events[0];
+    if (ev->type == V4L2_EVENT_SOURCE_CHANGE)
+        ev->u.src_change.changes = V4L2_EVENT_SRC_CH_RESOLUTION;
+    memmove(m->events, m->events + 1, --m->n_events * sizeof(m->events[0]));
+    ev->pending = m->n_events;
+    return 0;
+}
+
+static int decoder_cmd(struct mock *m, struct v4l2_decoder_cmd *cmd, int try)
+{
+    if (cmd->cmd != V4L2_DEC_CMD_STOP && cmd->cmd != V4L2_DEC_CMD_START)
+        return EINVAL;
+    if (try)
+        return 0;
+
+    if (cmd->cmd == V4L2_DEC_CMD_STOP) {
+        m->draining = 1;
+    } else {
+        m->draining = 0;
+        m->drained  = 0;
+    }
+    return 0;
+}
+
+/*
+ * Fill the visible pixels of a decoded frame with a pattern that moves from
+ * frame to frame, and the padding around them with 0xff, which the pattern
+ * never uses. Only MMAP and USERPTR buffers can be reached.
+ */
+static void paint(struct mock *m, struct mock_buf *b)
+{
+    uint32_t sizes[VIDEO_MAX_PLANES], strides[VIDEO_MAX_PLANES];
+    uint32_t luma_size, x, y;
+    unsigned int p, n = cap_plane_sizes(m, sizes, strides);
+    unsigned char *img;
+
+    if (m->cap.memory != V4L2_MEMORY_MMAP && m->cap.memory != V4L2_MEMORY_USERPTR)
+        return;
+
+    luma_size = strides[0] * coded_height(m);
+    for (p = 0; p < n; ++p) {
+        img = malloc(b->length[p]);
+        if (!img) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        memset(img, 0xff, b->length[p]);
+
+        if (p == 0) {
+            for (y = 0; y < m->height; ++y)
+                for (x = 0; x < m->width; ++x)
+                    img[y * strides[0] + x] = (x + 3 * y + m->decoded) & 0x7f;
+        }
+        /* Interleaved chroma at half height, after the luma or in a plane of its own */
+        if (p == n - 1) {
+            uint32_t base = n == 1 ? luma_size : 0;
+
+            for (y = 0; y < (m->height + 1) / 2; ++y)
+                for (x = 0; x < m->width; ++x)
+                    img[base + y * strides[p] + x] = (x + y + 2 * m->decoded) & 0x7f;
+        }
+
+        if (m->cap.memory == V4L2_MEMORY_USERPTR)
+            memcpy((void *)b->userptr[p], img, b->length[p]);
+        else if (pwrite(m->fd, img, b->length[p], b->offset[p]) < 0)
+            perror("mock paint");
+        free(img);
+    }
+}
+
+/* Return the reorder group to the application, newest frame first. */
+static void emit_group(struct mock *m)
+{
+    while (m->group_n) {
+        unsigned int c = m->group[--m->group_n];
+
+        m->cap.bufs[c].state    = BUF_DONE;
+        m->cap.bufs[c].sequence = m->cap.sequence++;
+        fifo_push(&m->cap.done, c);
+    }
+}
+
+/* Decode everything that is due by now and has somewhere to go. */
+static void process(struct mock *m, uint64_t now)
+{
+    m->next_deadline = 0;
+
+    while (m->out.streaming && m->cap.streaming && !m->change_pending && m->out.queued.n) {
+        struct mock_buf *ob = &m->out.bufs[m->out.queued.idx[m->out.queued.head]];
+        struct mock_buf *cb;
+        uint64_t due = ob->queued_ns + m->latency_ns;
+        unsigned int c, p;
+
+        if (m->interval_ns && m->last_decode_ns + m->interval_ns > due)
+            due = m->last_decode_ns + m->interval_ns;
+        if (due > now) {
+            m->next_deadline = due;
+            break;
+        }
+        if (!m->cap.queued.n)
+            break;
+
+        ob->state = BUF_DONE;
+        fifo_push(&m->out.done, fifo_pop(&m->out.queued));
+
+        c  = fifo_pop(&m->cap.queued);
+        cb = &m->cap.bufs[c];
+        for (p = 0; p < m->cap.planes; ++p)
+            cb->bytesused[p] = cb->length[p];
+        if (m->paint)
+            paint(m, cb);
+        cb->timestamp = ob->timestamp;
+        m->group[m->group_n++] = c;
+
+        m->last_decode_ns = due;
+        m->decoded++;
+
+        if (m->group_n > m->reorder)
+            emit_group(m);
+
+        if (m->change_every && m->decoded % m->change_every == 0) {
+            emit_group(m);
+            if (m->width == m->base_width) {
+                m->width  = (m->base_width / 2 + 15) & ~15;
+                m->height = (m->base_height / 2 + 15) & ~15;
+            } else {
+                m->width  = m->base_width;
+                m->height = m->base_height;
+            }
+            m->change_pending = 1;
+            queue_event(m, V4L2_EVENT_SOURCE_CHANGE);
+        }
+    }
+
+    if (m->draining && !m->out.queued.n && m->cap.streaming && !m->change_pending) {
+        emit_group(m);
+        if (m->cap.done.n) {
+            m->cap.bufs[fifo_tail(&m->cap.done)].flags |= V4L2_BUF_FLAG_LAST;
+        } else if (m->cap.queued.n) {
+            unsigned int c = fifo_pop(&m->cap.queued);
+
+            memset(m->cap.bufs[c].bytesused, 0, sizeof(m->cap.bufs[c].bytesused));
+            m->cap.bufs[c].flags = V4L2_BUF_FLAG_LAST;
+            m->cap.bufs[c].state = BUF_DONE;
+            fifo_push(&m->cap.done, c);
+        } else {
+            return;     /* wait for a CAPTURE buffer to flag */
+        }
+        m->draining = 0;
+        queue_event(m, V4L2_EVENT_EOS);
+    }
+}
+
+static uint32_t ready_mask(const struct mock *m)
+{
+    uint32_t mask = 0;
+
+    if (m->cap.done.n)
+        mask |= EPOLLIN;
+    if (m->out.done.n)
+        mask |= EPOLLOUT;
+    if (m->n_events)
+        mask |= EPOLLPRI;
+
+    return mask;
+}
+
+/*
+ * Keep timer_fd readable while anything is ready, like a level triggered
+ * device fd, and otherwise have it fire when the next frame is due.
+ */
+static void update(struct mock *m)
+{
+    struct itimerspec its;
+    uint64_t want;
+    int flags = 0;
+
+    process(m, now_ns());
+    want = ready_mask(m) ? 1 : m->next_deadline;
+    if (want == m->armed)
+        return;
+
+    CLEAR(its);
+    if (want == 1) {
+        its.it_value.tv_nsec = 1;
+    } else if (want) {
+        its.it_value.tv_sec  = want / 1000000000ULL;
+        its.it_value.tv_nsec = want % 1000000000ULL;
+        flags = TFD_TIMER_ABSTIME;
+    }
+    timerfd_settime(m->timer_fd, flags, &its, NULL);
+    m->armed = want;
+}
+
+uint32_t mock_poll(int fd)
+{
+    struct mock *m = mocks[fd];
+    uint64_t expirations;
+    uint32_t mask;
+
+    pthread_mutex_lock(&m->lock);
+    if (read(m->timer_fd, &expirations, sizeof(expirations)) > 0)
+        m->armed = 0;
+    update(m);
+    mask = ready_mask(m);
+    pthread_mutex_unlock(&m->lock);
+
+    return mask;
+}
+
+static int dispatch(struct mock *m, unsigned long request, void *arg)
+{
+    switch (request) {
+    case VIDIOC_QUERYCAP: {
+        struct v4l2_capability *cap = arg;
+
+        CLEAR(*cap);
+        strcpy((char *)cap->driver, "mock");
+        strcpy((char *)cap->card, "m2m mock decoder");
+        strcpy((char *)cap->bus_info, "platform:mock");
+        cap->device_caps  = (m->mplane ? V4L2_CAP_VIDEO_M2M_MPLANE : V4L2_CAP_VIDEO_M2M) | V4L2_CAP_STREAMING;
+        cap->capabilities = cap->device_caps | V4L2_CAP_DEVICE_CAPS;
+        return 0;
+    }
+
+    case VIDIOC_G_FMT:
+        if (!queue_of(m, ((struct v4l2_format *)arg)->type))
+            return EINVAL;
+        fill_fmt(m, arg);
+        return 0;
+
+    case VIDIOC_S_FMT:
+    case VIDIOC_TRY_FMT:
+        if (!queue_of(m, ((struct v4l2_format *)arg)->type))
+            return EINVAL;
+        return set_fmt(m, arg, request == VIDIOC_TRY_FMT);
+
+    case VIDIOC_G_CTRL: {
+        struct v4l2_control *ctrl = arg;
+
+        if (ctrl->id == V4L2_CID_MIN_BUFFERS_FOR_CAPTURE)
+            ctrl->value = m->min_cap;
+        else if (ctrl->id == V4L2_CID_MIN_BUFFERS_FOR_OUTPUT)
+            ctrl->value = 1;
+        else
+            return EINVAL;
+        return 0;
+    }
+
+    case VIDIOC_G_SELECTION: {
+        struct v4l2_selection *sel = arg;
+
+        /* Multi-planar devices take either type here. */
+        if ((sel->type != V4L2_BUF_TYPE_VIDEO_CAPTURE && !queue_of(m, sel->type)) ||
+            V4L2_TYPE_IS_OUTPUT(sel->type) ||
+            (sel->target != V4L2_SEL_TGT_COMPOSE && sel->target != V4L2_SEL_TGT_COMPOSE_DEFAULT))
+            return EINVAL;
+        CLEAR(sel->r);
+        sel->r.width  = m->width;
+        sel->r.height = m->height;
+        return 0;
+    }
+
+    case VIDIOC_REQBUFS:
+        return reqbufs(m, arg);
+    case VIDIOC_CREATE_BUFS:
+        return create_bufs(m, arg);
+    case VIDIOC_QUERYBUF:
+        return querybuf(m, arg);
+    case VIDIOC_EXPBUF:
+        return expbuf(m, arg);
+    case VIDIOC_QBUF:
+        return qbuf(m, arg);
+    case VIDIOC_DQBUF:
+        return dqbuf(m, arg);
+    case VIDIOC_STREAMON:
+        return streamon(m, arg, 1);
+    case VIDIOC_STREAMOFF:
+        return streamon(m, arg, 0);
+    case VIDIOC_SUBSCRIBE_EVENT:
+    case VIDIOC_UNSUBSCRIBE_EVENT:
+        return 0;
+    case VIDIOC_DQEVENT:
+        return dqevent(m, arg);
+    case VIDIOC_DECODER_CMD:
+    case VIDIOC_TRY_DECODER_CMD:
+        return decoder_cmd(m, arg, request == VIDIOC_TRY_DECODER_CMD);
+    default:
+        return ENOTTY;
+    }
+}
+
+int mock_ioctl(int fd, unsigned long request, void *arg)
+{
+    struct mock *m = mocks[fd];
+    int err;
+
+    pthread_mutex_lock(&m->lock);
+    err = dispatch(m, request, arg);
+    update(m);
+    pthread_mutex_unlock(&m->lock);
+
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,43 @@
+/*
+ *  Userspace mock of a V4L2 M2M stateful decoder
+ *
+ *  This program can be used and distributed without restrictions.
+ *
+ * Lets m2m be run and timed without a codec. The device fd is a memfd
+ * holding the buffers, so mmap() and munmap() work on it unchanged; ioctls
+ * on it are routed to mock_ioctl() by xioctl(). It isn't pollable, so the
+ * main loop waits on mock_wait_fd() and asks mock_poll() what is ready.
+ * VIDIOC_EXPBUF hands out a dup of the memfd, so the plane of an exported
+ * buffer is at its QUERYBUF offset rather than at 0. Bad values in the spec
+ * are fatal.
+ */
+
+#ifndef MOCKDEV_H
+#define MOCKDEV_H
+
+#include <stdint.h>
+
+/*
+ * spec is a comma separated list of key=value, all optional:
+ *   width, height   CAPTURE size [1920x1080]
+ *   planes          CAPTURE planes, 1 (NV12) or 2 (NV12M) [1]
+ *   mplane          use the multi-planar API [1]
+ *   outsize         OUTPUT buffer size in bytes [2 MiB]
+ *   latency         microseconds from OUTPUT QBUF to decoded frame [1000]
+ *   fps             decoder throughput cap, 0 for none [0]
+ *   reorder         frames held back for display reordering [0]
+ *   min             minimum CAPTURE buffers [reorder + 1]
+ *   change          source change every n frames, 0 for none [0]
+ *   stride          align bytesperline to this many bytes [1]
+ *   align           align the coded height to this many rows; the visible
+ *                   size is reported by VIDIOC_G_SELECTION [1]
+ *   paint           fill decoded frames with a test pattern, 0xff padding [0]
+ */
+int mock_open(const char *spec);
+void mock_close(int fd);
+int mock_owns(int fd);
+int mock_ioctl(int fd, unsigned long request, void *arg);
+int mock_wait_fd(int fd);
+uint32_t mock_poll(int fd);
+
+#endif
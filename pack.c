@@ -0,0 +1,743 @@
+/*
+ *  Packing of decoded frames into their visible pixels
+ *
+ *  This program can be used and distributed without restrictions.
+ *
+ * Each pixel format is described by its components: which buffer plane a
+ * component lives in, how it is subsampled and how many bytes a sample takes.
+ * Where several components share a plane they follow each other at the coded
+ * height, with strides in proportion to their row widths, which is how V4L2
+ * defines NV12, YUV420 and the like.
+ *
+ * Rows are copied with explicit vector loads rather than memcpy(), which may
+ * pick string instructions that crawl on the uncached memory some drivers
+ * map CAPTURE buffers with.
+ *
+ * Conversions are built from four row kernels: interleaving Cb and Cr rows
+ * into CbCr, splitting them again, merging luma and CbCr into YUYV and
+ * halving two luma rows into one. The vector versions do whole blocks and
+ * leave the tail to the scalar ones, which are the reference: averages are
+ * rounded halving ones taken vertically first, as pavgb and vrhadd give.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <linux/videodev2.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/* AVX2 kernels are built whatever -m flags say and only run where the CPU has it. */
+#if defined(__SSE2__) && (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define PACK_AVX2
+#include <immintrin.h>
+#endif
+
+#include "pack.h"
+
+struct pix_desc {
+    uint32_t        pixelformat;
+    unsigned char   n_comp;
+    unsigned char   n_planes;
+    struct {
+        unsigned char plane, hsub, vsub, bpp;
+    } comp[3];
+};
+
+static const struct pix_desc pix_descs[] = {
+    { V4L2_PIX_FMT_NV12,    2, 1, { { 0, 1, 1, 1 }, { 0, 2, 2, 2 } } },
+    { V4L2_PIX_FMT_NV21,    2, 1, { { 0, 1, 1, 1 }, { 0, 2, 2, 2 } } },
+    { V4L2_PIX_FMT_NV12M,   2, 2, { { 0, 1, 1, 1 }, { 1, 2, 2, 2 } } },
+    { V4L2_PIX_FMT_NV21M,   2, 2, { { 0, 1, 1, 1 }, { 1, 2, 2, 2 } } },
+    { V4L2_PIX_FMT_NV16,    2, 1, { { 0, 1, 1, 1 }, { 0, 2, 1, 2 } } },
+    { V4L2_PIX_FMT_NV16M,   2, 2, { { 0, 1, 1, 1 }, { 1, 2, 1, 2 } } },
+    { V4L2_PIX_FMT_P010,    2, 1, { { 0, 1, 1, 2 }, { 0, 2, 2, 4 } } },
+    { V4L2_PIX_FMT_YUV420,  3, 1, { { 0, 1, 1, 1 }, { 0, 2, 2, 1 }, { 0, 2, 2, 1 } } },
+    { V4L2_PIX_FMT_YVU420,  3, 1, { { 0, 1, 1, 1 }, { 0, 2, 2, 1 }, { 0, 2, 2, 1 } } },
+    { V4L2_PIX_FMT_YUV420M, 3, 3, { { 0, 1, 1, 1 }, { 1, 2, 2, 1 }, { 2, 2, 2, 1 } } },
+    { V4L2_PIX_FMT_YVU420M, 3, 3, { { 0, 1, 1, 1 }, { 1, 2, 2, 1 }, { 2, 2, 2, 1 } } },
+    { V4L2_PIX_FMT_YUV422P, 3, 1, { { 0, 1, 1, 1 }, { 0, 2, 1, 1 }, { 0, 2, 1, 1 } } },
+    /* Packed 4:2:2 in macropixels of two pixels */
+    { V4L2_PIX_FMT_YUYV,    1, 1, { { 0, 2, 1, 4 } } },
+    { V4L2_PIX_FMT_YVYU,    1, 1, { { 0, 2, 1, 4 } } },
+    { V4L2_PIX_FMT_UYVY,    1, 1, { { 0, 2, 1, 4 } } },
+    { V4L2_PIX_FMT_VYUY,    1, 1, { { 0, 2, 1, 4 } } },
+    { V4L2_PIX_FMT_GREY,    1, 1, { { 0, 1, 1, 1 } } },
+};
+
+static const struct pix_desc *find_desc(uint32_t pixelformat)
+{
+    unsigned int i;
+
+    for (i = 0; i < sizeof(pix_descs) / sizeof(pix_descs[0]); ++i)
+        if (pix_descs[i].pixelformat == pixelformat)
+            return &pix_descs[i];
+    return NULL;
+}
+
+unsigned int pack_bpp(uint32_t pixelformat)
+{
+    const struct pix_desc *d = find_desc(pixelformat);
+
+    return d ? d->comp[0].bpp / d->comp[0].hsub : 0;
+}
+
+int pack_layout(struct pack_layout *l, const struct v4l2_format *fmt,
+                const struct v4l2_rect *visible)
+{
+    const struct pix_desc *d;
+    uint32_t width, height, bpl[VIDEO_MAX_PLANES];
+    size_t plane_end[VIDEO_MAX_PLANES];
+    int first[VIDEO_MAX_PLANES];
+    unsigned int n_planes, c, p, hsub = 1, vsub = 1, left, top;
+
+    memset(l, 0, sizeof(*l));
+    if (V4L2_TYPE_IS_MULTIPLANAR(fmt->type)) {
+        l->pixelformat = fmt->fmt.pix_mp.pixelformat;
+        width    = fmt->fmt.pix_mp.width;
+        height   = fmt->fmt.pix_mp.height;
+        n_planes = fmt->fmt.pix_mp.num_planes;
+        for (p = 0; p < n_planes && p < VIDEO_MAX_PLANES; ++p)
+            bpl[p] = fmt->fmt.pix_mp.plane_fmt[p].bytesperline;
+    } else {
+        l->pixelformat = fmt->fmt.pix.pixelformat;
+        width    = fmt->fmt.pix.width;
+        height   = fmt->fmt.pix.height;
+        n_planes = 1;
+        bpl[0]   = fmt->fmt.pix.bytesperline;
+    }
+
+    d = find_desc(l->pixelformat);
+    if (!d || d->n_planes != n_planes || !width || !height)
+        return -1;
+
+    for (c = 0; c < d->n_comp; ++c) {
+        if (d->comp[c].hsub > hsub)
+            hsub = d->comp[c].hsub;
+        if (d->comp[c].vsub > vsub)
+            vsub = d->comp[c].vsub;
+    }
+
+    /* Start on a whole chroma sample, keeping the right and bottom edges. */
+    if (visible && visible->width && visible->height && visible->left >= 0 && visible->top >= 0 &&
+        visible->left + visible->width <= width && visible->top + visible->height <= height) {
+        left = visible->left / hsub * hsub;
+        top  = visible->top / vsub * vsub;
+        l->width  = visible->left + visible->width - left;
+        l->height = visible->top + visible->height - top;
+    } else {
+        left = top = 0;
+        l->width  = width;
+        l->height = height;
+    }
+
+    l->out_pixelformat = l->pixelformat;
+    l->scale    = 1;
+    l->n_comp   = d->n_comp;
+    l->n_planes = n_planes;
+    memset(plane_end, 0, sizeof(plane_end));
+    memset(first, -1, sizeof(first));
+    for (c = 0; c < d->n_comp; ++c) {
+        struct pack_comp *pc = &l->comp[c];
+        unsigned int cs = d->comp[c].hsub, vs = d->comp[c].vsub, bpp = d->comp[c].bpp;
+        size_t row = (size_t)(width + cs - 1) / cs * bpp;
+
+        /* bytesperline is that of the first component in the plane. */
+        p = d->comp[c].plane;
+        if (first[p] < 0) {
+            first[p]   = c;
+            pc->stride = bpl[p] ? bpl[p] : row;
+        } else {
+            pc->stride = l->comp[first[p]].stride * bpp * d->comp[first[p]].hsub /
+                         (cs * d->comp[first[p]].bpp);
+        }
+        if (pc->stride < row)
+            return -1;
+
+        pc->plane     = p;
+        pc->offset    = plane_end[p] + top / vs * pc->stride + left / cs * bpp;
+        pc->row_bytes = (size_t)(l->width + cs - 1) / cs * bpp;
+        pc->rows      = (l->height + vs - 1) / vs;
+        plane_end[p] += pc->stride * ((height + vs - 1) / vs);
+
+        l->plane_bytes[p] = pc->offset + (pc->rows - 1) * pc->stride + pc->row_bytes;
+        l->frame_bytes   += pc->row_bytes * pc->rows;
+    }
+
+    return 0;
+}
+
+/* Copy a row using non-temporal stores where the CPU has them */
+static void copy_row_nt(unsigned char *d, const unsigned char *s, size_t n)
+{
+#if defined(__SSE2__)
+    for (; n && ((uintptr_t)d & 15); --n)
+        *d++ = *s++;
+    for (; n >= 64; n -= 64, s += 64, d += 64) {
+        __m128i a = _mm_loadu_si128((const __m128i *)s);
+        __m128i b = _mm_loadu_si128((const __m128i *)(s + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(s + 32));
+        __m128i e = _mm_loadu_si128((const __m128i *)(s + 48));
+
+        _mm_stream_si128((__m128i *)d, a);
+        _mm_stream_si128((__m128i *)(d + 16), b);
+        _mm_stream_si128((__m128i *)(d + 32), c);
+        _mm_stream_si128((__m128i *)(d + 48), e);
+    }
+    for (; n >= 16; n -= 16, s += 16, d += 16)
+        _mm_stream_si128((__m128i *)d, _mm_loadu_si128((const __m128i *)s));
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    for (; n >= 32; n -= 32, s += 32, d += 32) {
+        uint8x16_t a = vld1q_u8(s);
+        uint8x16_t b = vld1q_u8(s + 16);
+
+        __asm__ volatile("stnp %q0, %q1, [%2]" : : "w" (a), "w" (b), "r" (d) : "memory");
+    }
+#endif
+    memcpy(d, s, n);
+}
+
+static void copy_row(unsigned char *d, const unsigned char *s, size_t n)
+{
+#if defined(__SSE2__)
+    for (; n >= 64; n -= 64, s += 64, d += 64) {
+        __m128i a = _mm_loadu_si128((const __m128i *)s);
+        __m128i b = _mm_loadu_si128((const __m128i *)(s + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(s + 32));
+        __m128i e = _mm_loadu_si128((const __m128i *)(s + 48));
+
+        _mm_storeu_si128((__m128i *)d, a);
+        _mm_storeu_si128((__m128i *)(d + 16), b);
+        _mm_storeu_si128((__m128i *)(d + 32), c);
+        _mm_storeu_si128((__m128i *)(d + 48), e);
+    }
+    for (; n >= 16; n -= 16, s += 16, d += 16)
+        _mm_storeu_si128((__m128i *)d, _mm_loadu_si128((const __m128i *)s));
+#elif defined(__ARM_NEON)
+    for (; n >= 64; n -= 64, s += 64, d += 64) {
+        uint8x16_t a = vld1q_u8(s);
+        uint8x16_t b = vld1q_u8(s + 16);
+        uint8x16_t c = vld1q_u8(s + 32);
+        uint8x16_t e = vld1q_u8(s + 48);
+
+        vst1q_u8(d, a);
+        vst1q_u8(d + 16, b);
+        vst1q_u8(d + 32, c);
+        vst1q_u8(d + 48, e);
+    }
+    for (; n >= 16; n -= 16, s += 16, d += 16)
+        vst1q_u8(d, vld1q_u8(s));
+#endif
+    memcpy(d, s, n);
+}
+
+struct pack_kernels {
+    const char *name;
+    int (*usable)(void);
+    void (*interleave)(unsigned char *uv, const unsigned char *u, const unsigned char *v, size_t n);
+    void (*deinterleave)(unsigned char *u, unsigned char *v, const unsigned char *uv, size_t n);
+    void (*yuyv)(unsigned char *d, const unsigned char *y, const unsigned char *uv, size_t pairs);
+    void (*halve)(unsigned char *d, const unsigned char *r0, const unsigned char *r1, size_t n);
+};
+
+static void interleave_c(unsigned char *uv, const unsigned char *u, const unsigned char *v, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; ++i) {
+        uv[2 * i]     = u[i];
+        uv[2 * i + 1] = v[i];
+    }
+}
+
+static void deinterleave_c(unsigned char *u, unsigned char *v, const unsigned char *uv, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; ++i) {
+        u[i] = uv[2 * i];
+        v[i] = uv[2 * i + 1];
+    }
+}
+
+static void yuyv_c(unsigned char *d, const unsigned char *y, const unsigned char *uv, size_t pairs)
+{
+    size_t i;
+
+    for (i = 0; i < pairs; ++i) {
+        d[4 * i]     = y[2 * i];
+        d[4 * i + 1] = uv[2 * i];
+        d[4 * i + 2] = y[2 * i + 1];
+        d[4 * i + 3] = uv[2 * i + 1];
+    }
+}
+
+static void halve_c(unsigned char *d, const unsigned char *r0, const unsigned char *r1, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; ++i) {
+        unsigned int a = (r0[2 * i] + r1[2 * i] + 1) >> 1;
+        unsigned int b = (r0[2 * i + 1] + r1[2 * i + 1] + 1) >> 1;
+
+        d[i] = (a + b + 1) >> 1;
+    }
+}
+
+static int always(void)
+{
+    return 1;
+}
+
+#if defined(__SSE2__)
+static void interleave_sse2(unsigned char *uv, const unsigned char *u, const unsigned char *v, size_t n)
+{
+    for (; n >= 16; n -= 16, u += 16, v += 16, uv += 32) {
+        __m128i a = _mm_loadu_si128((const __m128i *)u);
+        __m128i b = _mm_loadu_si128((const __m128i *)v);
+
+        _mm_storeu_si128((__m128i *)uv, _mm_unpacklo_epi8(a, b));
+        _mm_storeu_si128((__m128i *)(uv + 16), _mm_unpackhi_epi8(a, b));
+    }
+    interleave_c(uv, u, v, n);
+}
+
+static void deinterleave_sse2(unsigned char *u, unsigned char *v, const unsigned char *uv, size_t n)
+{
+    const __m128i lo = _mm_set1_epi16(0x00ff);
+
+    for (; n >= 16; n -= 16, u += 16, v += 16, uv += 32) {
+        __m128i a = _mm_loadu_si128((const __m128i *)uv);
+        __m128i b = _mm_loadu_si128((const __m128i *)(uv + 16));
+
+        _mm_storeu_si128((__m128i *)u, _mm_packus_epi16(_mm_and_si128(a, lo), _mm_and_si128(b, lo)));
+        _mm_storeu_si128((__m128i *)v, _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8)));
+    }
+    deinterleave_c(u, v, uv, n);
+}
+
+static void yuyv_sse2(unsigned char *d, const unsigned char *y, const unsigned char *uv, size_t pairs)
+{
+    for (; pairs >= 8; pairs -= 8, y += 16, uv += 16, d += 32) {
+        __m128i a = _mm_loadu_si128((const __m128i *)y);
+        __m128i b = _mm_loadu_si128((const __m128i *)uv);
+
+        _mm_storeu_si128((__m128i *)d, _mm_unpacklo_epi8(a, b));
+        _mm_storeu_si128((__m128i *)(d + 16), _mm_unpackhi_epi8(a, b));
+    }
+    yuyv_c(d, y, uv, pairs);
+}
+
+static void halve_sse2(unsigned char *d, const unsigned char *r0, const unsigned char *r1, size_t n)
+{
+    const __m128i lo = _mm_set1_epi16(0x00ff);
+
+    for (; n >= 16; n -= 16, r0 += 32, r1 += 32, d += 16) {
+        __m128i a = _mm_avg_epu8(_mm_loadu_si128((const __m128i *)r0),
+                                 _mm_loadu_si128((const __m128i *)r1));
+        __m128i b = _mm_avg_epu8(_mm_loadu_si128((const __m128i *)(r0 + 16)),
+                                 _mm_loadu_si128((const __m128i *)(r1 + 16)));
+
+        a = _mm_avg_epu16(_mm_and_si128(a, lo), _mm_srli_epi16(a, 8));
+        b = _mm_avg_epu16(_mm_and_si128(b, lo), _mm_srli_epi16(b, 8));
+        _mm_storeu_si128((__m128i *)d, _mm_packus_epi16(a, b));
+    }
+    halve_c(d, r0, r1, n);
+}
+#endif
+
+#if defined(PACK_AVX2)
+/*
+ * AVX2 unpacks and packs work within each 128 bit lane, so their results
+ * are put back in order with a permute.
+ */
+static int avx2_usable(void)
+{
+    return __builtin_cpu_supports("avx2");
+}
+
+__attribute__((target("avx2")))
+static void interleave_avx2(unsigned char *uv, const unsigned char *u, const unsigned char *v, size_t n)
+{
+    for (; n >= 32; n -= 32, u += 32, v += 32, uv += 64) {
+        __m256i a  = _mm256_loadu_si256((const __m256i *)u);
+        __m256i b  = _mm256_loadu_si256((const __m256i *)v);
+        __m256i lo = _mm256_unpacklo_epi8(a, b);
+        __m256i hi = _mm256_unpackhi_epi8(a, b);
+
+        _mm256_storeu_si256((__m256i *)uv, _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256((__m256i *)(uv + 32), _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+    interleave_sse2(uv, u, v, n);
+}
+
+__attribute__((target("avx2")))
+static void deinterleave_avx2(unsigned char *u, unsigned char *v, const unsigned char *uv, size_t n)
+{
+    const __m256i lo = _mm256_set1_epi16(0x00ff);
+
+    for (; n >= 32; n -= 32, u += 32, v += 32, uv += 64) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)uv);
+        __m256i b = _mm256_loadu_si256((const __m256i *)(uv + 32));
+        __m256i even = _mm256_packus_epi16(_mm256_and_si256(a, lo), _mm256_and_si256(b, lo));
+        __m256i odd  = _mm256_packus_epi16(_mm256_srli_epi16(a, 8), _mm256_srli_epi16(b, 8));
+
+        _mm256_storeu_si256((__m256i *)u, _mm256_permute4x64_epi64(even, 0xd8));
+        _mm256_storeu_si256((__m256i *)v, _mm256_permute4x64_epi64(odd, 0xd8));
+    }
+    deinterleave_sse2(u, v, uv, n);
+}
+
+__attribute__((target("avx2")))
+static void yuyv_avx2(unsigned char *d, const unsigned char *y, const unsigned char *uv, size_t pairs)
+{
+    for (; pairs >= 16; pairs -= 16, y += 32, uv += 32, d += 64) {
+        __m256i a  = _mm256_loadu_si256((const __m256i *)y);
+        __m256i b  = _mm256_loadu_si256((const __m256i *)uv);
+        __m256i lo = _mm256_unpacklo_epi8(a, b);
+        __m256i hi = _mm256_unpackhi_epi8(a, b);
+
+        _mm256_storeu_si256((__m256i *)d, _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256((__m256i *)(d + 32), _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+    yuyv_sse2(d, y, uv, pairs);
+}
+
+__attribute__((target("avx2")))
+static void halve_avx2(unsigned char *d, const unsigned char *r0, const unsigned char *r1, size_t n)
+{
+    const __m256i lo = _mm256_set1_epi16(0x00ff);
+
+    for (; n >= 32; n -= 32, r0 += 64, r1 += 64, d += 32) {
+        __m256i a = _mm256_avg_epu8(_mm256_loadu_si256((const __m256i *)r0),
+                                    _mm256_loadu_si256((const __m256i *)r1));
+        __m256i b = _mm256_avg_epu8(_mm256_loadu_si256((const __m256i *)(r0 + 32)),
+                                    _mm256_loadu_si256((const __m256i *)(r1 + 32)));
+
+        a = _mm256_avg_epu16(_mm256_and_si256(a, lo), _mm256_srli_epi16(a, 8));
+        b = _mm256_avg_epu16(_mm256_and_si256(b, lo), _mm256_srli_epi16(b, 8));
+        _mm256_storeu_si256((__m256i *)d, _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xd8));
+    }
+    halve_sse2(d, r0, r1, n);
+}
+#endif
+
+#if defined(__ARM_NEON)
+static void interleave_neon(unsigned char *uv, const unsigned char *u, const unsigned char *v, size_t n)
+{
+    for (; n >= 16; n -= 16, u += 16, v += 16, uv += 32) {
+        uint8x16x2_t x;
+
+        x.val[0] = vld1q_u8(u);
+        x.val[1] = vld1q_u8(v);
+        vst2q_u8(uv, x);
+    }
+    interleave_c(uv, u, v, n);
+}
+
+static void deinterleave_neon(unsigned char *u, unsigned char *v, const unsigned char *uv, size_t n)
+{
+    for (; n >= 16; n -= 16, u += 16, v += 16, uv += 32) {
+        uint8x16x2_t x = vld2q_u8(uv);
+
+        vst1q_u8(u, x.val[0]);
+        vst1q_u8(v, x.val[1]);
+    }
+    deinterleave_c(u, v, uv, n);
+}
+
+static void yuyv_neon(unsigned char *d, const unsigned char *y, const unsigned char *uv, size_t pairs)
+{
+    for (; pairs >= 16; pairs -= 16, y += 32, uv += 32, d += 64) {
+        uint8x16x2_t a = vld2q_u8(y);
+        uint8x16x2_t b = vld2q_u8(uv);
+        uint8x16x4_t x;
+
+        x.val[0] = a.val[0];
+        x.val[1] = b.val[0];
+        x.val[2] = a.val[1];
+        x.val[3] = b.val[1];
+        vst4q_u8(d, x);
+    }
+    yuyv_c(d, y, uv, pairs);
+}
+
+static void halve_neon(unsigned char *d, const unsigned char *r0, const unsigned char *r1, size_t n)
+{
+    for (; n >= 16; n -= 16, r0 += 32, r1 += 32, d += 16) {
+        uint8x16x2_t a = vld2q_u8(r0);
+        uint8x16x2_t b = vld2q_u8(r1);
+
+        vst1q_u8(d, vrhaddq_u8(vrhaddq_u8(a.val[0], b.val[0]), vrhaddq_u8(a.val[1], b.val[1])));
+    }
+    halve_c(d, r0, r1, n);
+}
+#endif
+
+static const struct pack_kernels all_kernels[] = {
+#if defined(PACK_AVX2)
+    { "avx2", avx2_usable, interleave_avx2, deinterleave_avx2, yuyv_avx2, halve_avx2 },
+#endif
+#if defined(__SSE2__)
+    { "sse2", always, interleave_sse2, deinterleave_sse2, yuyv_sse2, halve_sse2 },
+#endif
+#if defined(__ARM_NEON)
+    { "neon", always, interleave_neon, deinterleave_neon, yuyv_neon, halve_neon },
+#endif
+    { "scalar", always, interleave_c, deinterleave_c, yuyv_c, halve_c },
+};
+
+#define N_KERNELS (sizeof(all_kernels) / sizeof(all_kernels[0]))
+
+static const struct pack_kernels *kernels;
+
+static const struct pack_kernels *active_kernels(void)
+{
+    if (!kernels)
+        pack_use_kernels(NULL);
+    return kernels;
+}
+
+const char *pack_kernel_name(unsigned int i)
+{
+    unsigned int k;
+
+    for (k = 0; k < N_KERNELS; ++k)
+        if (all_kernels[k].usable() && !i--)
+            return all_kernels[k].name;
+    return NULL;
+}
+
+const char *pack_kernels_in_use(void)
+{
+    return active_kernels()->name;
+}
+
+int pack_use_kernels(const char *name)
+{
+    unsigned int k;
+
+    for (k = 0; k < N_KERNELS; ++k) {
+        if (all_kernels[k].usable() && (!name || !strcmp(name, all_kernels[k].name))) {
+            kernels = &all_kernels[k];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int pack_set_output(struct pack_layout *l, uint32_t pixelformat, unsigned int scale)
+{
+    size_t cw = (l->width + 1) / 2, ch = (l->height + 1) / 2;
+
+    switch (l->pixelformat) {
+    case V4L2_PIX_FMT_NV12:
+    case V4L2_PIX_FMT_NV12M:
+    case V4L2_PIX_FMT_YUV420:
+    case V4L2_PIX_FMT_YUV420M:
+        l->uv_swap = 0;
+        break;
+    case V4L2_PIX_FMT_NV21:
+    case V4L2_PIX_FMT_NV21M:
+    case V4L2_PIX_FMT_YVU420:
+    case V4L2_PIX_FMT_YVU420M:
+        l->uv_swap = 1;
+        break;
+    default:
+        return -1;
+    }
+
+    switch (pixelformat) {
+    case V4L2_PIX_FMT_YUV420:
+    case V4L2_PIX_FMT_NV12:
+        l->frame_bytes = (size_t)l->width * l->height + 2 * cw * ch;
+        break;
+    case V4L2_PIX_FMT_YUYV:
+        l->frame_bytes = 4 * cw * l->height;
+        break;
+    case V4L2_PIX_FMT_GREY:
+        if (!scale || scale > 8 || (scale & (scale - 1)) || l->width < scale || l->height < scale)
+            return -1;
+        l->frame_bytes = (size_t)(l->width / scale) * (l->height / scale);
+        break;
+    default:
+        return -1;
+    }
+
+    l->out_pixelformat = pixelformat;
+    l->scale = pixelformat == V4L2_PIX_FMT_GREY ? scale : 1;
+    return 0;
+}
+
+/* Plain copy of the rows of a component */
+static unsigned char *copy_comp(unsigned char *d, const struct pack_comp *pc,
+                                const unsigned char *const *src)
+{
+    const unsigned char *s = src[pc->plane] + pc->offset;
+    unsigned int r;
+
+    for (r = 0; r < pc->rows; ++r, s += pc->stride, d += pc->row_bytes)
+        copy_row(d, s, pc->row_bytes);
+    return d;
+}
+
+/*
+ * Luma box filtered down by scale: each output row halves scale input rows
+ * pairwise, then halves the results again until one row is left.
+ */
+static void grey_frame(const struct pack_layout *l, const struct pack_kernels *k,
+                       const unsigned char *const *src, unsigned char *d)
+{
+    const struct pack_comp *yc = &l->comp[0];
+    const unsigned char *y = src[yc->plane] + yc->offset;
+    unsigned int s = l->scale, ow = l->width / s, oh = l->height / s, r, i, n;
+    unsigned char tmp[2][s > 1 ? s / 2 * (l->width / 2) : 1];
+
+    for (r = 0; r < oh; ++r, d += ow) {
+        const unsigned char *rows = y + (size_t)r * s * yc->stride;
+        size_t w = l->width / 2, stride = yc->stride;
+        unsigned char *out = tmp[0];
+
+        if (s == 1) {
+            copy_row(d, rows, ow);
+            continue;
+        }
+        for (n = s; n > 1; n /= 2, w /= 2) {
+            if (n == 2)
+                out = d;
+            for (i = 0; i < n / 2; ++i)
+                k->halve(out + i * w, rows + 2 * i * stride, rows + (2 * i + 1) * stride, w);
+            rows   = out;
+            stride = w;
+            out    = out == tmp[0] ? tmp[1] : tmp[0];
+        }
+    }
+}
+
+static size_t convert_frame(const struct pack_layout *l, const unsigned char *const *src,
+                            unsigned char *dst)
+{
+    const struct pack_kernels *k = active_kernels();
+    const struct pack_comp *yc = &l->comp[0];
+    const struct pack_comp *uc = &l->comp[l->uv_swap && l->n_comp == 3 ? 2 : 1];
+    const struct pack_comp *vc = &l->comp[l->uv_swap ? 1 : 2];
+    const unsigned char *y = src[yc->plane] + yc->offset;
+    const unsigned char *u = src[uc->plane] + uc->offset;
+    const unsigned char *v = l->n_comp == 3 ? src[vc->plane] + vc->offset : NULL;
+    size_t w = l->width, cw = (w + 1) / 2, ch = (l->height + 1) / 2, r;
+    unsigned char tmp[2][2 * cw];
+    unsigned char *d = dst;
+
+    switch (l->out_pixelformat) {
+    case V4L2_PIX_FMT_YUV420:
+        d = copy_comp(d, yc, src);
+        if (v) {
+            d = copy_comp(d, uc, src);
+            d = copy_comp(d, vc, src);
+            break;
+        }
+        for (r = 0; r < ch; ++r, u += uc->stride) {
+            if (l->uv_swap)
+                k->deinterleave(d + cw * ch + r * cw, d + r * cw, u, cw);
+            else
+                k->deinterleave(d + r * cw, d + cw * ch + r * cw, u, cw);
+        }
+        d += 2 * cw * ch;
+        break;
+
+    case V4L2_PIX_FMT_NV12:
+        d = copy_comp(d, yc, src);
+        for (r = 0; r < ch; ++r, d += 2 * cw) {
+            if (v) {
+                k->interleave(d, u + r * uc->stride, v + r * vc->stride, cw);
+            } else if (l->uv_swap) {
+                k->deinterleave(tmp[1] + cw, tmp[1], u + r * uc->stride, cw);
+                k->interleave(d, tmp[1], tmp[1] + cw, cw);
+            } else {
+                /* NV12M, already in order */
+                copy_row(d, u + r * uc->stride, 2 * cw);
+            }
+        }
+        break;
+
+    case V4L2_PIX_FMT_YUYV:
+        for (r = 0; r < l->height; ++r, y += yc->stride, d += 4 * cw) {
+            const unsigned char *uv = u + r / 2 * uc->stride;
+
+            /* One chroma row serves two luma rows; it has to be CbCr. */
+            if (v || l->uv_swap) {
+                if (!(r & 1) && v) {
+                    k->interleave(tmp[0], uv, v + r / 2 * vc->stride, cw);
+                } else if (!(r & 1)) {
+                    k->deinterleave(tmp[1] + cw, tmp[1], uv, cw);
+                    k->interleave(tmp[0], tmp[1], tmp[1] + cw, cw);
+                }
+                uv = tmp[0];
+            }
+            k->yuyv(d, y, uv, w / 2);
+            if (w & 1) {
+                d[4 * cw - 4] = d[4 * cw - 2] = y[w - 1];
+                d[4 * cw - 3] = uv[2 * cw - 2];
+                d[4 * cw - 1] = uv[2 * cw - 1];
+            }
+        }
+        break;
+
+    case V4L2_PIX_FMT_GREY:
+        grey_frame(l, k, src, d);
+        d += l->frame_bytes;
+        break;
+    }
+
+    return d - dst;
+}
+
+size_t pack_frame(const struct pack_layout *l, const unsigned char *const *src,
+                  const size_t *len, unsigned char *dst, int nt)
+{
+    unsigned char *d = dst;
+    unsigned int c, p, r;
+
+    for (p = 0; p < l->n_planes; ++p)
+        if (len[p] < l->plane_bytes[p])
+            return 0;
+
+    if (l->out_pixelformat != l->pixelformat || l->scale != 1)
+        return convert_frame(l, src, dst);
+
+    for (c = 0; c < l->n_comp; ++c) {
+        const struct pack_comp *pc = &l->comp[c];
+        const unsigned char *s = src[pc->plane] + pc->offset;
+
+        /* Rows without padding are one run. */
+        if (pc->stride == pc->row_bytes) {
+            if (nt)
+                copy_row_nt(d, s, pc->row_bytes * pc->rows);
+            else
+                copy_row(d, s, pc->row_bytes * pc->rows);
+            d += pc->row_bytes * pc->rows;
+            continue;
+        }
+
+        for (r = 0; r < pc->rows; ++r, s += pc->stride, d += pc->row_bytes) {
+            if (nt)
+                copy_row_nt(d, s, pc->row_bytes);
+            else
+                copy_row(d, s, pc->row_bytes);
+        }
+    }
+
+#if defined(__SSE2__)
+    if (nt)
+        _mm_sfence();
+#endif
+    return d - dst;
+}
@@ -0,0 +1,84 @@
+/*
+ *  Packing of decoded frames into their visible pixels
+ *
+ *  This program can be used and distributed without restrictions.
+ *
+ * Decoders hand back frames with each row padded out to bytesperline and the
+ * planes sized for the coded height, which is usually a few rows more than
+ * the picture. pack_layout() works out where the visible rows of each plane
+ * are for a format and visible rectangle, and pack_frame() copies just those
+ * rows, back to back, so a frame comes out at exactly the size of its pixels.
+ *
+ * pack_set_output() turns the copy into a conversion from 4:2:0 to another
+ * layout, done in the same pass over the frame. The row kernels come in
+ * scalar, SSE2, AVX2 and NEON versions; the best one the CPU runs is used
+ * unless pack_use_kernels() picks another, and they all give the same bytes.
+ */
+
+#ifndef PACK_H
+#define PACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <linux/videodev2.h>
+
+/* Rows of one component (Y, CbCr, Cb or Cr) of the frame */
+struct pack_comp {
+    unsigned int    plane;      /* buffer plane they are in */
+    size_t          offset;     /* of the first visible byte in the plane */
+    size_t          stride;
+    size_t          row_bytes;  /* visible bytes in a row */
+    unsigned int    rows;
+};
+
+struct pack_layout {
+    uint32_t        pixelformat;
+    uint32_t        out_pixelformat;    /* what pack_frame() writes */
+    unsigned int    scale;      /* GREY output is 1/scale of the visible size */
+    int             uv_swap;    /* the source has Cr before Cb */
+    unsigned int    width;      /* visible size */
+    unsigned int    height;
+    unsigned int    n_comp;
+    struct pack_comp comp[3];
+    unsigned int    n_planes;
+    size_t          plane_bytes[VIDEO_MAX_PLANES];  /* needed in each plane */
+    size_t          frame_bytes;    /* of the output */
+};
+
+/* Bytes per pixel of the first plane of pixelformat, 0 if it isn't known. */
+unsigned int pack_bpp(uint32_t pixelformat);
+
+/*
+ * Lay out frames of fmt, a CAPTURE format, cropped to visible; a NULL or
+ * unusable visible means the whole format. Returns -1 for a pixel format
+ * that can't be packed.
+ */
+int pack_layout(struct pack_layout *l, const struct v4l2_format *fmt,
+                const struct v4l2_rect *visible);
+
+/*
+ * Write frames as pixelformat instead: YUV420, NV12, YUYV (chroma rows
+ * repeated) or GREY, which is only the luma, box filtered down by scale, a
+ * power of two up to 8. Returns -1 unless the frames are 8 bit 4:2:0.
+ */
+int pack_set_output(struct pack_layout *l, uint32_t pixelformat, unsigned int scale);
+
+/*
+ * Pack a frame whose planes start at src[] and hold len[] bytes into dst,
+ * which has room for l->frame_bytes. With nt the stores bypass the cache,
+ * where the CPU can do that; conversions ignore it. Returns the bytes
+ * packed, or 0 if a plane is too short to hold the frame, as an empty LAST
+ * buffer is.
+ */
+size_t pack_frame(const struct pack_layout *l, const unsigned char *const *src,
+                  const size_t *len, unsigned char *dst, int nt);
+
+/* The kernels the CPU can run, best first: NULL past the last, "scalar". */
+const char *pack_kernel_name(unsigned int i);
+const char *pack_kernels_in_use(void);
+
+/* Use the named kernels, or the best with NULL. Returns -1 if they can't run. */
+int pack_use_kernels(const char *name);
+
+#endif
@@ -0,0 +1,531 @@
+/*
+ *  ioctl trace recording and replay
+ *
+ *  This program can be used and distributed without restrictions.
+ *
+ * Replay doesn't model the driver, it hands back recorded results. A call is
+ * matched against the unconsumed records up to the next wait with the same
+ * request and queue, so calls the writer thread reorders still line up.
+ * Anything without a match is counted as a divergence: DQBUF and DQEVENT
+ * then report nothing to dequeue and everything else succeeds untouched.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+
+#include <linux/videodev2.h>
+
+#include "trace.h"
+
+#define CLEAR(x) memset(&(x), 0, sizeof(x))
+#define REPLAY_MAX_FDS 1024
+#define TRACE_ALIGN(n)  (((n) + 7) & ~(size_t)7)
+
+static FILE *trace_fp;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t trace_start_ns;
+
+struct replay {
+    pthread_mutex_t lock;
+    int             fd;             /* memfd that mmap() is pointed at */
+    int             timer_fd;
+    int             fast;
+    unsigned char  *map;
+    size_t          map_len;
+    const struct trace_record **recs;
+    unsigned char  *consumed;
+    size_t          n;
+    size_t          pos;            /* first unconsumed record */
+    uint64_t        start_ns;
+    uint64_t        base_ns;        /* trace time of the first record */
+    off_t           mem_size;
+    unsigned long   userptr[2][VIDEO_MAX_FRAME][VIDEO_MAX_PLANES];
+    unsigned long   diverged;
+};
+
+static struct replay *replays[REPLAY_MAX_FDS];
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int is_buf_ioctl(unsigned int request)
+{
+    return request == VIDIOC_QBUF || request == VIDIOC_DQBUF ||
+           request == VIDIOC_QUERYBUF || request == VIDIOC_PREPARE_BUF;
+}
+
+/* Planes following a v4l2_buffer in a record */
+static unsigned int buf_planes(const struct v4l2_buffer *b)
+{
+    if (!V4L2_TYPE_IS_MULTIPLANAR(b->type) || !b->m.planes)
+        return 0;
+    return b->length < VIDEO_MAX_PLANES ? b->length : VIDEO_MAX_PLANES;
+}
+
+/* What tells two calls with the same request apart, usually the queue */
+static uint32_t call_key(unsigned int request, const void *arg)
+{
+    switch (request) {
+    case VIDIOC_QBUF:
+    case VIDIOC_DQBUF:
+    case VIDIOC_QUERYBUF:
+    case VIDIOC_PREPARE_BUF:
+        return ((const struct v4l2_buffer *)arg)->type;
+    case VIDIOC_G_FMT:
+    case VIDIOC_S_FMT:
+    case VIDIOC_TRY_FMT:
+        return ((const struct v4l2_format *)arg)->type;
+    case VIDIOC_REQBUFS:
+        return ((const struct v4l2_requestbuffers *)arg)->type;
+    case VIDIOC_CREATE_BUFS:
+        return ((const struct v4l2_create_buffers *)arg)->format.type;
+    case VIDIOC_EXPBUF:
+        return ((const struct v4l2_exportbuffer *)arg)->type;
+    case VIDIOC_STREAMON:
+    case VIDIOC_STREAMOFF:
+        return *(const int *)arg;
+    case VIDIOC_G_CTRL:
+        return ((const struct v4l2_control *)arg)->id;
+    case VIDIOC_G_SELECTION:
+        return ((const struct v4l2_selection *)arg)->target;
+    case VIDIOC_SUBSCRIBE_EVENT:
+        return ((const struct v4l2_event_subscription *)arg)->type;
+    default:
+        return 0;
+    }
+}
+
+static void write_record(struct trace_record *rec, const void *arg, size_t size,
+                         const void *extra, size_t extra_size)
+{
+    static const char pad[8];
+    size_t len = size + extra_size;
+
+    pthread_mutex_lock(&trace_lock);
+    /* trace_stop() runs at exit while other threads may still be in ioctls. */
+    if (!trace_fp) {
+        pthread_mutex_unlock(&trace_lock);
+        return;
+    }
+    rec->ns  = now_ns() - trace_start_ns;
+    rec->len = len;
+    fwrite(rec, sizeof(*rec), 1, trace_fp);
+    if (size)
+        fwrite(arg, size, 1, trace_fp);
+    if (extra_size)
+        fwrite(extra, extra_size, 1, trace_fp);
+    fwrite(pad, TRACE_ALIGN(len) - len, 1, trace_fp);
+    pthread_mutex_unlock(&trace_lock);
+}
+
+int trace_start(const char *path)
+{
+    struct trace_header hdr;
+
+    trace_fp = fopen(path, "wb");
+    if (!trace_fp)
+        return -1;
+    setvbuf(trace_fp, NULL, _IOFBF, 1 << 20);
+
+    CLEAR(hdr);
+    memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+    hdr.version = TRACE_VERSION;
+    fwrite(&hdr, sizeof(hdr), 1, trace_fp);
+
+    trace_start_ns = now_ns();
+    /* Keep the trace of a run that dies in errno_exit(). */
+    atexit(trace_stop);
+    return 0;
+}
+
+void trace_stop(void)
+{
+    pthread_mutex_lock(&trace_lock);
+    if (trace_fp) {
+        if (fclose(trace_fp))
+            fprintf(stderr, "Writing the ioctl trace failed: %s\n", strerror(errno));
+        trace_fp = NULL;
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+int trace_enabled(void)
+{
+    return trace_fp != NULL;
+}
+
+void trace_ioctl(int fd, unsigned long request, const void *arg, int result, int err)
+{
+    struct trace_record rec;
+    size_t extra = 0;
+
+    CLEAR(rec);
+    rec.request = request;
+    rec.fd      = fd;
+    rec.result  = result;
+    rec.err     = -1 == result ? err : 0;
+
+    if (is_buf_ioctl(request))
+        extra = buf_planes(arg) * sizeof(struct v4l2_plane);
+    write_record(&rec, arg, _IOC_SIZE(request), extra ? ((const struct v4l2_buffer *)arg)->m.planes : NULL, extra);
+}
+
+void trace_wait(int fd, uint32_t events)
+{
+    struct trace_record rec;
+
+    CLEAR(rec);
+    rec.fd     = fd;
+    rec.result = events;
+    write_record(&rec, NULL, 0, NULL, 0);
+}
+
+/* Load the records of the first fd in the trace at path. */
+static int replay_load(struct replay *rp, const char *path)
+{
+    const struct trace_header *hdr;
+    struct stat st;
+    size_t off, alloc = 0;
+    int32_t dev_fd = -1;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (-1 == fd)
+        return -1;
+    if (-1 == fstat(fd, &st)) {
+        close(fd);
+        return -1;
+    }
+    if ((size_t)st.st_size < sizeof(*hdr)) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    rp->map_len = st.st_size;
+    rp->map = mmap(NULL, rp->map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (MAP_FAILED == rp->map)
+        return -1;
+
+    hdr = (const struct trace_header *)rp->map;
+    if (memcmp(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic)) || hdr->version != TRACE_VERSION) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (off = sizeof(*hdr); off + sizeof(struct trace_record) <= rp->map_len; ) {
+        const struct trace_record *rec = (const struct trace_record *)(rp->map + off);
+
+        if (off + sizeof(*rec) + rec->len > rp->map_len)
+            break;      /* cut short by a crash */
+        off += sizeof(*rec) + TRACE_ALIGN(rec->len);
+
+        if (-1 == dev_fd)
+            dev_fd = rec->fd;
+        if (rec->fd != dev_fd)
+            continue;
+
+        if (rp->n == alloc) {
+            alloc = alloc ? 2 * alloc : 4096;
+            rp->recs = realloc(rp->recs, alloc * sizeof(*rp->recs));
+            if (!rp->recs) {
+                fprintf(stderr, "Out of memory\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        rp->recs[rp->n++] = rec;
+    }
+
+    rp->consumed = calloc(rp->n ? rp->n : 1, 1);
+    if (!rp->consumed) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    rp->base_ns = rp->n ? rp->recs[0]->ns : 0;
+    return 0;
+}
+
+static void consume(struct replay *rp, size_t i)
+{
+    rp->consumed[i] = 1;
+    while (rp->pos < rp->n && rp->consumed[rp->pos])
+        rp->pos++;
+}
+
+/* Next wait record, or n */
+static size_t next_wait(const struct replay *rp)
+{
+    size_t i;
+
+    for (i = rp->pos; i < rp->n; ++i)
+        if (!rp->recs[i]->request && !rp->consumed[i])
+            break;
+    return i;
+}
+
+/* Arm the timer for the next wait, or disarm it at the end of the trace. */
+static void arm(struct replay *rp)
+{
+    struct itimerspec its;
+    size_t w = next_wait(rp);
+    int flags = 0;
+
+    CLEAR(its);
+    if (w < rp->n) {
+        uint64_t due = rp->start_ns + rp->recs[w]->ns - rp->base_ns;
+
+        if (rp->fast) {
+            its.it_value.tv_nsec = 1;
+        } else {
+            its.it_value.tv_sec  = due / 1000000000ULL;
+            its.it_value.tv_nsec = due % 1000000000ULL;
+            if (!due)
+                its.it_value.tv_nsec = 1;
+            flags = TFD_TIMER_ABSTIME;
+        }
+    }
+    timerfd_settime(rp->timer_fd, flags, &its, NULL);
+}
+
+int replay_open(const char *spec)
+{
+    struct replay *rp = calloc(1, sizeof(*rp));
+    char *path = strdup(spec);
+    char *comma;
+
+    if (!rp || !path) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    comma = strrchr(path, ',');
+    if (comma && !strcmp(comma, ",fast")) {
+        *comma = '\0';
+        rp->fast = 1;
+    }
+
+    if (replay_load(rp, path)) {
+        fprintf(stderr, "Cannot load trace '%s': %d, %s\n", path, errno, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    free(path);
+
+    rp->fd = memfd_create("m2m-replay", MFD_CLOEXEC);
+    if (-1 == rp->fd)
+        return -1;
+    rp->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (-1 == rp->timer_fd || rp->fd >= REPLAY_MAX_FDS) {
+        if (-1 != rp->timer_fd)
+            close(rp->timer_fd);
+        close(rp->fd);
+        errno = EMFILE;
+        return -1;
+    }
+
+    pthread_mutex_init(&rp->lock, NULL);
+    rp->start_ns = now_ns();
+    replays[rp->fd] = rp;
+    arm(rp);
+    return rp->fd;
+}
+
+void replay_close(int fd)
+{
+    struct replay *rp = replays[fd];
+
+    if (rp->diverged || rp->pos < rp->n)
+        fprintf(stderr, "replay: %lu calls diverged from the trace, %zu of %zu records unused\n",
+                rp->diverged, rp->n - rp->pos, rp->n);
+
+    replays[fd] = NULL;
+    close(rp->timer_fd);
+    close(rp->fd);
+    munmap(rp->map, rp->map_len);
+    free(rp->recs);
+    free(rp->consumed);
+    pthread_mutex_destroy(&rp->lock);
+    free(rp);
+}
+
+int replay_owns(int fd)
+{
+    return fd >= 0 && fd < REPLAY_MAX_FDS && replays[fd];
+}
+
+int replay_wait_fd(int fd)
+{
+    return replays[fd]->timer_fd;
+}
+
+/* Unconsumed record before the next wait for the same call, or n */
+static size_t find_call(const struct replay *rp, unsigned int request, const void *arg)
+{
+    uint32_t key = call_key(request, arg);
+    size_t i;
+
+    for (i = rp->pos; i < rp->n && rp->recs[i]->request; ++i) {
+        const struct trace_record *rec = rp->recs[i];
+
+        if (!rp->consumed[i] && rec->request == request &&
+            rec->len >= _IOC_SIZE(request) && call_key(request, rec + 1) == key)
+            return i;
+    }
+    return rp->n;
+}
+
+/* Copy a recorded v4l2_buffer back, keeping the caller's pointers. */
+static void apply_buf(struct replay *rp, const struct trace_record *rec, struct v4l2_buffer *b)
+{
+    const struct v4l2_buffer *rb = (const struct v4l2_buffer *)(rec + 1);
+    const struct v4l2_plane *rplanes = (const struct v4l2_plane *)(rb + 1);
+    struct v4l2_plane *planes = b->m.planes;
+    unsigned int length = b->length, n = 0, p;
+    unsigned long (*userptr)[VIDEO_MAX_PLANES];
+    off_t end;
+
+    *b = *rb;
+    if (b->index >= VIDEO_MAX_FRAME)
+        return;
+    userptr = &rp->userptr[V4L2_TYPE_IS_OUTPUT(b->type)][b->index];
+
+    if (V4L2_TYPE_IS_MULTIPLANAR(b->type)) {
+        n = (rec->len - sizeof(*rb)) / sizeof(*rplanes);
+        if (n > length)
+            n = length;
+        b->m.planes = planes;
+        memcpy(planes, rplanes, n * sizeof(*planes));
+        for (p = 0; p < n; ++p) {
+            if (b->memory == V4L2_MEMORY_USERPTR)
+                planes[p].m.userptr = (*userptr)[p];
+            end = (off_t)planes[p].m.mem_offset + planes[p].length;
+            if (b->memory == V4L2_MEMORY_MMAP && end > rp->mem_size)
+                rp->mem_size = end;
+        }
+    } else {
+        if (b->memory == V4L2_MEMORY_USERPTR)
+            b->m.userptr = (*userptr)[0];
+        end = (off_t)b->m.offset + b->length;
+        if (b->memory == V4L2_MEMORY_MMAP && end > rp->mem_size)
+            rp->mem_size = end;
+    }
+}
+
+static int replay_call(struct replay *rp, unsigned long request, void *arg)
+{
+    const struct trace_record *rec;
+    off_t mem_size = rp->mem_size;
+    size_t i;
+
+    /* Where the caller's USERPTR buffers are, to hand back on DQBUF */
+    if (request == VIDIOC_QBUF && ((struct v4l2_buffer *)arg)->memory == V4L2_MEMORY_USERPTR) {
+        struct v4l2_buffer *b = arg;
+        unsigned int p;
+
+        if (b->index < VIDEO_MAX_FRAME) {
+            unsigned long *userptr = rp->userptr[V4L2_TYPE_IS_OUTPUT(b->type)][b->index];
+
+            if (V4L2_TYPE_IS_MULTIPLANAR(b->type)) {
+                for (p = 0; p < buf_planes(b); ++p)
+                    userptr[p] = b->m.planes[p].m.userptr;
+            } else {
+                userptr[0] = b->m.userptr;
+            }
+        }
+    }
+
+    i = find_call(rp, request, arg);
+    if (i == rp->n) {
+        rp->diverged++;
+        if (request == VIDIOC_DQBUF)
+            return EAGAIN;
+        if (request == VIDIOC_DQEVENT)
+            return ENOENT;
+        return 0;
+    }
+    rec = rp->recs[i];
+    consume(rp, i);
+
+    if (_IOC_DIR(request) & _IOC_READ) {
+        if (is_buf_ioctl(request))
+            apply_buf(rp, rec, arg);
+        else
+            memcpy(arg, rec + 1, _IOC_SIZE(request));
+    }
+
+    if (mem_size != rp->mem_size && -1 == ftruncate(rp->fd, rp->mem_size))
+        return errno;
+
+    /* Exported buffers are stood in for by empty memfds. */
+    if (request == VIDIOC_EXPBUF && 0 == rec->result) {
+        struct v4l2_exportbuffer *exp = arg;
+
+        exp->fd = memfd_create("m2m-replay-expbuf", MFD_CLOEXEC);
+        if (-1 == exp->fd)
+            return errno;
+    }
+
+    return -1 == rec->result ? rec->err : 0;
+}
+
+int replay_ioctl(int fd, unsigned long request, void *arg)
+{
+    struct replay *rp = replays[fd];
+    int err;
+
+    pthread_mutex_lock(&rp->lock);
+    err = replay_call(rp, request, arg);
+    pthread_mutex_unlock(&rp->lock);
+
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+uint32_t replay_poll(int fd)
+{
+    struct replay *rp = replays[fd];
+    uint64_t expirations;
+    uint32_t events = 0;
+    size_t w, i;
+
+    pthread_mutex_lock(&rp->lock);
+    if (read(rp->timer_fd, &expirations, sizeof(expirations)) > 0) {
+        w = next_wait(rp);
+        if (w < rp->n) {
+            /* Calls the recording made that this run didn't */
+            for (i = rp->pos; i < w; ++i) {
+                if (!rp->consumed[i]) {
+                    rp->diverged++;
+                    rp->consumed[i] = 1;
+                }
+            }
+            events = rp->recs[w]->result;
+            consume(rp, w);
+        }
+        arm(rp);
+    }
+    pthread_mutex_unlock(&rp->lock);
+
+    return events;
+}
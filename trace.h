@@ -0,0 +1,61 @@
+/*
+ *  ioctl trace recording and replay
+ *
+ *  This program can be used and distributed without restrictions.
+ *
+ * With tracing on, xioctl() appends every call to a trace file, and the
+ * main loop adds a wait record each time it acts on a device's readiness.
+ * A trace is replayed by opening "replay:path" as the device: it answers
+ * the first device's ioctls from the trace and becomes ready when the
+ * recording did, so the queues see the same dynamics without the hardware.
+ * Calls are matched in one sequence, so only sessions that make them all
+ * from the main loop can be traced: not with -t, -w or -U.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#define TRACE_MAGIC     "M2MTRACE"
+#define TRACE_VERSION   1
+
+/*
+ * File layout: struct trace_header, then records. Each record is followed by
+ * len bytes, the ioctl argument as it was after the call and, for
+ * multi-planar buffer ioctls, its length planes.
+ */
+struct trace_header {
+    char        magic[8];
+    uint32_t    version;
+    uint32_t    reserved;
+};
+
+struct trace_record {
+    uint64_t    ns;         /* since the trace was started */
+    uint32_t    request;    /* 0 for a wait */
+    int32_t     fd;
+    int32_t     result;     /* ioctl return value, or the epoll events of a wait */
+    int32_t     err;        /* errno when result is -1 */
+    uint32_t    len;
+    uint32_t    reserved;
+};
+
+int trace_start(const char *path);
+void trace_stop(void);
+int trace_enabled(void);
+void trace_ioctl(int fd, unsigned long request, const void *arg, int result, int err);
+void trace_wait(int fd, uint32_t events);
+
+/*
+ * spec is the trace path, optionally followed by ",fast" to replay without
+ * the recorded delays.
+ */
+int replay_open(const char *spec);
+void replay_close(int fd);
+int replay_owns(int fd);
+int replay_ioctl(int fd, unsigned long request, void *arg);
+int replay_wait_fd(int fd);
+uint32_t replay_poll(int fd);
+
+#endif
@@ -0,0 +1,534 @@
+/*
+ *  Asynchronous file i/o on io_uring, or on a thread without it
+ *
+ *  This program can be used and distributed without restrictions.
+ *
+ * The io_uring backend talks to the kernel directly rather than through
+ * liburing: one submission and completion ring, mapped once, with an eventfd
+ * registered for completions. The thread backend keeps requests and
+ * completions in two rings of its own under one lock and signals the same
+ * kind of eventfd, so callers can't tell them apart.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <linux/io_uring.h>
+
+#include "uring.h"
+
+#define CLEAR(x) memset(&(x), 0, sizeof(x))
+
+/* A request queued for the thread backend */
+struct uring_req {
+    int             write;
+    int             fd;
+    void           *buf;
+    size_t          len;
+    uint64_t        offset;
+    uint64_t        tag;
+};
+
+struct uring_done {
+    uint64_t        tag;
+    int             res;
+};
+
+struct uring {
+    int             ring_fd;        /* -1 when requests go to the thread */
+    int             event_fd;
+    unsigned int    depth;          /* power of two */
+
+    /* io_uring */
+    void           *sq_ring;
+    void           *cq_ring;
+    size_t          sq_ring_len;
+    size_t          cq_ring_len;
+    struct io_uring_sqe *sqes;
+    size_t          sqes_len;
+    unsigned int   *sq_head;
+    unsigned int   *sq_tail;
+    unsigned int   *sq_mask;
+    unsigned int   *sq_array;
+    unsigned int    sq_entries;
+    unsigned int   *cq_head;
+    unsigned int   *cq_tail;
+    unsigned int   *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned int    to_submit;
+    int             registered;
+
+    /* thread */
+    pthread_t       thread;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    struct uring_req  *reqs;
+    unsigned int    req_head;       /* queued by the caller */
+    unsigned int    req_ready;      /* submitted to the thread */
+    unsigned int    req_tail;       /* taken by the thread */
+    struct uring_done *done;
+    unsigned int    done_head;
+    unsigned int    done_tail;
+    int             stop;
+};
+
+static void uring_exit(const char *s)
+{
+    fprintf(stderr, "%s error %d, %s\n", s, errno, strerror(errno));
+    exit(EXIT_FAILURE);
+}
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+                              unsigned int flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode, const void *arg,
+                                 unsigned int nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* Plain and fixed reads and writes all have to be there. */
+static int ring_probe(struct uring *u)
+{
+    static const unsigned char ops[] = {
+        IORING_OP_READ, IORING_OP_WRITE, IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED,
+    };
+    struct io_uring_probe *probe;
+    size_t len = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+    unsigned int i;
+    int ok = 0;
+
+    probe = calloc(1, len);
+    if (!probe) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (!sys_io_uring_register(u->ring_fd, IORING_REGISTER_PROBE, probe, 256)) {
+        ok = 1;
+        for (i = 0; i < sizeof(ops); ++i) {
+            if (ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+                ok = 0;
+        }
+    }
+
+    free(probe);
+    return ok;
+}
+
+static void ring_teardown(struct uring *u)
+{
+    if (u->sqes)
+        munmap(u->sqes, u->sqes_len);
+    if (u->cq_ring && u->cq_ring != u->sq_ring)
+        munmap(u->cq_ring, u->cq_ring_len);
+    if (u->sq_ring)
+        munmap(u->sq_ring, u->sq_ring_len);
+    if (u->ring_fd >= 0)
+        close(u->ring_fd);
+
+    u->sqes    = NULL;
+    u->cq_ring = NULL;
+    u->sq_ring = NULL;
+    u->ring_fd = -1;
+}
+
+static int ring_setup(struct uring *u)
+{
+    struct io_uring_params p;
+    unsigned char *sq, *cq;
+
+    CLEAR(p);
+    u->ring_fd = sys_io_uring_setup(u->depth, &p);
+    if (-1 == u->ring_fd)
+        return -1;
+
+    u->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    u->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_ring_len > u->sq_ring_len)
+            u->sq_ring_len = u->cq_ring_len;
+        u->cq_ring_len = u->sq_ring_len;
+    }
+
+    u->sq_ring = mmap(NULL, u->sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      u->ring_fd, IORING_OFF_SQ_RING);
+    if (MAP_FAILED == u->sq_ring) {
+        u->sq_ring = NULL;
+        goto fail;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        u->cq_ring = u->sq_ring;
+    } else {
+        u->cq_ring = mmap(NULL, u->cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          u->ring_fd, IORING_OFF_CQ_RING);
+        if (MAP_FAILED == u->cq_ring) {
+            u->cq_ring = NULL;
+            goto fail;
+        }
+    }
+
+    u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   u->ring_fd, IORING_OFF_SQES);
+    if (MAP_FAILED == u->sqes) {
+        u->sqes = NULL;
+        goto fail;
+    }
+
+    sq = u->sq_ring;
+    cq = u->cq_ring;
+    u->sq_head    = (unsigned int *)(sq + p.sq_off.head);
+    u->sq_tail    = (unsigned int *)(sq + p.sq_off.tail);
+    u->sq_mask    = (unsigned int *)(sq + p.sq_off.ring_mask);
+    u->sq_array   = (unsigned int *)(sq + p.sq_off.array);
+    u->sq_entries = p.sq_entries;
+    u->cq_head    = (unsigned int *)(cq + p.cq_off.head);
+    u->cq_tail    = (unsigned int *)(cq + p.cq_off.tail);
+    u->cq_mask    = (unsigned int *)(cq + p.cq_off.ring_mask);
+    u->cqes       = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    if (!ring_probe(u)) {
+        errno = EOPNOTSUPP;
+        goto fail;
+    }
+
+    if (-1 == sys_io_uring_register(u->ring_fd, IORING_REGISTER_EVENTFD, &u->event_fd, 1))
+        goto fail;
+
+    return 0;
+
+fail:
+    ring_teardown(u);
+    return -1;
+}
+
+static void ring_queue(struct uring *u, int opcode, int fd, const void *buf, size_t len,
+                       uint64_t offset, int buf_index, uint64_t tag)
+{
+    struct io_uring_sqe *sqe;
+    unsigned int tail = *u->sq_tail;
+
+    /* The caller never has more than depth requests out, but they may not be submitted yet. */
+    if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries)
+        uring_submit(u);
+
+    sqe = &u->sqes[tail & *u->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode    = opcode;
+    sqe->fd        = fd;
+    sqe->addr      = (uintptr_t)buf;
+    sqe->len       = len;
+    sqe->off       = offset;
+    sqe->buf_index = buf_index < 0 ? 0 : buf_index;
+    sqe->user_data = tag;
+
+    u->sq_array[tail & *u->sq_mask] = tail & *u->sq_mask;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    u->to_submit++;
+}
+
+static int ring_complete(struct uring *u, uint64_t *tag, int *res)
+{
+    unsigned int head = *u->cq_head;
+    struct io_uring_cqe *cqe;
+
+    if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+        return 0;
+
+    cqe  = &u->cqes[head & *u->cq_mask];
+    *tag = cqe->user_data;
+    *res = cqe->res;
+    __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+static int thread_io(const struct uring_req *r)
+{
+    size_t done = 0;
+
+    while (done < r->len) {
+        ssize_t n;
+
+        if (r->write)
+            n = pwrite(r->fd, (char *)r->buf + done, r->len - done, r->offset + done);
+        else
+            n = pread(r->fd, (char *)r->buf + done, r->len - done, r->offset + done);
+        if (-1 == n) {
+            if (EINTR == errno)
+                continue;
+            return -errno;
+        }
+        if (0 == n)
+            break;
+        done += n;
+    }
+
+    return done;
+}
+
+static void *thread_main(void *arg)
+{
+    struct uring *u = arg;
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&u->lock);
+    for (;;) {
+        struct uring_req r;
+        struct uring_done *d;
+        int res;
+
+        while (!u->stop && u->req_tail == u->req_ready)
+            pthread_cond_wait(&u->cond, &u->lock);
+        if (u->stop)
+            break;
+
+        r = u->reqs[u->req_tail++ & (u->depth - 1)];
+        pthread_mutex_unlock(&u->lock);
+
+        res = thread_io(&r);
+
+        pthread_mutex_lock(&u->lock);
+        d = &u->done[u->done_head++ & (u->depth - 1)];
+        d->tag = r.tag;
+        d->res = res;
+        if (-1 == write(u->event_fd, &one, sizeof(one)))
+            uring_exit("eventfd write");
+        pthread_cond_broadcast(&u->cond);
+    }
+    pthread_mutex_unlock(&u->lock);
+
+    return NULL;
+}
+
+static void thread_setup(struct uring *u)
+{
+    int err;
+
+    u->reqs = calloc(u->depth, sizeof(*u->reqs));
+    u->done = calloc(u->depth, sizeof(*u->done));
+    if (!u->reqs || !u->done) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_mutex_init(&u->lock, NULL);
+    pthread_cond_init(&u->cond, NULL);
+
+    err = pthread_create(&u->thread, NULL, thread_main, u);
+    if (err) {
+        errno = err;
+        uring_exit("pthread_create");
+    }
+}
+
+static void thread_queue(struct uring *u, int write, int fd, const void *buf, size_t len,
+                         uint64_t offset, uint64_t tag)
+{
+    struct uring_req *r = &u->reqs[u->req_head++ & (u->depth - 1)];
+
+    r->write  = write;
+    r->fd     = fd;
+    r->buf    = (void *)buf;
+    r->len    = len;
+    r->offset = offset;
+    r->tag    = tag;
+}
+
+struct uring *uring_open(unsigned int depth, int use_thread)
+{
+    struct uring *u;
+
+    u = calloc(1, sizeof(*u));
+    if (!u) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    u->depth = 1;
+    while (u->depth < depth)
+        u->depth <<= 1;
+    u->ring_fd = -1;
+
+    u->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (-1 == u->event_fd)
+        uring_exit("eventfd");
+
+    if (use_thread || -1 == ring_setup(u))
+        thread_setup(u);
+
+    return u;
+}
+
+void uring_close(struct uring *u)
+{
+    if (!u)
+        return;
+
+    if (u->ring_fd >= 0) {
+        ring_teardown(u);
+    } else {
+        pthread_mutex_lock(&u->lock);
+        u->stop = 1;
+        pthread_cond_broadcast(&u->cond);
+        pthread_mutex_unlock(&u->lock);
+        pthread_join(u->thread, NULL);
+        pthread_cond_destroy(&u->cond);
+        pthread_mutex_destroy(&u->lock);
+        free(u->reqs);
+        free(u->done);
+    }
+
+    close(u->event_fd);
+    free(u);
+}
+
+int uring_fd(struct uring *u)
+{
+    return u->event_fd;
+}
+
+const char *uring_backend(struct uring *u)
+{
+    return u->ring_fd >= 0 ? "io_uring" : "thread";
+}
+
+int uring_register(struct uring *u, const struct iovec *iov, unsigned int n)
+{
+    if (u->ring_fd < 0) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    uring_unregister(u);
+    if (-1 == sys_io_uring_register(u->ring_fd, IORING_REGISTER_BUFFERS, iov, n))
+        return -1;
+    u->registered = 1;
+    return 0;
+}
+
+void uring_unregister(struct uring *u)
+{
+    if (!u->registered)
+        return;
+
+    if (-1 == sys_io_uring_register(u->ring_fd, IORING_UNREGISTER_BUFFERS, NULL, 0))
+        uring_exit("IORING_UNREGISTER_BUFFERS");
+    u->registered = 0;
+}
+
+void uring_read(struct uring *u, int fd, void *buf, size_t len, uint64_t offset,
+                int buf_index, uint64_t tag)
+{
+    if (u->ring_fd < 0)
+        thread_queue(u, 0, fd, buf, len, offset, tag);
+    else
+        ring_queue(u, buf_index < 0 ? IORING_OP_READ : IORING_OP_READ_FIXED,
+                   fd, buf, len, offset, buf_index, tag);
+}
+
+void uring_write(struct uring *u, int fd, const void *buf, size_t len, uint64_t offset,
+                 int buf_index, uint64_t tag)
+{
+    if (u->ring_fd < 0)
+        thread_queue(u, 1, fd, buf, len, offset, tag);
+    else
+        ring_queue(u, buf_index < 0 ? IORING_OP_WRITE : IORING_OP_WRITE_FIXED,
+                   fd, buf, len, offset, buf_index, tag);
+}
+
+void uring_submit(struct uring *u)
+{
+    if (u->ring_fd < 0) {
+        pthread_mutex_lock(&u->lock);
+        if (u->req_ready != u->req_head) {
+            u->req_ready = u->req_head;
+            pthread_cond_broadcast(&u->cond);
+        }
+        pthread_mutex_unlock(&u->lock);
+        return;
+    }
+
+    while (u->to_submit) {
+        int n = sys_io_uring_enter(u->ring_fd, u->to_submit, 0, 0);
+
+        if (-1 == n) {
+            if (EINTR == errno)
+                continue;
+            uring_exit("io_uring_enter");
+        }
+        u->to_submit -= n;
+    }
+}
+
+/*
+ * The eventfd is only cleared once there is nothing left to reap, and the
+ * queue is looked at again after that, so a completion that races with the
+ * read still leaves the eventfd readable.
+ */
+int uring_complete(struct uring *u, uint64_t *tag, int *res)
+{
+    uint64_t count;
+    int got = 0;
+
+    if (u->ring_fd >= 0) {
+        if (ring_complete(u, tag, res))
+            return 1;
+        if (-1 == read(u->event_fd, &count, sizeof(count)) && EAGAIN != errno)
+            uring_exit("eventfd read");
+        return ring_complete(u, tag, res);
+    }
+
+    pthread_mutex_lock(&u->lock);
+    if (u->done_tail != u->done_head) {
+        struct uring_done *d = &u->done[u->done_tail++ & (u->depth - 1)];
+
+        *tag = d->tag;
+        *res = d->res;
+        got  = 1;
+    } else if (-1 == read(u->event_fd, &count, sizeof(count)) && EAGAIN != errno) {
+        uring_exit("eventfd read");
+    }
+    pthread_mutex_unlock(&u->lock);
+
+    return got;
+}
+
+void uring_wait(struct uring *u)
+{
+    uring_submit(u);
+
+    if (u->ring_fd >= 0) {
+        while (*u->cq_head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+            if (-1 == sys_io_uring_enter(u->ring_fd, 0, 1, IORING_ENTER_GETEVENTS) &&
+                EINTR != errno)
+                uring_exit("io_uring_enter");
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&u->lock);
+    while (u->done_tail == u->done_head)
+        pthread_cond_wait(&u->cond, &u->lock);
+    pthread_mutex_unlock(&u->lock);
+}
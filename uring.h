@@ -0,0 +1,52 @@
+/*
+ *  Asynchronous file i/o on io_uring, or on a thread without it
+ *
+ *  This program can be used and distributed without restrictions.
+ *
+ * Reads and writes are queued with uring_read() and uring_write(), sent to
+ * the kernel by uring_submit() and reaped with uring_complete(). uring_fd()
+ * is an eventfd that is readable while completions are waiting, so it can
+ * sit in the same epoll set as the devices. Where io_uring_setup() isn't
+ * allowed, the same calls are served by a thread doing pread() and pwrite().
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+struct uring;
+
+/*
+ * depth is the most requests that will be in flight at once. With
+ * use_thread, or if io_uring isn't available, requests go to a thread.
+ */
+struct uring *uring_open(unsigned int depth, int use_thread);
+void uring_close(struct uring *u);
+int uring_fd(struct uring *u);
+const char *uring_backend(struct uring *u);
+
+/*
+ * Register buffers for fixed reads and writes; buf_index in the calls below
+ * then refers to iov[buf_index], or is -1 for an unregistered buffer.
+ * Nothing that uses them may be in flight when they are unregistered.
+ */
+int uring_register(struct uring *u, const struct iovec *iov, unsigned int n);
+void uring_unregister(struct uring *u);
+
+void uring_read(struct uring *u, int fd, void *buf, size_t len, uint64_t offset,
+                int buf_index, uint64_t tag);
+void uring_write(struct uring *u, int fd, const void *buf, size_t len, uint64_t offset,
+                 int buf_index, uint64_t tag);
+void uring_submit(struct uring *u);
+
+/*
+ * Return 1 and the tag and result (bytes transferred or -errno) of a
+ * finished request, or 0 if none is waiting. uring_wait() blocks until one is.
+ */
+int uring_complete(struct uring *u, uint64_t *tag, int *res);
+void uring_wait(struct uring *u);
+
+#endif